@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""
+Local WS-BaseNotification consumer for testing push event delivery
+from onvif_server without a VMS.
+
+Usage:
+    python3 notify_consumer.py --port 9000
+    python3 notify_consumer.py --port 9000 --delay 0.5 --fail-rate 0.1
+
+Subscribe with a ConsumerReference of http://127.0.0.1:9000/notify, e.g.
+    python3 notify_consumer.py --subscribe http://localhost:8080/onvif/event_service
+"""
+
+import argparse
+import random
+import re
+import threading
+import time
+import urllib.request
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+TOPIC_PATTERN = re.compile(r'<wsnt:Topic[^>]*>([^<]*)</wsnt:Topic>')
+
+SUBSCRIBE_TEMPLATE = """<?xml version="1.0" encoding="UTF-8"?>
+<s:Envelope xmlns:s="http://www.w3.org/2003/05/soap-envelope"
+            xmlns:wsnt="http://docs.oasis-open.org/wsn/b-2"
+            xmlns:wsa="http://www.w3.org/2005/08/addressing">
+<s:Body>
+<wsnt:Subscribe>
+<wsnt:ConsumerReference><wsa:Address>{consumer}</wsa:Address></wsnt:ConsumerReference>
+<wsnt:InitialTerminationTime>PT{seconds}S</wsnt:InitialTerminationTime>
+</wsnt:Subscribe>
+</s:Body>
+</s:Envelope>"""
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.requests = 0
+        self.messages = 0
+        self.failed = 0
+
+
+class NotifyHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    delay = 0.0
+    fail_rate = 0.0
+    verbose = False
+    stats = Stats()
+
+    def do_POST(self):
+        length = int(self.headers.get("Content-Length", 0))
+        body = self.rfile.read(length).decode("utf-8", errors="replace")
+
+        if self.delay:
+            time.sleep(self.delay)
+
+        if random.random() < self.fail_rate:
+            with self.stats.lock:
+                self.stats.failed += 1
+            self.send_response(503)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+
+        topics = TOPIC_PATTERN.findall(body)
+        with self.stats.lock:
+            self.stats.requests += 1
+            self.stats.messages += len(topics)
+
+        if self.verbose:
+            for topic in topics:
+                print(f"Notify: {topic}")
+
+        self.send_response(200)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def log_message(self, format, *args):
+        pass
+
+
+def report(stats, interval):
+    """Print delivery statistics every interval seconds"""
+    while True:
+        time.sleep(interval)
+        with stats.lock:
+            requests, messages, failed = stats.requests, stats.messages, stats.failed
+            stats.requests = stats.messages = stats.failed = 0
+        batch = messages / requests if requests else 0
+        print(f"{messages / interval:.0f} messages/s in {requests / interval:.0f} requests/s "
+              f"(avg batch {batch:.1f}), {failed} rejected")
+
+
+def subscribe(service_url, consumer_url, seconds):
+    """Create a push subscription on the server pointing at this consumer"""
+    body = SUBSCRIBE_TEMPLATE.format(consumer=consumer_url, seconds=seconds).encode()
+    request = urllib.request.Request(service_url, data=body,
+                                     headers={"Content-Type": "application/soap+xml"})
+    with urllib.request.urlopen(request) as response:
+        reply = response.read().decode()
+    match = re.search(r'<wsa:Address>([^<]*)</wsa:Address>', reply)
+    print(f"Subscribed: {match.group(1) if match else reply}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local WS-BaseNotification consumer")
+    parser.add_argument("--port", type=int, default=9000)
+    parser.add_argument("--delay", type=float, default=0.0, help="seconds to wait before answering")
+    parser.add_argument("--fail-rate", type=float, default=0.0, help="fraction of Notify requests rejected with 503")
+    parser.add_argument("--subscribe", metavar="EVENT_SERVICE_URL", help="subscribe this consumer on startup")
+    parser.add_argument("--duration", type=int, default=3600, help="subscription lifetime in seconds")
+    parser.add_argument("--verbose", action="store_true", help="print every received topic")
+    args = parser.parse_args()
+
+    NotifyHandler.delay = args.delay
+    NotifyHandler.fail_rate = args.fail_rate
+    NotifyHandler.verbose = args.verbose
+
+    server = ThreadingHTTPServer(("127.0.0.1", args.port), NotifyHandler)
+    print(f"Consumer listening on http://127.0.0.1:{args.port}/notify")
+    threading.Thread(target=report, args=(NotifyHandler.stats, 5), daemon=True).start()
+
+    if args.subscribe:
+        subscribe(args.subscribe, f"http://127.0.0.1:{args.port}/notify", args.duration)
+
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
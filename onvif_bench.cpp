@@ -0,0 +1,385 @@
+// Microbenchmarks for onvif_server.cpp. The server source is included
+// whole, so the benchmarks reach the renderers, the parser and the
+// request path without widening the server's interface.
+//
+//     g++ -std=c++17 -O2 -pthread -o onvif_bench onvif_bench.cpp -lz -lssl -lcrypto
+//     ./onvif_bench [<iterations>]
+
+#define ONVIF_SERVER_NO_MAIN
+#include "onvif_server.cpp"
+
+class OnvifServerBench {
+public:
+    static bool run(int iterations) {
+        // Started for its listener and local address, but its loop is not
+        // run: the request path calls processInput directly
+        OnvifServer server(0);
+        if (!server.start()) {
+            return false;
+        }
+        return responses(server, iterations) && parser(iterations) && requestPath(server, iterations) &&
+               backends(iterations) && tls(iterations);
+    }
+    
+private:
+    // Times GetProfiles rendered through the XML sinks against the string
+    // concatenation it replaced, on the current configuration. Returns
+    // false if the two disagree.
+    static bool responses(OnvifServer& server, int iterations) {
+        auto config = server.mediaConfig();
+        if (server.handleGetProfiles(*config) != concatGetProfiles(*config)) {
+            std::cerr << "GetProfiles renderers disagree" << std::endl;
+            return false;
+        }
+        auto measure = [&](const char* name, auto render) {
+            size_t bytes = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                bytes += render().size();
+            }
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            std::cout << name << ": " << std::fixed << std::setprecision(0) << ns / iterations << " ns/response, "
+                      << bytes / iterations << " bytes" << std::endl;
+            return ns;
+        };
+        double concat = measure("GetProfiles concatenation", [&] { return concatGetProfiles(*config); });
+        double sinks = measure("GetProfiles XML sinks    ", [&] { return server.handleGetProfiles(*config); });
+        std::cout << "speedup " << std::setprecision(2) << concat / sinks << "x" << std::endl;
+        return true;
+    }
+    
+    // Parses a GetStreamUri request of about 2 KB with a WS-Security
+    // header, the size ONVIF clients typically send
+    static bool parser(int iterations) {
+        std::string request =
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\" "
+            "xmlns:trt=\"http://www.onvif.org/ver10/media/wsdl\" xmlns:tt=\"http://www.onvif.org/ver10/schema\">\n"
+            "<s:Header>\n"
+            "<wsse:Security s:mustUnderstand=\"1\" "
+            "xmlns:wsse=\"http://docs.oasis-open.org/wss/2004/01/oasis-200401-wss-wssecurity-secext-1.0.xsd\" "
+            "xmlns:wsu=\"http://docs.oasis-open.org/wss/2004/01/oasis-200401-wss-wssecurity-utility-1.0.xsd\">\n"
+            "<wsse:UsernameToken wsu:Id=\"UsernameToken-1\">\n"
+            "<wsse:Username>admin</wsse:Username>\n"
+            "<wsse:Password Type=\"http://docs.oasis-open.org/wss/2004/01/"
+            "oasis-200401-wss-username-token-profile-1.0#PasswordDigest\">tuOSpGlFlIXsozq4HFNeeGeFLEI=</wsse:Password>\n"
+            "<wsse:Nonce EncodingType=\"http://docs.oasis-open.org/wss/2004/01/"
+            "oasis-200401-wss-soap-message-security-1.0#Base64Binary\">LKqI6G/AikKCQrN0zqZFlg==</wsse:Nonce>\n"
+            "<wsu:Created>2024-01-01T00:00:00.000Z</wsu:Created>\n"
+            "</wsse:UsernameToken>\n"
+            "</wsse:Security>\n"
+            "</s:Header>\n"
+            "<s:Body xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+            "xmlns:xsd=\"http://www.w3.org/2001/XMLSchema\">\n"
+            "<trt:GetStreamUri>\n"
+            "<trt:StreamSetup>\n"
+            "<tt:Stream>RTP-Unicast</tt:Stream>\n"
+            "<tt:Transport><tt:Protocol>RTSP</tt:Protocol></tt:Transport>\n"
+            "</trt:StreamSetup>\n"
+            "<trt:ProfileToken>Profile_1</trt:ProfileToken>\n"
+            "</trt:GetStreamUri>\n"
+            "</s:Body>\n"
+            "</s:Envelope>";
+        // Pad with a comment up to the typical size
+        request.insert(request.find("<s:Header>"), "<!--" + std::string(2048 - std::min<size_t>(2048, request.size() + 8), ' ') + "-->\n");
+        
+        SoapMessage soap;
+        if (!soap.parse(request) || soap.operation != "GetStreamUri" || soap.field("ProfileToken") != "Profile_1" ||
+            soap.field("Protocol") != "RTSP" || soap.security.username != "admin" || soap.security.created.empty()) {
+            std::cerr << "SOAP parser failed on the benchmark request" << std::endl;
+            return false;
+        }
+        size_t fields = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            SoapMessage message;
+            message.parse(request);
+            fields += message.field_count;
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "SOAP parse (" << request.size() << " bytes, " << fields / iterations << " fields): "
+                  << std::setprecision(0) << ns / iterations << " ns" << std::endl;
+        return true;
+    }
+    
+    // Replays keep-alive requests through processInput over a socket pair,
+    // after a first round that fills the caches and sizes the buffers.
+    // onvif_alloc_test.cpp replays the same requests counting allocations.
+    static bool requestPath(OnvifServer& server, int iterations) {
+        auto soap = [](const char* path, const char* body) {
+            std::string envelope = std::string("<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\">"
+                                               "<s:Body>") + body + "</s:Body></s:Envelope>";
+            return std::string("POST ") + path + " HTTP/1.1\r\nHost: localhost\r\n"
+                   "Content-Type: application/soap+xml\r\nContent-Length: " + std::to_string(envelope.size()) +
+                   "\r\n\r\n" + envelope;
+        };
+        auto gzip = [](std::string request) {
+            return request.insert(request.find("\r\n") + 2, "Accept-Encoding: gzip, deflate\r\n");
+        };
+        const std::pair<const char*, std::string> requests[] = {
+            {"GetProfiles", soap("/onvif/media_service", "<trt:GetProfiles/>")},
+            {"GetDeviceInformation", soap("/onvif/device_service", "<tds:GetDeviceInformation/>")},
+            {"Media2 GetProfiles", soap("/onvif/media2_service", "<tr2:GetProfiles><tr2:Token>Profile_2</tr2:Token>"
+                                                                 "<tr2:Type>All</tr2:Type></tr2:GetProfiles>")},
+            {"Media2 GetStreamUri", soap("/onvif/media2_service", "<tr2:GetStreamUri><tr2:Protocol>RtspUnicast</tr2:Protocol>"
+                                                                  "<tr2:ProfileToken>Profile_3</tr2:ProfileToken></tr2:GetStreamUri>")},
+            {"Snapshot", "GET /snapshot/Profile_2 HTTP/1.1\r\nHost: localhost\r\n\r\n"},
+            {"GetProfiles gzip", gzip(soap("/onvif/media_service", "<trt:GetProfiles/>"))},
+        };
+        
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0) {
+            std::cerr << "socketpair failed" << std::endl;
+            return false;
+        }
+        OnvifServer::Connection conn;
+        conn.fd = sockets[0];
+        char reply[65536];
+        bool ok = true;
+        for (const auto& request : requests) {
+            auto start = std::chrono::steady_clock::now();
+            for (int i = -1; i < iterations && ok; i++) {
+                conn.in.append(request.second);
+                server.processInput(&conn);
+                while (recv(sockets[1], reply, sizeof(reply), MSG_DONTWAIT) > 0) {
+                }
+                ok = conn.in.empty() && conn.out.empty();
+            }
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            std::cout << request.first << " request: " << std::setprecision(0) << ns / (iterations + 1) << " ns"
+                      << std::endl;
+        }
+        std::cout << "request arena: " << server.request_arena.capacity() << " bytes" << std::endl;
+        server.timers.cancel(&conn.timer);
+        close(sockets[0]);
+        close(sockets[1]);
+        if (!ok) {
+            std::cerr << "steady-state request path failed" << std::endl;
+        }
+        return ok;
+    }
+    
+    // Serves GetDeviceInformation over loopback with each I/O backend in
+    // turn. CLIENTS keep-alive connections each send their next request
+    // once the previous answer arrived, so the loop sees batches of ready
+    // sockets as it would with a fleet of clients. Reports requests per
+    // second and the system calls the event loop made per request.
+    static bool backends(int iterations) {
+        const int CLIENTS = 32;
+        std::string body = "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"><s:Body>"
+                           "<tds:GetDeviceInformation/></s:Body></s:Envelope>";
+        std::string request = "POST /onvif/device_service HTTP/1.1\r\nHost: localhost\r\n"
+                              "Content-Type: application/soap+xml\r\nContent-Length: " + std::to_string(body.size()) +
+                              "\r\n\r\n" + body;
+        for (OnvifServer::IoBackend backend : {OnvifServer::IO_EPOLL, OnvifServer::IO_URING}) {
+            const char* name = backend == OnvifServer::IO_URING ? "io_uring" : "epoll   ";
+            OnvifServer server(0);
+            server.setIoBackend(backend);
+            if (!server.start()) {
+                return false;
+            }
+            if (server.ioBackend() != backend) {
+                std::cout << name << ": not available" << std::endl;
+                continue;
+            }
+            std::thread loop(&OnvifServer::run, &server);
+            
+            struct sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = htons(server.listeningPort());
+            std::vector<int> clients;
+            bool ok = true;
+            for (int i = 0; i < CLIENTS && ok; i++) {
+                int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                ok = fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0;
+                if (fd >= 0) {
+                    clients.push_back(fd);
+                }
+            }
+            
+            int rounds = std::max(1, iterations / CLIENTS);
+            std::string reply;
+            char buffer[16384];
+            auto start = std::chrono::steady_clock::now();
+            for (int round = 0; round < rounds && ok; round++) {
+                for (int fd : clients) {
+                    ok = ok && send(fd, request.data(), request.size(), MSG_NOSIGNAL) == ssize_t(request.size());
+                }
+                for (int fd : clients) {
+                    // One response: the headers, then Content-Length bytes
+                    reply.clear();
+                    size_t expected = std::string::npos;
+                    while (ok && reply.size() < expected) {
+                        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+                        ok = received > 0;
+                        if (ok) {
+                            reply.append(buffer, received);
+                        }
+                        size_t header_end = reply.find("\r\n\r\n");
+                        if (header_end != std::string::npos) {
+                            expected = header_end + 4 + OnvifServer::parseSize(OnvifServer::getHeader(reply, "Content-Length"));
+                        }
+                    }
+                    ok = ok && reply.size() == expected;
+                }
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            for (int fd : clients) {
+                close(fd);
+            }
+            server.stop();
+            loop.join();
+            if (!ok) {
+                std::cerr << "backend benchmark failed on " << name << std::endl;
+                return false;
+            }
+            uint64_t requests = uint64_t(rounds) * CLIENTS;
+            uint64_t syscalls = server.loop_syscalls + server.ring.enterCalls();
+            std::cout << name << ": " << std::setprecision(0) << requests / seconds << " requests/s, "
+                      << std::setprecision(2) << double(syscalls) / requests << " system calls/request" << std::endl;
+        }
+        return true;
+    }
+
+    // One GetDeviceInformation per HTTPS connection, once with a full
+    // handshake every time and once resuming the previous session's ticket.
+    static bool tls(int iterations) {
+        std::string body = "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"><s:Body>"
+                           "<tds:GetDeviceInformation/></s:Body></s:Envelope>";
+        std::string request = "POST /onvif/device_service HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n"
+                              "Content-Type: application/soap+xml\r\nContent-Length: " + std::to_string(body.size()) +
+                              "\r\n\r\n" + body;
+        OnvifServer server(0);
+        server.setTls(0, "", "");
+        if (!server.start()) {
+            return false;
+        }
+        std::thread loop(&OnvifServer::run, &server);
+
+        SSL_CTX* context = SSL_CTX_new(TLS_client_method());
+        if (context) {
+            // Without client caching OpenSSL discards TLS 1.3 tickets
+            SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT);
+        }
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(server.tlsListeningPort());
+        int connections = std::max(20, std::min(iterations / 100, 500));
+        bool ok = context != nullptr;
+        for (bool resume : {false, true}) {
+            SSL_SESSION* session = nullptr;
+            int resumed = 0;
+            double handshake_us = 0;
+            char buffer[16384];
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < connections && ok; i++) {
+                int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                ok = fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0;
+                SSL* ssl = ok ? SSL_new(context) : nullptr;
+                if (ssl) {
+                    SSL_set_fd(ssl, fd);
+                    if (resume && session) {
+                        SSL_set_session(ssl, session);
+                    }
+                    auto handshake_start = std::chrono::steady_clock::now();
+                    ok = SSL_connect(ssl) == 1;
+                    handshake_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - handshake_start).count();
+                    resumed += ok && SSL_session_reused(ssl);
+                    ok = ok && SSL_write(ssl, request.data(), int(request.size())) == int(request.size());
+                    size_t received = 0;
+                    int n;
+                    while (ok && (n = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
+                        received += n;
+                    }
+                    ok = ok && received > 0;
+                    // A session freed without close_notify is marked unresumable
+                    SSL_shutdown(ssl);
+                    if (resume) {
+                        // TLS 1.3 tickets arrive after the handshake, so take
+                        // the session once the response has been read
+                        SSL_SESSION_free(session);
+                        session = SSL_get1_session(ssl);
+                    }
+                    SSL_free(ssl);
+                }
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            SSL_SESSION_free(session);
+            if (!ok) {
+                break;
+            }
+            std::cout << (resume ? "TLS resumed: " : "TLS full:    ") << std::setprecision(0) << connections / seconds
+                      << " connections/s, " << std::setprecision(1) << handshake_us / connections << " us/handshake, "
+                      << resumed << "/" << connections << " resumed" << std::endl;
+        }
+        SSL_CTX_free(context);
+        server.stop();
+        loop.join();
+        if (!ok) {
+            std::cerr << "TLS benchmark failed" << std::endl;
+            return false;
+        }
+        std::cout << "kTLS send offload: " << (server.ktls_connections > 0 ? "active" : "not available") << std::endl;
+        return true;
+    }
+    
+    // GetProfiles as it was built before the XML sinks, one temporary
+    // string per splice. Only kept as the benchmark baseline.
+    static std::string concatGetProfiles(const OnvifServer::MediaConfig& config) {
+        std::string profiles_xml;
+        for (const auto& profile : config.profiles) {
+            const OnvifServer::VideoEncoderConfig* encoder = config.encoderOf(profile);
+            int width = encoder ? encoder->width : OnvifServer::SOURCE_WIDTH;
+            int height = encoder ? encoder->height : OnvifServer::SOURCE_HEIGHT;
+            profiles_xml += "<trt:Profiles token=\"" + profile.token + "\" fixed=\"" + (profile.fixed ? "true" : "false") + "\">\n"
+                           "<trt:Name>" + profile.name + "</trt:Name>\n"
+                           "<trt:VideoSourceConfiguration token=\"VideoSource_1\" fixed=\"true\">\n"
+                           "<trt:Name>VideoSourceConfig</trt:Name>\n"
+                           "<trt:UseCount>" + std::to_string(config.profiles.size()) + "</trt:UseCount>\n"
+                           "<trt:SourceToken>VideoSource_1</trt:SourceToken>\n"
+                           "<trt:Bounds x=\"0\" y=\"0\" width=\"" + std::to_string(width) + "\" height=\"" + std::to_string(height) + "\"/>\n"
+                           "</trt:VideoSourceConfiguration>\n";
+            if (encoder && encoder->encoding != "H265") {
+                profiles_xml += "<trt:VideoEncoderConfiguration token=\"" + encoder->token + "\">\n"
+                               "<trt:Name>" + encoder->name + "</trt:Name>\n"
+                               "<trt:UseCount>" + std::to_string(config.useCount(encoder->token)) + "</trt:UseCount>\n"
+                               "<trt:Encoding>" + encoder->encoding + "</trt:Encoding>\n"
+                               "<trt:Resolution>\n"
+                               "<trt:Width>" + std::to_string(encoder->width) + "</trt:Width>\n"
+                               "<trt:Height>" + std::to_string(encoder->height) + "</trt:Height>\n"
+                               "</trt:Resolution>\n"
+                               "<trt:Quality>" + std::to_string(encoder->quality) + "</trt:Quality>\n"
+                               "<trt:RateControl>\n"
+                               "<trt:FrameRateLimit>" + std::to_string(encoder->framerate) + "</trt:FrameRateLimit>\n"
+                               "<trt:EncodingInterval>1</trt:EncodingInterval>\n"
+                               "<trt:BitrateLimit>" + std::to_string(encoder->bitrate) + "</trt:BitrateLimit>\n"
+                               "</trt:RateControl>\n" +
+                               (encoder->encoding == "H264" ? "<trt:H264>\n"
+                                                              "<trt:GovLength>" + std::to_string(encoder->gov_length) + "</trt:GovLength>\n"
+                                                              "<trt:H264Profile>" + encoder->codec_profile + "</trt:H264Profile>\n"
+                                                              "</trt:H264>\n" : "") +
+                               "</trt:VideoEncoderConfiguration>\n";
+            }
+            profiles_xml += "</trt:Profiles>\n";
+        }
+        
+        std::string body = "<trt:GetProfilesResponse>\n" + profiles_xml + "</trt:GetProfilesResponse>";
+        return std::string(OnvifServer::SOAP_ENVELOPE_START) + body + OnvifServer::SOAP_ENVELOPE_END;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 100000;
+    if (argc > 2 || iterations <= 0) {
+        std::cout << "Usage: " << argv[0] << " [<iterations>]" << std::endl;
+        std::cout << "Times GetProfiles rendering, SOAP parsing, the keep-alive request path," << std::endl;
+        std::cout << "both I/O backends over loopback and TLS handshakes (default: 100000 iterations)" << std::endl;
+        return -1;
+    }
+    return OnvifServerBench::run(iterations) ? 0 : -1;
+}
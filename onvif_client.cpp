@@ -0,0 +1,961 @@
+#include "onvif_client.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <strings.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+static const char* const SOAP_ENVELOPE_START =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\""
+    " xmlns:tds=\"http://www.onvif.org/ver10/device/wsdl\""
+    " xmlns:trt=\"http://www.onvif.org/ver10/media/wsdl\""
+    " xmlns:tptz=\"http://www.onvif.org/ver20/ptz/wsdl\""
+    " xmlns:tt=\"http://www.onvif.org/ver10/schema\">\n";
+
+static uint64_t steadyMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string escapeXml(std::string_view text) {
+    std::string escaped;
+    escaped.reserve(text.size());
+    for (char c : text) {
+        switch (c) {
+            case '&': escaped += "&amp;"; break;
+            case '<': escaped += "&lt;"; break;
+            case '>': escaped += "&gt;"; break;
+            case '"': escaped += "&quot;"; break;
+            case '\'': escaped += "&apos;"; break;
+            default: escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static std::string unescapeXml(std::string_view text) {
+    static const std::pair<std::string_view, char> ENTITIES[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''},
+    };
+    std::string plain;
+    plain.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        bool replaced = false;
+        if (text[i] == '&') {
+            for (const auto& entity : ENTITIES) {
+                if (text.compare(i, entity.first.size(), entity.first) == 0) {
+                    plain += entity.second;
+                    i += entity.first.size() - 1;
+                    replaced = true;
+                    break;
+                }
+            }
+        }
+        if (!replaced) {
+            plain += text[i];
+        }
+    }
+    return plain;
+}
+
+// Next element named `name` (local part) at or after `from`. Sets `tag` to
+// its start tag and `content` to what lies between the tags, and returns
+// the position after the element; npos if there is no such element.
+static size_t findElement(std::string_view xml, std::string_view name, size_t from,
+                          std::string_view& tag, std::string_view& content) {
+    for (size_t open = xml.find('<', from); open != std::string_view::npos; open = xml.find('<', open + 1)) {
+        if (open + 1 >= xml.size() || xml[open + 1] == '/' || xml[open + 1] == '?' || xml[open + 1] == '!') {
+            continue;
+        }
+        size_t name_end = xml.find_first_of(" \t\r\n/>", open + 1);
+        if (name_end == std::string_view::npos) {
+            return std::string_view::npos;
+        }
+        std::string_view qname = xml.substr(open + 1, name_end - open - 1);
+        size_t colon = qname.find(':');
+        if ((colon == std::string_view::npos ? qname : qname.substr(colon + 1)) != name) {
+            continue;
+        }
+        size_t tag_end = xml.find('>', name_end);
+        if (tag_end == std::string_view::npos) {
+            return std::string_view::npos;
+        }
+        tag = xml.substr(open, tag_end + 1 - open);
+        if (xml[tag_end - 1] == '/') {
+            content = std::string_view();
+            return tag_end + 1;
+        }
+        // Elements of the same name do not nest in ONVIF responses
+        std::string closing = "</" + std::string(qname) + ">";
+        size_t close = xml.find(closing, tag_end + 1);
+        if (close == std::string_view::npos) {
+            return std::string_view::npos;
+        }
+        content = xml.substr(tag_end + 1, close - tag_end - 1);
+        return close + closing.size();
+    }
+    return std::string_view::npos;
+}
+
+static std::string_view attributeValue(std::string_view tag, std::string_view name) {
+    for (size_t at = tag.find(name); at != std::string_view::npos; at = tag.find(name, at + 1)) {
+        size_t quote = at + name.size() + 1;
+        if (at > 0 && (tag[at - 1] == ' ' || tag[at - 1] == '\t' || tag[at - 1] == '\n') &&
+            quote < tag.size() && tag[quote - 1] == '=' && (tag[quote] == '"' || tag[quote] == '\'')) {
+            size_t end = tag.find(tag[quote], quote + 1);
+            if (end != std::string_view::npos) {
+                return tag.substr(quote + 1, end - quote - 1);
+            }
+        }
+    }
+    return std::string_view();
+}
+
+std::string_view OnvifClient::elementText(std::string_view xml, std::string_view name, size_t from) {
+    std::string_view tag, content;
+    findElement(xml, name, from, tag, content);
+    return content;
+}
+
+static int parseInt(std::string_view text) {
+    return std::atoi(std::string(text).c_str());
+}
+
+// Header value from the header block of an HTTP response, empty if absent
+static std::string_view headerValue(std::string_view headers, std::string_view name) {
+    for (size_t line = headers.find("\r\n"); line != std::string_view::npos; line = headers.find("\r\n", line + 2)) {
+        size_t start = line + 2;
+        if (headers.size() - start > name.size() && headers[start + name.size()] == ':' &&
+            strncasecmp(headers.data() + start, name.data(), name.size()) == 0) {
+            size_t end = headers.find("\r\n", start);
+            std::string_view value = headers.substr(start + name.size() + 1,
+                                                    (end == std::string_view::npos ? headers.size() : end) - start - name.size() - 1);
+            while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+                value.remove_prefix(1);
+            }
+            return value;
+        }
+    }
+    return std::string_view();
+}
+
+// Decodes a chunked body. 1 when it is complete, 0 when more data is
+// needed, -1 when it is malformed.
+static int decodeChunked(std::string_view data, std::string& body) {
+    body.clear();
+    size_t at = 0;
+    for (;;) {
+        size_t line_end = data.find("\r\n", at);
+        if (line_end == std::string_view::npos) {
+            return 0;
+        }
+        // The size may be followed by ;extensions
+        std::string line(data.substr(at, line_end - at));
+        char* end;
+        unsigned long size = std::strtoul(line.c_str(), &end, 16);
+        if (end == line.c_str() || (*end != '\0' && *end != ';' && *end != ' ')) {
+            return -1;
+        }
+        at = line_end + 2;
+        if (size == 0) {
+            // Trailers, then the empty line
+            return data.find("\r\n", at) == std::string_view::npos ? 0 : 1;
+        }
+        if (data.size() < at + size + 2) {
+            return 0;
+        }
+        body.append(data.data() + at, size);
+        at += size + 2;
+    }
+}
+
+struct OnvifClient::Pool {
+    std::string host_header;            // Host: value, IPv6 in brackets
+    struct sockaddr_storage address = {};
+    socklen_t address_length = 0;
+    bool resolving = false;             // calls queue until the name is looked up
+    std::string error;                  // why the host could not be resolved
+    std::vector<Connection*> idle;
+    int open = 0;                       // connections, idle or busy
+    std::deque<Request> queue;
+};
+
+struct OnvifClient::Connection {
+    int fd;
+    Pool* pool;
+    bool connected = false;
+    bool busy = false;                  // `request` is in flight
+    bool reused = false;                // served a response before
+    bool dead = false;                  // closed, waiting for freeClosed()
+    Request request;
+    size_t out_offset = 0;
+    std::string in;
+    // Response being received
+    size_t header_end = std::string::npos;
+    int status = 0;
+    size_t content_length = 0;
+    bool chunked = false;
+    bool until_close = false;           // neither a length nor chunks: the body ends with the connection
+    bool keep_alive = true;
+    std::string body;
+    bool timed = false;
+    std::multimap<uint64_t, Connection*>::iterator timer;
+};
+
+// First address of `host` and `port`. false with `error` set when there
+// is none; `flags` may restrict the lookup to literals.
+static bool resolveAddress(const std::string& host, int port, int flags, struct sockaddr_storage& address,
+                           socklen_t& length, int& error) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | flags;
+    struct addrinfo* result = nullptr;
+    error = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result);
+    bool found = error == 0 && result;
+    if (found) {
+        memcpy(&address, result->ai_addr, result->ai_addrlen);
+        length = result->ai_addrlen;
+    }
+    if (result) {
+        freeaddrinfo(result);
+    }
+    return found;
+}
+
+// getaddrinfo blocks for as long as DNS takes, so host names are looked up
+// on a helper thread. Finished lookups are handed back under the mutex and
+// announced on an eventfd in the client's epoll set.
+struct OnvifClient::Resolver {
+    struct Lookup {
+        Pool* pool;
+        std::string host;
+        int port;
+        struct sockaddr_storage address;
+        socklen_t address_length;
+        int error;
+    };
+
+    int event_fd;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Lookup> pending;
+    std::vector<Lookup> done;
+    bool stopping = false;
+    std::thread thread;
+
+    Resolver() : event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), thread(&Resolver::run, this) {}
+
+    // Waits for a lookup in progress, which is bounded by the resolver's
+    // own timeouts
+    ~Resolver() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+        if (event_fd >= 0) {
+            close(event_fd);
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (stopping) {
+                return;
+            }
+            Lookup lookup = std::move(pending.front());
+            pending.pop_front();
+            lock.unlock();
+            resolveAddress(lookup.host, lookup.port, 0, lookup.address, lookup.address_length, lookup.error);
+            lock.lock();
+            done.push_back(std::move(lookup));
+            uint64_t one = 1;
+            ssize_t ignored = write(event_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+};
+
+OnvifClient::OnvifClient()
+    : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), max_connections_per_host(2), timeout_ms(5000), outstanding_calls(0) {
+}
+
+OnvifClient::~OnvifClient() {
+    // Stops the helper thread before the pools its lookups point to go
+    resolver.reset();
+    for (auto& entry : pools) {
+        Pool* pool = entry.second.get();
+        for (Connection* conn : pool->idle) {
+            closeConnection(conn);
+        }
+    }
+    while (!timers.empty()) {
+        closeConnection(timers.begin()->second);
+    }
+    freeClosed();
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+}
+
+// WS-Security UsernameToken with Digest = Base64(SHA1(nonce + created + password))
+std::string OnvifClient::securityHeader(const Request& request) {
+    unsigned char nonce[16];
+    if (RAND_bytes(nonce, sizeof(nonce)) != 1) {
+        return std::string();
+    }
+    time_t now = time(nullptr) + request.clock_offset;
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    char created[32];
+    strftime(created, sizeof(created), "%Y-%m-%dT%H:%M:%SZ", &utc);
+
+    std::string input(reinterpret_cast<const char*>(nonce), sizeof(nonce));
+    input += created;
+    input += request.password;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char*>(input.data()), input.size(), digest);
+
+    unsigned char nonce64[32], digest64[32];
+    EVP_EncodeBlock(nonce64, nonce, sizeof(nonce));
+    EVP_EncodeBlock(digest64, digest, sizeof(digest));
+    return std::string("<s:Header>\n"
+                       "<wsse:Security s:mustUnderstand=\"1\""
+                       " xmlns:wsse=\"http://docs.oasis-open.org/wss/2004/01/oasis-200401-wss-wssecurity-secext-1.0.xsd\""
+                       " xmlns:wsu=\"http://docs.oasis-open.org/wss/2004/01/oasis-200401-wss-wssecurity-utility-1.0.xsd\">\n"
+                       "<wsse:UsernameToken>\n"
+                       "<wsse:Username>") + escapeXml(request.username) + "</wsse:Username>\n"
+           "<wsse:Password Type=\"http://docs.oasis-open.org/wss/2004/01/"
+           "oasis-200401-wss-username-token-profile-1.0#PasswordDigest\">" + reinterpret_cast<char*>(digest64) + "</wsse:Password>\n"
+           "<wsse:Nonce EncodingType=\"http://docs.oasis-open.org/wss/2004/01/"
+           "oasis-200401-wss-soap-message-security-1.0#Base64Binary\">" + reinterpret_cast<char*>(nonce64) + "</wsse:Nonce>\n"
+           "<wsu:Created>" + created + "</wsu:Created>\n"
+           "</wsse:UsernameToken>\n"
+           "</wsse:Security>\n"
+           "</s:Header>\n";
+}
+
+OnvifClient::Pool* OnvifClient::pool(const OnvifDevice& device) {
+    std::string key = device.host + " " + std::to_string(device.port);
+    auto it = pools.find(key);
+    if (it != pools.end()) {
+        return it->second.get();
+    }
+    std::unique_ptr<Pool> pool(new Pool());
+    bool ipv6 = device.host.find(':') != std::string::npos;
+    pool->host_header = (ipv6 ? "[" + device.host + "]" : device.host) + ":" + std::to_string(device.port);
+    // Addresses are taken as they are; names are resolved once per host and
+    // port, off this thread
+    int error;
+    if (!resolveAddress(device.host, device.port, AI_NUMERICHOST, pool->address, pool->address_length, error)) {
+        if (error == EAI_NONAME && startLookup(pool.get(), device)) {
+            pool->resolving = true;
+        } else {
+            pool->error = std::string("cannot resolve ") + device.host + ": " + gai_strerror(error);
+        }
+    }
+    return pools.emplace(key, std::move(pool)).first->second.get();
+}
+
+bool OnvifClient::startLookup(Pool* pool, const OnvifDevice& device) {
+    if (!resolver) {
+        std::unique_ptr<Resolver> started(new Resolver());
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;       // not a connection, see poll()
+        if (started->event_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, started->event_fd, &event) < 0) {
+            return false;
+        }
+        resolver = std::move(started);
+    }
+    {
+        std::lock_guard<std::mutex> lock(resolver->mutex);
+        resolver->pending.push_back(Resolver::Lookup{pool, device.host, device.port, {}, 0, 0});
+    }
+    resolver->wake.notify_one();
+    return true;
+}
+
+// Hands finished lookups to their pools: calls queued behind a name that
+// did not resolve fail, the others go out
+void OnvifClient::finishLookups() {
+    uint64_t counter;
+    ssize_t ignored = read(resolver->event_fd, &counter, sizeof(counter));
+    (void)ignored;
+    std::vector<Resolver::Lookup> done;
+    {
+        std::lock_guard<std::mutex> lock(resolver->mutex);
+        done.swap(resolver->done);
+    }
+    for (Resolver::Lookup& lookup : done) {
+        Pool* pool = lookup.pool;
+        pool->resolving = false;
+        if (lookup.error != 0) {
+            pool->error = std::string("cannot resolve ") + lookup.host + ": " + gai_strerror(lookup.error);
+            while (!pool->queue.empty()) {
+                OnvifResult result;
+                result.error = pool->error;
+                complete(pool->queue.front(), result);
+                pool->queue.pop_front();
+            }
+            continue;
+        }
+        pool->address = lookup.address;
+        pool->address_length = lookup.address_length;
+        dispatch(pool);
+    }
+}
+
+void OnvifClient::call(const OnvifDevice& device, const std::string& path, std::string_view body, Callback done) {
+    Request request;
+    request.path = path;
+    request.body = body;
+    request.username = device.username;
+    request.password = device.password;
+    request.clock_offset = device.clock_offset;
+    request.done = std::move(done);
+    submit(pool(device), std::move(request));
+}
+
+void OnvifClient::submit(Pool* pool, Request request) {
+    outstanding_calls++;
+    if (!pool->error.empty()) {
+        OnvifResult result;
+        result.error = pool->error;
+        complete(request, result);
+        return;
+    }
+    pool->queue.push_back(std::move(request));
+    dispatch(pool);
+}
+
+// Starts queued requests on idle connections, opening new ones up to the
+// per-host limit
+void OnvifClient::dispatch(Pool* pool) {
+    while (!pool->resolving && !pool->queue.empty()) {
+        Connection* conn = nullptr;
+        if (!pool->idle.empty()) {
+            conn = pool->idle.back();
+            pool->idle.pop_back();
+        } else if (pool->open < max_connections_per_host) {
+            std::string error;
+            if (!openConnection(pool, conn, error)) {
+                OnvifResult result;
+                result.error = error;
+                complete(pool->queue.front(), result);
+                pool->queue.pop_front();
+                continue;
+            }
+        } else {
+            return;
+        }
+        Request request = std::move(pool->queue.front());
+        pool->queue.pop_front();
+        startRequest(conn, std::move(request));
+    }
+}
+
+bool OnvifClient::openConnection(Pool* pool, Connection*& conn, std::string& error) {
+    int fd = socket(pool->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error = std::string("socket: ") + strerror(errno);
+        return false;
+    }
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&pool->address), pool->address_length) < 0 &&
+        errno != EINPROGRESS) {
+        error = std::string("connect: ") + strerror(errno);
+        close(fd);
+        return false;
+    }
+    conn = new Connection();
+    conn->fd = fd;
+    conn->pool = pool;
+    // Edge-triggered for both directions, so a connection is registered
+    // once and never modified
+    struct epoll_event event = {};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        error = std::string("epoll_ctl: ") + strerror(errno);
+        close(fd);
+        delete conn;
+        return false;
+    }
+    pool->open++;
+    return true;
+}
+
+void OnvifClient::startRequest(Connection* conn, Request request) {
+    std::string envelope = SOAP_ENVELOPE_START;
+    if (!request.username.empty()) {
+        envelope += securityHeader(request);
+    }
+    envelope += "<s:Body>";
+    envelope += request.body;
+    envelope += "</s:Body>\n</s:Envelope>";
+    request.message = "POST " + request.path + " HTTP/1.1\r\n"
+                      "Host: " + conn->pool->host_header + "\r\n"
+                      "Content-Type: application/soap+xml; charset=utf-8\r\n"
+                      "Content-Length: " + std::to_string(envelope.size()) + "\r\n\r\n" + envelope;
+    conn->request = std::move(request);
+    conn->busy = true;
+    conn->out_offset = 0;
+    conn->in.clear();
+    conn->header_end = std::string::npos;
+    conn->body.clear();
+    armTimer(conn);
+    // Writable already: with edge triggering no further event would come
+    if (conn->connected && !sendPending(conn)) {
+        failConnection(conn, std::string("send: ") + strerror(errno));
+    }
+}
+
+bool OnvifClient::sendPending(Connection* conn) {
+    const std::string& message = conn->request.message;
+    while (conn->out_offset < message.size()) {
+        ssize_t sent = send(conn->fd, message.data() + conn->out_offset, message.size() - conn->out_offset, MSG_NOSIGNAL);
+        if (sent < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->out_offset += sent;
+    }
+    return true;
+}
+
+// Reads everything the socket has. `closed` tells whether the peer has
+// finished sending.
+bool OnvifClient::receive(Connection* conn, bool& closed) {
+    char buffer[16384];
+    closed = false;
+    for (;;) {
+        ssize_t received = recv(conn->fd, buffer, sizeof(buffer), 0);
+        if (received > 0) {
+            conn->in.append(buffer, received);
+        } else if (received == 0) {
+            closed = true;
+            return true;
+        } else {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+}
+
+void OnvifClient::handleEvent(Connection* conn, uint32_t events) {
+    if (conn->dead) {
+        return;
+    }
+    if (!conn->connected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+            failConnection(conn, std::string("connect: ") + strerror(error));
+            return;
+        }
+        if (!(events & EPOLLOUT)) {
+            return;
+        }
+        conn->connected = true;
+    }
+    if ((events & EPOLLOUT) && conn->busy && !sendPending(conn)) {
+        failConnection(conn, std::string("send: ") + strerror(errno));
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    bool closed;
+    if (!receive(conn, closed)) {
+        failConnection(conn, std::string("recv: ") + strerror(errno), errno == ECONNRESET ? FAILURE_PEER_CLOSED : FAILURE_ERROR);
+        return;
+    }
+    if (!conn->busy) {
+        // An idle connection that the device closed, or that sent
+        // something unasked for
+        if (closed || !conn->in.empty()) {
+            closeConnection(conn);
+        }
+        return;
+    }
+    if (responseComplete(conn) || (closed && conn->until_close && conn->header_end != std::string::npos)) {
+        if (closed) {
+            conn->keep_alive = false;
+        }
+        finishRequest(conn);
+    } else if (conn->status < 0) {
+        failConnection(conn, "malformed response");
+    } else if (closed) {
+        failConnection(conn, "connection closed", FAILURE_PEER_CLOSED);
+    } else if (events & EPOLLERR) {
+        failConnection(conn, "connection closed");
+    }
+}
+
+bool OnvifClient::responseComplete(Connection* conn) {
+    std::string_view in = conn->in;
+    if (conn->status < 0) {
+        return false;
+    }
+    if (conn->header_end == std::string::npos) {
+        size_t end = in.find("\r\n\r\n");
+        if (end == std::string_view::npos) {
+            return false;
+        }
+        conn->header_end = end + 4;
+        std::string_view headers = in.substr(0, end + 2);
+        conn->status = in.size() > 12 && in.compare(0, 5, "HTTP/") == 0 ? parseInt(in.substr(9, 3)) : -1;
+        if (conn->status < 0) {
+            return false;
+        }
+        std::string_view connection = headerValue(headers, "Connection");
+        bool http10 = in.compare(5, 3, "1.0") == 0;
+        conn->keep_alive = http10 ? strncasecmp(connection.data(), "keep-alive", 10) == 0 && connection.size() == 10
+                                  : !(connection.size() == 5 && strncasecmp(connection.data(), "close", 5) == 0);
+        std::string_view encoding = headerValue(headers, "Transfer-Encoding");
+        std::string_view length = headerValue(headers, "Content-Length");
+        conn->chunked = encoding.size() >= 7 && strncasecmp(encoding.data(), "chunked", 7) == 0;
+        conn->until_close = !conn->chunked && length.empty();
+        conn->content_length = length.empty() ? 0 : std::strtoull(std::string(length).c_str(), nullptr, 10);
+        if (conn->until_close) {
+            conn->keep_alive = false;
+        }
+    }
+    std::string_view rest = in.substr(conn->header_end);
+    if (conn->chunked) {
+        int decoded = decodeChunked(rest, conn->body);
+        if (decoded < 0) {
+            conn->status = -1;
+        }
+        return decoded > 0;
+    }
+    if (conn->until_close) {
+        conn->body.assign(rest);
+        return false;
+    }
+    if (rest.size() < conn->content_length) {
+        return false;
+    }
+    conn->body.assign(rest.substr(0, conn->content_length));
+    // Bytes past the response were not asked for
+    if (rest.size() > conn->content_length) {
+        conn->keep_alive = false;
+    }
+    return true;
+}
+
+void OnvifClient::finishRequest(Connection* conn) {
+    cancelTimer(conn);
+    OnvifResult result;
+    result.status = conn->status;
+    result.body = std::move(conn->body);
+    std::string_view tag, content;
+    if (findElement(result.body, "Fault", 0, tag, content) != std::string_view::npos) {
+        std::string_view reason = elementText(content, "Text");
+        result.error = reason.empty() ? "SOAP fault" : unescapeXml(reason);
+    } else if (result.status != 200) {
+        result.error = "HTTP " + std::to_string(result.status);
+    }
+    Request request = std::move(conn->request);
+    conn->busy = false;
+    conn->reused = true;
+    Pool* pool = conn->pool;
+    if (conn->keep_alive) {
+        pool->idle.push_back(conn);
+    } else {
+        closeConnection(conn);
+    }
+    complete(request, result);
+    dispatch(pool);
+}
+
+// Ends the request in flight with `error` and closes the connection. A
+// request that found a kept-alive connection closed by the device before
+// any response byte arrived is tried once more on a new connection; the
+// device most likely closed it as idle without seeing the request. Other
+// failures, timeouts included, are not retried, as the device may have
+// acted on the call.
+void OnvifClient::failConnection(Connection* conn, const std::string& error, Failure failure) {
+    Pool* pool = conn->pool;
+    if (conn->busy) {
+        Request request = std::move(conn->request);
+        conn->busy = false;
+        if (failure == FAILURE_PEER_CLOSED && conn->reused && conn->in.empty() && !request.retried) {
+            request.retried = true;
+            pool->queue.push_front(std::move(request));
+        } else {
+            OnvifResult result;
+            result.status = conn->status > 0 ? conn->status : 0;
+            result.error = error;
+            complete(request, result);
+        }
+    }
+    closeConnection(conn);
+    dispatch(pool);
+}
+
+void OnvifClient::closeConnection(Connection* conn) {
+    if (conn->dead) {
+        return;
+    }
+    conn->dead = true;
+    cancelTimer(conn);
+    close(conn->fd);
+    Pool* pool = conn->pool;
+    pool->open--;
+    auto idle = std::find(pool->idle.begin(), pool->idle.end(), conn);
+    if (idle != pool->idle.end()) {
+        pool->idle.erase(idle);
+    }
+    closed.push_back(conn);
+}
+
+void OnvifClient::complete(Request& request, OnvifResult& result) {
+    finished.emplace_back(std::move(request.done), std::move(result));
+}
+
+void OnvifClient::armTimer(Connection* conn) {
+    cancelTimer(conn);
+    conn->timer = timers.emplace(steadyMs() + timeout_ms, conn);
+    conn->timed = true;
+}
+
+void OnvifClient::cancelTimer(Connection* conn) {
+    if (conn->timed) {
+        timers.erase(conn->timer);
+        conn->timed = false;
+    }
+}
+
+void OnvifClient::expireTimers() {
+    uint64_t now = steadyMs();
+    while (!timers.empty() && timers.begin()->first <= now) {
+        failConnection(timers.begin()->second, "timed out");
+    }
+}
+
+void OnvifClient::freeClosed() {
+    for (Connection* conn : closed) {
+        delete conn;
+    }
+    closed.clear();
+}
+
+int OnvifClient::timeoutMs() const {
+    if (!finished.empty()) {
+        return 0;
+    }
+    if (timers.empty()) {
+        return -1;
+    }
+    uint64_t now = steadyMs();
+    return timers.begin()->first <= now ? 0 : int(timers.begin()->first - now);
+}
+
+size_t OnvifClient::poll(int wait_ms) {
+    int until = timeoutMs();
+    if (until >= 0) {
+        wait_ms = wait_ms < 0 ? until : std::min(wait_ms, until);
+    }
+    struct epoll_event events[256];
+    int count = epoll_wait(epoll_fd, events, 256, wait_ms);
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.ptr) {
+            handleEvent(static_cast<Connection*>(events[i].data.ptr), events[i].events);
+        } else {
+            finishLookups();
+        }
+    }
+    expireTimers();
+    freeClosed();
+    // Callbacks last, as they may start further calls
+    size_t ready = finished.size();
+    for (size_t i = 0; i < ready; i++) {
+        std::pair<Callback, OnvifResult> call = std::move(finished.front());
+        finished.pop_front();
+        outstanding_calls--;
+        if (call.first) {
+            call.first(call.second);
+        }
+    }
+    return outstanding_calls;
+}
+
+void OnvifClient::run() {
+    while (outstanding_calls > 0) {
+        poll(-1);
+    }
+}
+
+// Typed operations: the reply is parsed from the response body, and a
+// response without the expected content counts as an error
+
+template <typename T, typename Parse>
+static OnvifClient::Callback parsed(OnvifClient::Reply<T> done, Parse parse) {
+    return [done = std::move(done), parse](const OnvifResult& result) {
+        T value{};
+        if (!result.ok() || parse(std::string_view(result.body), value)) {
+            done(result, value);
+            return;
+        }
+        OnvifResult unexpected = result;
+        unexpected.error = "unexpected response";
+        done(unexpected, value);
+    };
+}
+
+static std::string text(std::string_view xml, std::string_view name) {
+    return unescapeXml(OnvifClient::elementText(xml, name));
+}
+
+void OnvifClient::getSystemDateAndTime(const OnvifDevice& device, Reply<time_t> done) {
+    call(device, device.device_path, "<tds:GetSystemDateAndTime/>", parsed<time_t>(std::move(done), [](std::string_view body, time_t& utc) {
+        std::string_view date_time = elementText(body, "UTCDateTime");
+        std::string_view date = elementText(date_time, "Date");
+        std::string_view clock = elementText(date_time, "Time");
+        if (date.empty() || clock.empty()) {
+            return false;
+        }
+        struct tm fields = {};
+        fields.tm_year = parseInt(elementText(date, "Year")) - 1900;
+        fields.tm_mon = parseInt(elementText(date, "Month")) - 1;
+        fields.tm_mday = parseInt(elementText(date, "Day"));
+        fields.tm_hour = parseInt(elementText(clock, "Hour"));
+        fields.tm_min = parseInt(elementText(clock, "Minute"));
+        fields.tm_sec = parseInt(elementText(clock, "Second"));
+        utc = timegm(&fields);
+        return true;
+    }));
+}
+
+void OnvifClient::getDeviceInformation(const OnvifDevice& device, Reply<OnvifDeviceInformation> done) {
+    call(device, device.device_path, "<tds:GetDeviceInformation/>",
+         parsed<OnvifDeviceInformation>(std::move(done), [](std::string_view body, OnvifDeviceInformation& info) {
+             info.manufacturer = text(body, "Manufacturer");
+             info.model = text(body, "Model");
+             info.firmware_version = text(body, "FirmwareVersion");
+             info.serial_number = text(body, "SerialNumber");
+             info.hardware_id = text(body, "HardwareId");
+             return !elementText(body, "GetDeviceInformationResponse").empty();
+         }));
+}
+
+void OnvifClient::getCapabilities(const OnvifDevice& device, Reply<OnvifCapabilities> done) {
+    call(device, device.device_path, "<tds:GetCapabilities><tds:Category>All</tds:Category></tds:GetCapabilities>",
+         parsed<OnvifCapabilities>(std::move(done), [](std::string_view body, OnvifCapabilities& capabilities) {
+             capabilities.device_xaddr = text(elementText(body, "Device"), "XAddr");
+             capabilities.media_xaddr = text(elementText(body, "Media"), "XAddr");
+             capabilities.ptz_xaddr = text(elementText(body, "PTZ"), "XAddr");
+             capabilities.events_xaddr = text(elementText(body, "Events"), "XAddr");
+             return !capabilities.device_xaddr.empty();
+         }));
+}
+
+void OnvifClient::getProfiles(const OnvifDevice& device, Reply<std::vector<OnvifProfile>> done) {
+    call(device, device.media_path, "<trt:GetProfiles/>",
+         parsed<std::vector<OnvifProfile>>(std::move(done), [](std::string_view body, std::vector<OnvifProfile>& profiles) {
+             std::string_view tag, content;
+             for (size_t at = findElement(body, "Profiles", 0, tag, content); at != std::string_view::npos;
+                  at = findElement(body, "Profiles", at, tag, content)) {
+                 OnvifProfile profile;
+                 profile.token = unescapeXml(attributeValue(tag, "token"));
+                 // The profile's own Name comes before those of its configurations
+                 profile.name = text(content, "Name");
+                 std::string_view encoder = elementText(content, "VideoEncoderConfiguration");
+                 if (!encoder.empty()) {
+                     profile.encoding = text(encoder, "Encoding");
+                     profile.width = parseInt(elementText(encoder, "Width"));
+                     profile.height = parseInt(elementText(encoder, "Height"));
+                     profile.frame_rate = parseInt(elementText(encoder, "FrameRateLimit"));
+                     profile.bitrate = parseInt(elementText(encoder, "BitrateLimit"));
+                 }
+                 profiles.push_back(std::move(profile));
+             }
+             return body.find("GetProfilesResponse") != std::string_view::npos;
+         }));
+}
+
+void OnvifClient::getStreamUri(const OnvifDevice& device, const std::string& profile_token, Reply<std::string> done) {
+    call(device, device.media_path,
+         "<trt:GetStreamUri><trt:StreamSetup><tt:Stream>RTP-Unicast</tt:Stream>"
+         "<tt:Transport><tt:Protocol>RTSP</tt:Protocol></tt:Transport></trt:StreamSetup>"
+         "<trt:ProfileToken>" + escapeXml(profile_token) + "</trt:ProfileToken></trt:GetStreamUri>",
+         parsed<std::string>(std::move(done), [](std::string_view body, std::string& uri) {
+             uri = text(body, "Uri");
+             return !uri.empty();
+         }));
+}
+
+void OnvifClient::continuousMove(const OnvifDevice& device, const std::string& profile_token, double pan, double tilt,
+                                 double zoom, Callback done) {
+    char velocity[160];
+    snprintf(velocity, sizeof(velocity), "<tptz:Velocity><tt:PanTilt x=\"%g\" y=\"%g\"/><tt:Zoom x=\"%g\"/></tptz:Velocity>",
+             pan, tilt, zoom);
+    call(device, device.ptz_path,
+         "<tptz:ContinuousMove><tptz:ProfileToken>" + escapeXml(profile_token) + "</tptz:ProfileToken>" + velocity +
+         "</tptz:ContinuousMove>", std::move(done));
+}
+
+void OnvifClient::stop(const OnvifDevice& device, const std::string& profile_token, Callback done) {
+    call(device, device.ptz_path,
+         "<tptz:Stop><tptz:ProfileToken>" + escapeXml(profile_token) + "</tptz:ProfileToken>"
+         "<tptz:PanTilt>true</tptz:PanTilt><tptz:Zoom>true</tptz:Zoom></tptz:Stop>", std::move(done));
+}
+
+void OnvifClient::getPresets(const OnvifDevice& device, const std::string& profile_token,
+                             Reply<std::vector<OnvifPreset>> done) {
+    call(device, device.ptz_path,
+         "<tptz:GetPresets><tptz:ProfileToken>" + escapeXml(profile_token) + "</tptz:ProfileToken></tptz:GetPresets>",
+         parsed<std::vector<OnvifPreset>>(std::move(done), [](std::string_view body, std::vector<OnvifPreset>& presets) {
+             std::string_view tag, content;
+             for (size_t at = findElement(body, "Preset", 0, tag, content); at != std::string_view::npos;
+                  at = findElement(body, "Preset", at, tag, content)) {
+                 presets.push_back({unescapeXml(attributeValue(tag, "token")), text(content, "Name")});
+             }
+             return body.find("GetPresetsResponse") != std::string_view::npos;
+         }));
+}
+
+void OnvifClient::setPreset(const OnvifDevice& device, const std::string& profile_token, const std::string& name,
+                            Reply<std::string> done) {
+    call(device, device.ptz_path,
+         "<tptz:SetPreset><tptz:ProfileToken>" + escapeXml(profile_token) + "</tptz:ProfileToken>"
+         "<tptz:PresetName>" + escapeXml(name) + "</tptz:PresetName></tptz:SetPreset>",
+         parsed<std::string>(std::move(done), [](std::string_view body, std::string& token) {
+             token = text(body, "PresetToken");
+             return !token.empty();
+         }));
+}
+
+void OnvifClient::gotoPreset(const OnvifDevice& device, const std::string& profile_token, const std::string& preset_token,
+                             Callback done) {
+    call(device, device.ptz_path,
+         "<tptz:GotoPreset><tptz:ProfileToken>" + escapeXml(profile_token) + "</tptz:ProfileToken>"
+         "<tptz:PresetToken>" + escapeXml(preset_token) + "</tptz:PresetToken></tptz:GotoPreset>", std::move(done));
+}
+
+void OnvifClient::removePreset(const OnvifDevice& device, const std::string& profile_token, const std::string& preset_token,
+                               Callback done) {
+    call(device, device.ptz_path,
+         "<tptz:RemovePreset><tptz:ProfileToken>" + escapeXml(profile_token) + "</tptz:ProfileToken>"
+         "<tptz:PresetToken>" + escapeXml(preset_token) + "</tptz:PresetToken></tptz:RemovePreset>", std::move(done));
+}
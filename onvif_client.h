@@ -0,0 +1,205 @@
+// Non-blocking ONVIF client. One OnvifClient drives any number of calls to
+// any number of devices from the thread that calls poll(): requests to a
+// device share a small pool of keep-alive connections, further calls queue
+// behind them, and every call ends in its callback, on success or with an
+// error. Calls carry a WS-Security UsernameToken with a password digest
+// when the device has a username. Host names are looked up on a helper
+// thread, so no call blocks on DNS; calls to a host queue until its name
+// is resolved.
+//
+//     OnvifClient client;
+//     OnvifDevice camera{"192.168.0.252", 2020, "user", "secret"};
+//     client.getDeviceInformation(camera, [](const OnvifResult& result, const OnvifDeviceInformation& info) {
+//         std::cout << (result.ok() ? info.model : result.error) << std::endl;
+//     });
+//     client.run();
+//
+// Not thread-safe: calls and poll() belong to one thread. Callbacks run
+// inside poll() and may start further calls.
+
+#ifndef ONVIF_CLIENT_H
+#define ONVIF_CLIENT_H
+
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+
+struct OnvifDevice {
+    std::string host;                   // name or address; IPv6 without brackets
+    int port = 80;
+    std::string username;               // empty: no WS-Security header
+    std::string password;
+    // Seconds the device clock is ahead of ours, added to the digest's
+    // Created time. Devices reject tokens too far from their own clock;
+    // see getSystemDateAndTime().
+    int64_t clock_offset = 0;
+    std::string device_path = "/onvif/device_service";
+    std::string media_path = "/onvif/media_service";
+    std::string ptz_path = "/onvif/ptz_service";
+};
+
+// Outcome of one call. `error` is empty on success, otherwise it names a
+// transport failure, an unexpected HTTP status or the reason of a SOAP fault.
+struct OnvifResult {
+    int status = 0;                     // HTTP status, 0 when no response arrived
+    std::string error;
+    std::string body;                   // response envelope
+    bool ok() const { return error.empty(); }
+};
+
+struct OnvifDeviceInformation {
+    std::string manufacturer;
+    std::string model;
+    std::string firmware_version;
+    std::string serial_number;
+    std::string hardware_id;
+};
+
+struct OnvifCapabilities {
+    std::string device_xaddr;
+    std::string media_xaddr;
+    std::string ptz_xaddr;              // empty without PTZ
+    std::string events_xaddr;
+};
+
+struct OnvifProfile {
+    std::string token;
+    std::string name;
+    std::string encoding;               // empty without a video encoder
+    int width = 0;
+    int height = 0;
+    int frame_rate = 0;
+    int bitrate = 0;
+};
+
+struct OnvifPreset {
+    std::string token;
+    std::string name;
+};
+
+class OnvifClient {
+public:
+    using Callback = std::function<void(const OnvifResult&)>;
+    template <typename T>
+    using Reply = std::function<void(const OnvifResult&, const T&)>;
+
+    OnvifClient();
+    ~OnvifClient();
+    OnvifClient(const OnvifClient&) = delete;
+    OnvifClient& operator=(const OnvifClient&) = delete;
+
+    // Connections kept open per device (host and port). Default 2.
+    void setMaxConnectionsPerHost(int connections) { max_connections_per_host = connections; }
+    // Time a call may take from going out on a connection (connecting
+    // included) to the end of its response. Default 5000 ms.
+    void setTimeout(int milliseconds) { timeout_ms = milliseconds; }
+
+    // Any SOAP operation: `body` goes inside s:Body and may use the tds,
+    // trt, tptz and tt prefixes
+    void call(const OnvifDevice& device, const std::string& path, std::string_view body, Callback done);
+
+    void getSystemDateAndTime(const OnvifDevice& device, Reply<time_t> done);
+    void getDeviceInformation(const OnvifDevice& device, Reply<OnvifDeviceInformation> done);
+    void getCapabilities(const OnvifDevice& device, Reply<OnvifCapabilities> done);
+    void getProfiles(const OnvifDevice& device, Reply<std::vector<OnvifProfile>> done);
+    void getStreamUri(const OnvifDevice& device, const std::string& profile_token, Reply<std::string> done);
+    void continuousMove(const OnvifDevice& device, const std::string& profile_token, double pan, double tilt,
+                        double zoom, Callback done);
+    void stop(const OnvifDevice& device, const std::string& profile_token, Callback done);
+    void getPresets(const OnvifDevice& device, const std::string& profile_token, Reply<std::vector<OnvifPreset>> done);
+    // Stores the current position; replies with the preset token
+    void setPreset(const OnvifDevice& device, const std::string& profile_token, const std::string& name,
+                   Reply<std::string> done);
+    void gotoPreset(const OnvifDevice& device, const std::string& profile_token, const std::string& preset_token,
+                    Callback done);
+    void removePreset(const OnvifDevice& device, const std::string& profile_token, const std::string& preset_token,
+                      Callback done);
+
+    // Waits up to `wait_ms` (-1: until something happens) for network
+    // events, then runs the callbacks of finished calls. Returns the number
+    // of calls still outstanding.
+    size_t poll(int wait_ms);
+    // Polls until every call has finished
+    void run();
+    size_t outstanding() const { return outstanding_calls; }
+    // An epoll descriptor that becomes readable when poll() has work, for
+    // embedding the client in another event loop. Such a loop waits at most
+    // timeoutMs() (-1: no limit) and then calls poll(0).
+    int fd() const { return epoll_fd; }
+    int timeoutMs() const;
+
+    // Text of the first element named `name` after `from`, whatever its
+    // namespace prefix; empty if there is none
+    static std::string_view elementText(std::string_view xml, std::string_view name, size_t from = 0);
+
+private:
+    struct Pool;
+    struct Connection;
+    struct Resolver;
+
+    // A call waiting for or using a connection. The HTTP message is put
+    // together when the call goes out, so the WS-Security nonce and Created
+    // time are fresh for every attempt.
+    struct Request {
+        std::string path;
+        std::string body;               // inside s:Body
+        std::string username;
+        std::string password;
+        int64_t clock_offset = 0;
+        std::string message;            // HTTP request of the current attempt
+        Callback done;
+        bool retried = false;
+    };
+
+    // Why a connection is given up
+    enum Failure {
+        FAILURE_ERROR,                  // the call fails
+        FAILURE_PEER_CLOSED             // closed or reset by the device, which may have timed out a kept-alive connection
+    };
+
+    Pool* pool(const OnvifDevice& device);
+    bool startLookup(Pool* pool, const OnvifDevice& device);
+    void finishLookups();
+    void submit(Pool* pool, Request request);
+    void dispatch(Pool* pool);
+    void startRequest(Connection* conn, Request request);
+    bool openConnection(Pool* pool, Connection*& conn, std::string& error);
+    void handleEvent(Connection* conn, uint32_t events);
+    bool sendPending(Connection* conn);
+    bool receive(Connection* conn, bool& closed);
+    bool responseComplete(Connection* conn);
+    void finishRequest(Connection* conn);
+    void failConnection(Connection* conn, const std::string& error, Failure failure = FAILURE_ERROR);
+    void closeConnection(Connection* conn);
+    void complete(Request& request, OnvifResult& result);
+    void armTimer(Connection* conn);
+    void cancelTimer(Connection* conn);
+    void expireTimers();
+    void freeClosed();
+    std::string securityHeader(const Request& request);
+
+    int epoll_fd;
+    int max_connections_per_host;
+    int timeout_ms;
+    size_t outstanding_calls;
+    std::unordered_map<std::string, std::unique_ptr<Pool>> pools;
+    // Deadlines of connections with a request in flight
+    std::multimap<uint64_t, Connection*> timers;
+    // Closed during this poll(); freed once no event can refer to them
+    std::vector<Connection*> closed;
+    // Finished calls whose callbacks have yet to run
+    std::deque<std::pair<Callback, OnvifResult>> finished;
+    // Started with the first host name to look up
+    std::unique_ptr<Resolver> resolver;
+};
+
+#endif
@@ -0,0 +1,186 @@
+// The operations of onvif_example.py through OnvifClient, plus a load mode
+// that keeps many calls in flight against one device.
+//
+//     ./onvif_example localhost 8080 user user123
+//     ./onvif_example localhost 8080 user user123 --load 100000 --connections 8
+
+#include "onvif_client.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+static void printResult(const char* operation, const OnvifResult& result) {
+    if (!result.ok()) {
+        std::cout << operation << " failed: " << result.error << std::endl;
+    }
+}
+
+// Calls GetDeviceInformation `calls` times with all of them queued at
+// once, so the pool keeps every connection busy
+static int runLoad(OnvifClient& client, const OnvifDevice& device, int calls) {
+    int failed = 0;
+    std::string first_error;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < calls; i++) {
+        client.getDeviceInformation(device, [&](const OnvifResult& result, const OnvifDeviceInformation&) {
+            if (!result.ok() && failed++ == 0) {
+                first_error = result.error;
+            }
+        });
+    }
+    client.run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << calls << " calls in " << std::fixed << std::setprecision(2) << seconds << " s: "
+              << std::setprecision(0) << calls / seconds << " calls/s, " << failed << " failed" << std::endl;
+    if (failed > 0) {
+        std::cout << "First error: " << first_error << std::endl;
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    OnvifDevice device;
+    device.host = "localhost";
+    device.port = 8080;
+    device.username = "user";
+    device.password = "user123";
+    int load = 0;
+    int connections = 2;
+    int positional = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            load = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connections = std::atoi(argv[++i]);
+        } else if (positional == 0) {
+            device.host = argv[i];
+            positional++;
+        } else if (positional == 1) {
+            device.port = std::atoi(argv[i]);
+            positional++;
+        } else if (positional == 2) {
+            device.username = argv[i];
+            positional++;
+        } else if (positional == 3) {
+            device.password = argv[i];
+            positional++;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [host] [port] [username] [password] [--load calls] [--connections n]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    OnvifClient client;
+    client.setMaxConnectionsPerHost(connections);
+
+    // Digests are checked against the device clock
+    client.getSystemDateAndTime(device, [&](const OnvifResult& result, const time_t& utc) {
+        if (result.ok()) {
+            device.clock_offset = utc - time(nullptr);
+        }
+    });
+    client.run();
+
+    if (load > 0) {
+        return runLoad(client, device, load);
+    }
+
+    bool connected = false;
+    client.getDeviceInformation(device, [&](const OnvifResult& result, const OnvifDeviceInformation& info) {
+        printResult("GetDeviceInformation", result);
+        if (!result.ok()) {
+            return;
+        }
+        connected = true;
+        std::cout << "\n=== Device Information ===" << std::endl;
+        std::cout << "Manufacturer: " << info.manufacturer << std::endl;
+        std::cout << "Model: " << info.model << std::endl;
+        std::cout << "Firmware Version: " << info.firmware_version << std::endl;
+        std::cout << "Serial Number: " << info.serial_number << std::endl;
+        std::cout << "Hardware ID: " << info.hardware_id << std::endl;
+    });
+    client.run();
+    if (!connected) {
+        std::cout << "Failed to connect to camera" << std::endl;
+        return 1;
+    }
+
+    bool ptz = false;
+    client.getCapabilities(device, [&](const OnvifResult& result, const OnvifCapabilities& capabilities) {
+        printResult("GetCapabilities", result);
+        std::cout << "\n=== Device Capabilities ===" << std::endl;
+        std::cout << "Media Service: " << capabilities.media_xaddr << std::endl;
+        if (!capabilities.ptz_xaddr.empty()) {
+            std::cout << "PTZ Service: " << capabilities.ptz_xaddr << std::endl;
+            ptz = true;
+        }
+        std::cout << "Events Service: " << capabilities.events_xaddr << std::endl;
+    });
+    std::vector<OnvifProfile> profiles;
+    client.getProfiles(device, [&](const OnvifResult& result, const std::vector<OnvifProfile>& found) {
+        printResult("GetProfiles", result);
+        profiles = found;
+    });
+    client.run();
+
+    std::cout << "\n=== Media Profiles ===" << std::endl;
+    for (size_t i = 0; i < profiles.size(); i++) {
+        const OnvifProfile& profile = profiles[i];
+        std::cout << "Profile " << i + 1 << ":\n  Name: " << profile.name << "\n  Token: " << profile.token << std::endl;
+        if (!profile.encoding.empty()) {
+            std::cout << "  Video Encoding: " << profile.encoding << "\n  Resolution: " << profile.width << "x"
+                      << profile.height << "\n  Frame Rate: " << profile.frame_rate << "\n  Bitrate: " << profile.bitrate
+                      << std::endl;
+        }
+    }
+    if (profiles.empty()) {
+        return 1;
+    }
+    const std::string& token = profiles.front().token;
+
+    client.getStreamUri(device, token, [&](const OnvifResult& result, const std::string& uri) {
+        printResult("GetStreamUri", result);
+        if (result.ok()) {
+            std::cout << "\n=== Stream URI ===\nProfile: " << profiles.front().name << "\nStream URI: " << uri << std::endl;
+        }
+    });
+    client.run();
+    if (!ptz) {
+        std::cout << "PTZ service not available" << std::endl;
+        return 0;
+    }
+
+    client.getPresets(device, token, [&](const OnvifResult& result, const std::vector<OnvifPreset>& presets) {
+        printResult("GetPresets", result);
+        std::cout << "\n=== PTZ Presets ===" << std::endl;
+        for (const auto& preset : presets) {
+            std::cout << "Preset: " << preset.name << " (Token: " << preset.token << ")" << std::endl;
+        }
+    });
+    client.run();
+
+    std::cout << "\nTesting PTZ movement..." << std::endl;
+    client.continuousMove(device, token, 0.5, 0, 0, [](const OnvifResult& result) {
+        printResult("ContinuousMove", result);
+        if (result.ok()) {
+            std::cout << "PTZ command sent: Pan=0.5, Tilt=0, Zoom=0" << std::endl;
+        }
+    });
+    client.run();
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    client.stop(device, token, [](const OnvifResult& result) {
+        printResult("Stop", result);
+        if (result.ok()) {
+            std::cout << "PTZ movement stopped" << std::endl;
+        }
+    });
+    client.run();
+
+    std::cout << "\nONVIF operations completed successfully!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,530 @@
+// Fleet health poller. Polls GetSystemDateAndTime, GetDeviceInformation
+// and GetProfiles on every device of an inventory, spread evenly over the
+// polling interval, and prints a line only when something changes: a
+// response that hashes differently from the previous one, a device going
+// down or coming back, or a device clock drifting. Slow and failing
+// devices are polled less often until they recover.
+//
+//     ./onvif_poller --inventory cameras.txt --user admin --password secret
+//     ./onvif_poller --fleet 50@8080             # onvif_server --devices 50 --port 8080
+//     ./onvif_poller --loopback 10000@8080       # 127.0.x.y addresses, one onvif_server
+
+#include "onvif_client.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+static uint64_t steadyMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string utcNow() {
+    time_t now = time(nullptr);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    char text[32];
+    strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    return text;
+}
+
+enum Operation {
+    OP_DATE_TIME,
+    OP_DEVICE_INFORMATION,
+    OP_PROFILES,
+    OPERATION_COUNT
+};
+static const char* const OPERATION_NAMES[OPERATION_COUNT] = {
+    "GetSystemDateAndTime", "GetDeviceInformation", "GetProfiles"
+};
+
+// Hashed timing wheel of device indices. A slot holds the devices due at
+// every tick congruent to it; one due on a later revolution stays in its
+// slot until its tick comes round.
+class PollWheel {
+public:
+    static const uint64_t TICK_MS = 10;
+    static const size_t SLOTS = 4096;   // 41 s per revolution
+
+    explicit PollWheel(uint64_t now_ms) : slots(SLOTS), tick(now_ms / TICK_MS + 1) {}
+
+    // Due no earlier than the next tick
+    void schedule(uint32_t device, uint64_t due_ms) {
+        uint64_t due = std::max(due_ms / TICK_MS, tick);
+        slots[due % SLOTS].push_back({device, due});
+    }
+
+    template <typename Fire>
+    void advance(uint64_t now_ms, Fire fire) {
+        for (; tick <= now_ms / TICK_MS; tick++) {
+            std::vector<Entry>& slot = slots[tick % SLOTS];
+            for (size_t i = 0; i < slot.size();) {
+                if (slot[i].due > tick) {
+                    i++;
+                    continue;
+                }
+                uint32_t device = slot[i].device;
+                slot[i] = slot.back();
+                slot.pop_back();
+                fire(device);
+            }
+        }
+    }
+
+    // Milliseconds until the next occupied slot, -1 if there is none
+    int timeoutMs(uint64_t now_ms) const {
+        for (size_t i = 0; i < SLOTS; i++) {
+            if (!slots[(tick + i) % SLOTS].empty()) {
+                uint64_t at = (tick + i) * TICK_MS;
+                return at <= now_ms ? 0 : int(at - now_ms);
+            }
+        }
+        return -1;
+    }
+
+private:
+    struct Entry {
+        uint32_t device;
+        uint64_t due;                   // tick
+    };
+    std::vector<std::vector<Entry>> slots;
+    uint64_t tick;                      // next tick to fire
+};
+
+struct Device {
+    OnvifDevice target;
+    std::string name;                   // host:port in reports
+    enum State { UNKNOWN, UP, DOWN } state = UNKNOWN;
+    uint64_t hashes[OPERATION_COUNT] = {};  // 0: no response seen yet
+    bool offset_known = false;
+    int64_t reported_offset = 0;
+    uint64_t interval_ms = 0;
+    uint64_t due_ms = 0;
+    int failures = 0;                   // consecutive failed polls
+    // Poll in progress
+    int pending = 0;
+    std::string error;
+    uint64_t started_ms = 0;
+    uint64_t latency_ms = 0;
+};
+
+class Poller {
+public:
+    uint64_t interval_ms = 10000;
+    uint64_t max_interval_ms = 300000;
+    uint64_t slow_ms = 1000;
+    int64_t skew_seconds = 5;
+    std::vector<Device> devices;
+
+    explicit Poller(OnvifClient& client) : client(client), wheel(steadyMs()), random(std::random_device()()) {}
+
+    // Spreads the first polls evenly over one interval
+    void start() {
+        uint64_t now = steadyMs();
+        for (size_t i = 0; i < devices.size(); i++) {
+            devices[i].interval_ms = interval_ms;
+            devices[i].due_ms = now + interval_ms * i / devices.size();
+            wheel.schedule(uint32_t(i), devices[i].due_ms);
+        }
+    }
+
+    int timeoutMs() const {
+        return wheel.timeoutMs(steadyMs());
+    }
+
+    void advance() {
+        wheel.advance(steadyMs(), [this](uint32_t index) { poll(index); });
+    }
+
+    void printStats(double seconds) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+        size_t up = 0, down = 0;
+        for (const Device& device : devices) {
+            up += device.state == Device::UP;
+            down += device.state == Device::DOWN;
+        }
+        std::cerr << std::fixed << std::setprecision(0) << "[stats] " << devices.size() << " devices: " << up << " up, "
+                  << down << " down | " << (calls - last.calls) / seconds << " calls/s, " << failed_calls - last.failed_calls
+                  << " failed | " << polls - last.polls << " polls, mean "
+                  << std::setprecision(1) << (polls > last.polls ? double(latency_total - last.latency_total) / (polls - last.polls) : 0)
+                  << " ms, " << slow_polls - last.slow_polls << " slow | " << changes - last.changes << " changes | cpu "
+                  << std::setprecision(0) << 100 * (cpu - last.cpu) / seconds << "%" << std::endl;
+        last = {calls, failed_calls, polls, slow_polls, latency_total, changes, cpu};
+    }
+
+private:
+    void poll(uint32_t index) {
+        Device& device = devices[index];
+        device.pending = OPERATION_COUNT;
+        device.error.clear();
+        device.started_ms = steadyMs();
+        device.latency_ms = 0;
+        client.getSystemDateAndTime(device.target, [this, index](const OnvifResult& result, const time_t& utc) {
+            if (result.ok()) {
+                checkClock(devices[index], int64_t(utc) - int64_t(time(nullptr)));
+            }
+            finishCall(index, OP_DATE_TIME, result);
+        });
+        client.call(device.target, device.target.device_path, "<tds:GetDeviceInformation/>",
+                    [this, index](const OnvifResult& result) { finishCall(index, OP_DEVICE_INFORMATION, result); });
+        client.call(device.target, device.target.media_path, "<trt:GetProfiles/>",
+                    [this, index](const OnvifResult& result) { finishCall(index, OP_PROFILES, result); });
+    }
+
+    // FNV-1a of the response, leaving out the clock readings of
+    // GetSystemDateAndTime, which change on every poll
+    static uint64_t responseHash(Operation operation, std::string_view body) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        auto add = [&](std::string_view part) {
+            for (unsigned char c : part) {
+                hash = (hash ^ c) * 0x100000001b3ull;
+            }
+        };
+        if (operation == OP_DATE_TIME) {
+            for (const char* element : {"UTCDateTime", "LocalDateTime"}) {
+                std::string_view reading = OnvifClient::elementText(body, element);
+                if (!reading.empty()) {
+                    size_t at = reading.data() - body.data();
+                    add(body.substr(0, at));
+                    body = body.substr(at + reading.size());
+                }
+            }
+        }
+        add(body);
+        return hash;
+    }
+
+    void checkClock(Device& device, int64_t offset) {
+        device.target.clock_offset = offset;
+        if (device.offset_known ? std::llabs(offset - device.reported_offset) < skew_seconds
+                                : std::llabs(offset) < skew_seconds) {
+            device.offset_known = true;
+            return;
+        }
+        device.offset_known = true;
+        device.reported_offset = offset;
+        report(device) << "clock offset " << std::showpos << offset << std::noshowpos << " s" << std::endl;
+    }
+
+    void finishCall(uint32_t index, Operation operation, const OnvifResult& result) {
+        Device& device = devices[index];
+        device.latency_ms = std::max(device.latency_ms, steadyMs() - device.started_ms);
+        calls++;
+        if (!result.ok()) {
+            failed_calls++;
+            if (device.error.empty()) {
+                device.error = std::string(OPERATION_NAMES[operation]) + ": " + result.error;
+            }
+        } else {
+            uint64_t hash = responseHash(operation, result.body);
+            if (device.hashes[operation] != 0 && device.hashes[operation] != hash) {
+                changes++;
+                report(device) << OPERATION_NAMES[operation] << " changed" << std::endl;
+            }
+            device.hashes[operation] = hash;
+        }
+        if (--device.pending == 0) {
+            finishPoll(index);
+        }
+    }
+
+    // Failures double the interval, slow answers stretch it by half, and
+    // each quick answer halves it again down to the configured interval.
+    // The next poll keeps the device's place in the schedule, so devices
+    // stay spread out.
+    void finishPoll(uint32_t index) {
+        Device& device = devices[index];
+        uint64_t now = steadyMs();
+        polls++;
+        latency_total += device.latency_ms;
+        uint64_t jitter = 0;
+        if (!device.error.empty()) {
+            device.failures++;
+            if (device.state != Device::DOWN) {
+                report(device) << "down: " << device.error << std::endl;
+            }
+            device.state = Device::DOWN;
+            device.interval_ms = std::min(device.interval_ms * 2, max_interval_ms);
+            // Devices that failed together do not come back together
+            jitter = std::uniform_int_distribution<uint64_t>(0, device.interval_ms / 10)(random);
+        } else {
+            if (device.state == Device::DOWN) {
+                report(device) << "up after " << device.failures << " failed polls" << std::endl;
+            }
+            device.state = Device::UP;
+            device.failures = 0;
+            if (device.latency_ms > slow_ms) {
+                slow_polls++;
+                device.interval_ms = std::min(device.interval_ms * 3 / 2, max_interval_ms);
+            } else {
+                device.interval_ms = std::max(device.interval_ms / 2, interval_ms);
+            }
+        }
+        device.due_ms = std::max(device.due_ms + device.interval_ms, now) + jitter;
+        wheel.schedule(index, device.due_ms);
+    }
+
+    std::ostream& report(const Device& device) {
+        return std::cout << utcNow() << " " << device.name << " ";
+    }
+
+    OnvifClient& client;
+    PollWheel wheel;
+    std::mt19937_64 random;
+    uint64_t calls = 0;
+    uint64_t failed_calls = 0;
+    uint64_t polls = 0;
+    uint64_t slow_polls = 0;
+    uint64_t latency_total = 0;
+    uint64_t changes = 0;
+    struct {
+        uint64_t calls, failed_calls, polls, slow_polls, latency_total, changes;
+        double cpu;
+    } last = {};
+};
+
+// "host[:port]", "[v6 address]:port" or a bare IPv6 address
+static bool parseAddress(const std::string& text, OnvifDevice& device) {
+    device.port = 80;
+    if (!text.empty() && text[0] == '[') {
+        size_t close = text.find(']');
+        if (close == std::string::npos) {
+            return false;
+        }
+        device.host = text.substr(1, close - 1);
+        if (close + 1 < text.size()) {
+            if (text[close + 1] != ':') {
+                return false;
+            }
+            device.port = std::atoi(text.c_str() + close + 2);
+        }
+    } else if (std::count(text.begin(), text.end(), ':') == 1) {
+        size_t colon = text.find(':');
+        device.host = text.substr(0, colon);
+        device.port = std::atoi(text.c_str() + colon + 1);
+    } else {
+        device.host = text;
+    }
+    return !device.host.empty() && device.port > 0 && device.port < 65536;
+}
+
+// One device per line: "<address> [<username> <password>]"; # starts a comment
+static bool loadInventory(const std::string& path, std::vector<Device>& devices) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    int number = 0;
+    while (std::getline(file, line)) {
+        number++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string address;
+        if (!(fields >> address)) {
+            continue;
+        }
+        Device device;
+        if (!parseAddress(address, device.target)) {
+            std::cerr << path << ":" << number << ": invalid address " << address << std::endl;
+            return false;
+        }
+        fields >> device.target.username >> device.target.password;
+        device.name = address;
+        devices.push_back(std::move(device));
+    }
+    return true;
+}
+
+// "<count>[@<port>]"
+static bool parseFleet(const char* spec, int& count, int& port) {
+    char* end;
+    count = std::strtol(spec, &end, 10);
+    port = *end == '@' ? std::atoi(end + 1) : 8080;
+    return count > 0 && (*end == '\0' || *end == '@') && port > 0 && port < 65536;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> inventories;
+    std::vector<std::pair<int, int>> fleets;       // count, first port
+    std::vector<std::pair<int, int>> loopbacks;    // count, port
+    std::string username, password;
+    double interval = 10, max_interval = 300, stats_interval = 10, duration = 0;
+    int slow_ms = 1000, timeout_ms = 5000, connections = 1, skew = 5;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        int count, port;
+        if (arg == "--inventory" && i + 1 < argc) {
+            inventories.push_back(argv[++i]);
+        } else if (arg == "--fleet" && i + 1 < argc && parseFleet(argv[i + 1], count, port)) {
+            fleets.emplace_back(count, port);
+            i++;
+        } else if (arg == "--loopback" && i + 1 < argc && parseFleet(argv[i + 1], count, port)) {
+            loopbacks.emplace_back(count, port);
+            i++;
+        } else if (arg == "--user" && i + 1 < argc) {
+            username = argv[++i];
+        } else if (arg == "--password" && i + 1 < argc) {
+            password = argv[++i];
+        } else if (arg == "--interval" && i + 1 < argc) {
+            interval = std::atof(argv[++i]);
+        } else if (arg == "--max-interval" && i + 1 < argc) {
+            max_interval = std::atof(argv[++i]);
+        } else if (arg == "--slow" && i + 1 < argc) {
+            slow_ms = std::atoi(argv[++i]);
+        } else if (arg == "--timeout" && i + 1 < argc) {
+            timeout_ms = std::atoi(argv[++i]);
+        } else if (arg == "--connections" && i + 1 < argc) {
+            connections = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--skew" && i + 1 < argc) {
+            skew = std::atoi(argv[++i]);
+        } else if (arg == "--stats" && i + 1 < argc) {
+            stats_interval = std::atof(argv[++i]);
+        } else if (arg == "--duration" && i + 1 < argc) {
+            duration = std::atof(argv[++i]);
+        } else {
+            std::cout << "Usage: " << argv[0] << " [options]" << std::endl;
+            std::cout << "Devices:" << std::endl;
+            std::cout << "  --inventory <file>            \"<host>[:<port>] [<user> <password>]\" per line" << std::endl;
+            std::cout << "  --fleet <n>[@<port>]          n devices on 127.0.0.1, consecutive ports from <port>" << std::endl;
+            std::cout << "                                (onvif_server --devices n)" << std::endl;
+            std::cout << "  --loopback <n>[@<port>]       n devices on 127.0.0.1, 127.0.0.2, ... sharing <port>" << std::endl;
+            std::cout << "  --user <name> --password <pw> Credentials for devices without their own" << std::endl;
+            std::cout << "Options:" << std::endl;
+            std::cout << "  --interval <seconds>          Time between polls of a device (default: 10)" << std::endl;
+            std::cout << "  --max-interval <seconds>      Longest backoff for failing devices (default: 300)" << std::endl;
+            std::cout << "  --slow <ms>                   Polls slower than this back off (default: 1000)" << std::endl;
+            std::cout << "  --timeout <ms>                Time allowed for one call (default: 5000)" << std::endl;
+            std::cout << "  --connections <n>             Connections per device (default: 1)" << std::endl;
+            std::cout << "  --skew <seconds>              Clock offset change worth reporting (default: 5)" << std::endl;
+            std::cout << "  --stats <seconds>             Statistics to stderr, 0 for none (default: 10)" << std::endl;
+            std::cout << "  --duration <seconds>          Stop after this long (default: until SIGTERM)" << std::endl;
+            return -1;
+        }
+    }
+
+    OnvifClient client;
+    client.setTimeout(timeout_ms);
+    client.setMaxConnectionsPerHost(connections);
+    Poller poller(client);
+    poller.interval_ms = uint64_t(std::max(0.1, interval) * 1000);
+    poller.max_interval_ms = std::max(poller.interval_ms, uint64_t(max_interval * 1000));
+    poller.slow_ms = slow_ms;
+    poller.skew_seconds = skew;
+
+    for (const auto& path : inventories) {
+        if (!loadInventory(path, poller.devices)) {
+            std::cerr << "Could not read inventory " << path << std::endl;
+            return -1;
+        }
+    }
+    for (const auto& fleet : fleets) {
+        for (int i = 0; i < fleet.first; i++) {
+            Device device;
+            device.target.host = "127.0.0.1";
+            device.target.port = fleet.second + i;
+            device.name = "127.0.0.1:" + std::to_string(device.target.port);
+            poller.devices.push_back(std::move(device));
+        }
+    }
+    for (const auto& loopback : loopbacks) {
+        for (int i = 1; i <= loopback.first; i++) {
+            Device device;
+            device.target.host = "127." + std::to_string((i >> 16) & 255) + "." + std::to_string((i >> 8) & 255) + "." +
+                                 std::to_string(i & 255);
+            device.target.port = loopback.second;
+            device.name = device.target.host + ":" + std::to_string(loopback.second);
+            poller.devices.push_back(std::move(device));
+        }
+    }
+    if (poller.devices.empty()) {
+        std::cerr << "No devices; see --inventory, --fleet and --loopback" << std::endl;
+        return -1;
+    }
+    for (Device& device : poller.devices) {
+        if (device.target.username.empty()) {
+            device.target.username = username;
+            device.target.password = password;
+        }
+    }
+
+    // Keep-alive connections to every device, plus those being opened
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &stop_signals, nullptr);
+    int signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+
+    std::cerr << "Polling " << poller.devices.size() << " devices every " << interval << " s" << std::endl;
+    poller.start();
+    uint64_t started = steadyMs();
+    uint64_t stats_ms = uint64_t(stats_interval * 1000);
+    uint64_t next_stats = started + stats_ms;
+    uint64_t stats_start = started;
+    uint64_t end = duration > 0 ? started + uint64_t(duration * 1000) : 0;
+
+    struct pollfd waits[2] = {{client.fd(), POLLIN, 0}, {signal_fd, POLLIN, 0}};
+    for (;;) {
+        uint64_t now = steadyMs();
+        int wait = -1;
+        auto until = [&](uint64_t at) {
+            int ms = at <= now ? 0 : int(at - now);
+            wait = wait < 0 ? ms : std::min(wait, ms);
+        };
+        for (int timeout : {poller.timeoutMs(), client.timeoutMs()}) {
+            if (timeout >= 0) {
+                until(now + timeout);
+            }
+        }
+        if (stats_ms > 0) {
+            until(next_stats);
+        }
+        if (end > 0) {
+            until(end);
+        }
+        ::poll(waits, signal_fd >= 0 ? 2 : 1, wait);
+        if (waits[1].revents) {
+            break;
+        }
+        client.poll(0);
+        poller.advance();
+
+        now = steadyMs();
+        if (stats_ms > 0 && now >= next_stats) {
+            poller.printStats((now - stats_start) / 1000.0);
+            stats_start = now;
+            next_stats = now + stats_ms;
+        }
+        if (end > 0 && now >= end) {
+            break;
+        }
+    }
+    std::cout << std::flush;
+    if (signal_fd >= 0) {
+        close(signal_fd);
+    }
+    return 0;
+}
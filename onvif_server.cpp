@@ -2,427 +2,7201 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <queue>
+#include <deque>
+#include <random>
+#include <atomic>
+#include <cmath>
 #include <memory>
+#include <memory_resource>
 #include <thread>
 #include <mutex>
 #include <chrono>
 #include <sstream>
 #include <ctime>
 #include <iomanip>
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <iterator>
+#include <cctype>
+#include <charconv>
+#include <string_view>
+#include <type_traits>
+#include <cstdlib>
+#include <climits>
+#include <cerrno>
+#include <csignal>
 
 // Basic HTTP server functionality
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <cstring>
+#include <strings.h>
 
-class OnvifServer {
+// Linux event loop and zero-copy file sends
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+
+// HTTPS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+// Pulled in through <linux/fs.h>, clashes with RequestArena::BLOCK_SIZE
+#undef BLOCK_SIZE
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static uint64_t steadyMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Device wall clock, refreshed once per second by an event loop timer.
+// The current second is kept together with its xs:dateTime text, so
+// responses copy a cached string instead of going through gmtime and
+// strftime. An offset makes the device run ahead of or behind the host,
+// the way a badly set camera does.
+class CoarseClock {
+public:
+    struct Civil {
+        int year;
+        unsigned month;
+        unsigned day;
+        unsigned hour;
+        unsigned minute;
+        unsigned second;
+    };
+    
+    static const size_t TEXT_LENGTH = 20;   // 2024-01-01T12:00:00Z
+    
+    CoarseClock() : host_second(0), offset(0), second(0) {
+        update();
+    }
+    
+    // Re-reads the host clock (a vDSO call) and returns the milliseconds
+    // until the next second starts
+    uint64_t update() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        if (ts.tv_sec != host_second) {
+            host_second = ts.tv_sec;
+            refresh();
+        }
+        return 1000 - ts.tv_nsec / 1000000;
+    }
+    
+    // Device time in seconds since the epoch
+    int64_t now() const {
+        return second;
+    }
+    
+    const char* text() const {
+        return cached_text;
+    }
+    
+    void setOffset(int64_t seconds) {
+        offset = seconds;
+        refresh();
+    }
+    
+    int64_t getOffset() const {
+        return offset;
+    }
+    
+    // Makes the device clock read `device_time` now
+    void set(int64_t device_time) {
+        setOffset(device_time - host_second);
+    }
+    
+    // Days since 1970-01-01 to a proleptic Gregorian date, after
+    // Howard Hinnant's civil_from_days
+    static Civil toCivil(int64_t time) {
+        int64_t days = time >= 0 ? time / 86400 : (time - 86399) / 86400;
+        int64_t rest = time - days * 86400;
+        days += 719468;
+        int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+        unsigned day_of_era = static_cast<unsigned>(days - era * 146097);
+        unsigned year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+        unsigned day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+        unsigned mp = (5 * day_of_year + 2) / 153;
+        Civil civil;
+        civil.day = day_of_year - (153 * mp + 2) / 5 + 1;
+        civil.month = mp < 10 ? mp + 3 : mp - 9;
+        civil.year = static_cast<int>(year_of_era + era * 400 + (civil.month <= 2));
+        civil.hour = static_cast<unsigned>(rest / 3600);
+        civil.minute = static_cast<unsigned>(rest / 60 % 60);
+        civil.second = static_cast<unsigned>(rest % 60);
+        return civil;
+    }
+    
+    // Inverse of toCivil (days_from_civil)
+    static int64_t fromCivil(const Civil& civil) {
+        int year = civil.year - (civil.month <= 2);
+        int64_t era = (year >= 0 ? year : year - 399) / 400;
+        unsigned year_of_era = static_cast<unsigned>(year - era * 400);
+        unsigned day_of_year = (153 * (civil.month > 2 ? civil.month - 3 : civil.month + 9) + 2) / 5 + civil.day - 1;
+        unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+        int64_t days = era * 146097 + day_of_era - 719468;
+        return days * 86400 + civil.hour * 3600 + civil.minute * 60 + civil.second;
+    }
+    
+    // Writes TEXT_LENGTH characters of xs:dateTime in UTC
+    static void format(int64_t time, char* out) {
+        Civil c = toCivil(time);
+        auto two = [](char* at, unsigned value) {
+            at[0] = static_cast<char>('0' + value / 10);
+            at[1] = static_cast<char>('0' + value % 10);
+        };
+        unsigned year = static_cast<unsigned>(c.year) % 10000;
+        two(out, year / 100);
+        two(out + 2, year % 100);
+        out[4] = '-';
+        two(out + 5, c.month);
+        out[7] = '-';
+        two(out + 8, c.day);
+        out[10] = 'T';
+        two(out + 11, c.hour);
+        out[13] = ':';
+        two(out + 14, c.minute);
+        out[16] = ':';
+        two(out + 17, c.second);
+        out[19] = 'Z';
+    }
+    
+    static std::string format(int64_t time) {
+        char text[TEXT_LENGTH];
+        format(time, text);
+        return std::string(text, TEXT_LENGTH);
+    }
+    
+    // Parses xs:dateTime, YYYY-MM-DDThh:mm:ss with an optional fraction,
+    // followed by Z, a +hh:mm or -hh:mm offset, or nothing (taken as UTC)
+    static bool parse(const std::string& text, int64_t& time) {
+        Civil c;
+        int consumed = 0;
+        if (sscanf(text.c_str(), "%4d-%2u-%2uT%2u:%2u:%2u%n", &c.year, &c.month, &c.day,
+                   &c.hour, &c.minute, &c.second, &consumed) != 6 ||
+            c.month < 1 || c.month > 12 || c.day < 1 || c.day > 31 || c.hour > 23 || c.minute > 59 || c.second > 60) {
+            return false;
+        }
+        auto digit = [](char d) { return d >= '0' && d <= '9'; };
+        const char* p = text.c_str() + consumed;
+        if (*p == '.') {
+            if (!digit(*++p)) {
+                return false;
+            }
+            while (digit(*p)) {
+                p++;
+            }
+        }
+        int64_t offset = 0;
+        if (*p == 'Z') {
+            p++;
+        } else if (*p == '+' || *p == '-') {
+            if (!digit(p[1]) || !digit(p[2]) || p[3] != ':' || !digit(p[4]) || !digit(p[5])) {
+                return false;
+            }
+            int hours = (p[1] - '0') * 10 + (p[2] - '0');
+            int minutes = (p[4] - '0') * 10 + (p[5] - '0');
+            if (hours > 14 || minutes > 59) {
+                return false;
+            }
+            offset = (*p == '-' ? -1 : 1) * (hours * 3600 + minutes * 60);
+            p += 6;
+        }
+        if (*p != '\0') {
+            return false;
+        }
+        // 12:00+02:00 is 10:00Z
+        time = fromCivil(c) - offset;
+        return true;
+    }
+    
 private:
-    int server_socket;
-    int port;
-    std::string device_uuid;
-    std::string device_name;
-    std::string manufacturer;
-    std::string model;
-    std::string serial_number;
-    std::string firmware_version;
+    int64_t host_second;
+    int64_t offset;
+    int64_t second;
+    char cached_text[TEXT_LENGTH + 1];
     
-    // Media profiles
-    struct MediaProfile {
-        std::string token;
-        std::string name;
-        std::string video_encoder_token;
-        std::string audio_encoder_token;
-        int width;
-        int height;
-        int framerate;
-        int bitrate;
-    };
+    void refresh() {
+        second = host_second + offset;
+        format(second, cached_text);
+        cached_text[TEXT_LENGTH] = '\0';
+    }
+};
+
+// Sinks for the SOAP response renderers. A renderer is written once as a
+// generic lambda and run twice: over an XmlSize to measure the response,
+// then over an XmlWriter into a buffer of exactly that size. String
+// literals keep their compile-time length and numbers are formatted with
+// to_chars, so rendering a response allocates once, for the result.
+class XmlSize {
+public:
+    template <size_t N>
+    XmlSize& operator<<(const char (&)[N]) {
+        length += N - 1;
+        return *this;
+    }
+    
+    XmlSize& operator<<(std::string_view text) {
+        length += text.size();
+        return *this;
+    }
+    
+    template <typename T, typename = std::enable_if_t<std::is_integral<T>::value>>
+    XmlSize& operator<<(T value) {
+        char digits[24];
+        length += std::to_chars(digits, digits + sizeof(digits), value).ptr - digits;
+        return *this;
+    }
+    
+    size_t size() const {
+        return length;
+    }
     
-    std::vector<MediaProfile> media_profiles;
-    std::mutex server_mutex;
-    bool running;
+private:
+    size_t length = 0;
+};
 
+class XmlWriter {
 public:
-    OnvifServer(int port = 8080) : port(port), running(false) {
-        device_uuid = "urn:uuid:12345678-1234-1234-1234-123456789012";
-        device_name = "ONVIF Camera";
-        manufacturer = "Sample Manufacturer";
-        model = "Sample Model";
-        serial_number = "123456789";
-        firmware_version = "1.0.0";
+    explicit XmlWriter(char* out) : pos(out) {}
+    
+    template <size_t N>
+    XmlWriter& operator<<(const char (&literal)[N]) {
+        std::memcpy(pos, literal, N - 1);
+        pos += N - 1;
+        return *this;
+    }
+    
+    XmlWriter& operator<<(std::string_view text) {
+        std::memcpy(pos, text.data(), text.size());
+        pos += text.size();
+        return *this;
+    }
+    
+    template <typename T, typename = std::enable_if_t<std::is_integral<T>::value>>
+    XmlWriter& operator<<(T value) {
+        char digits[24];
+        return *this << std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr - digits);
+    }
+    
+    char* end() const {
+        return pos;
+    }
+    
+private:
+    char* pos;
+};
+
+// Runs `render(sink)` over both sinks and returns the text
+template <typename Render>
+std::string renderXml(Render render) {
+    XmlSize size;
+    render(size);
+    std::string out(size.size(), '\0');
+    XmlWriter writer(&out[0]);
+    render(writer);
+    return out;
+}
+
+// Position of the first of `a`, `b` or `c` in [p, end), or `end`. This is
+// where the XML parser spends its time, skipping text and attribute values,
+// so it compares 32 (AVX2) or 16 (SSE2) bytes per step.
+static inline const char* scanFor(const char* p, const char* end, char a, char b, char c) {
+#if defined(__AVX2__)
+    const __m256i wide_a = _mm256_set1_epi8(a);
+    const __m256i wide_b = _mm256_set1_epi8(b);
+    const __m256i wide_c = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, wide_a), _mm256_cmpeq_epi8(chunk, wide_b)),
+                                       _mm256_cmpeq_epi8(chunk, wide_c));
+        if (uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hits))) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i narrow_a = _mm_set1_epi8(a);
+    const __m128i narrow_b = _mm_set1_epi8(b);
+    const __m128i narrow_c = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, narrow_a), _mm_cmpeq_epi8(chunk, narrow_b)),
+                                    _mm_cmpeq_epi8(chunk, narrow_c));
+        if (uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hits))) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#else
+    if (a == b && b == c) {
+        const void* hit = std::memchr(p, a, end - p);
+        return hit ? static_cast<const char*>(hit) : end;
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == a || *p == b || *p == c) {
+            return p;
+        }
+    }
+    return end;
+}
+
+// Streaming XML reader over a string_view. next() moves from token to token
+// and everything it reports is a view into the input, so nothing is
+// allocated. Namespace declarations are kept on a fixed-size stack and
+// element prefixes resolved against it. Comments and processing
+// instructions are skipped; DTDs are refused. Text is reported raw, with
+// entities left in. An end tag with no open element ends the input, which
+// lets the reader walk a fragment cut out of a larger document.
+class XmlPullParser {
+public:
+    enum Event {
+        START,      // start tag, or an empty element (reported again as END)
+        END,
+        TEXT,       // character data other than whitespace, or a CDATA section
+        DONE,
+        ERROR
+    };
+    
+    static const int MAX_DEPTH = 32;
+    static const int MAX_BINDINGS = 32;
+    
+    explicit XmlPullParser(std::string_view xml, size_t from = 0)
+        : begin(xml.data()), pos(xml.data() + std::min(from, xml.size())), end(xml.data() + xml.size()) {}
+    
+    Event next() {
+        // Declarations of the element closed last go out of scope only now,
+        // so ns() still resolves on its END
+        while (binding_count > 0 && bindings[binding_count - 1].depth > depth) {
+            binding_count--;
+        }
+        if (pending_end) {
+            pending_end = false;
+            return closeElement();
+        }
+        while (pos < end) {
+            if (*pos != '<') {
+                const char* text_start = pos;
+                pos = scanFor(pos, end, '<', '<', '<');
+                for (const char* c = text_start; c < pos; c++) {
+                    if (!isSpace(*c)) {
+                        text = std::string_view(text_start, pos - text_start);
+                        return TEXT;
+                    }
+                }
+                continue;
+            }
+            if (end - pos >= 2 && (pos[1] == '?' || pos[1] == '!')) {
+                Event skipped = skipMarkup();
+                if (skipped != DONE) {
+                    return skipped;
+                }
+                continue;
+            }
+            return pos + 1 < end && pos[1] == '/' ? readEndTag() : readStartTag();
+        }
+        return depth == 0 ? DONE : ERROR;
+    }
+    
+    // Current element: prefix, local name and namespace URI
+    std::string_view prefix() const {
+        return element_prefix;
+    }
+    
+    std::string_view name() const {
+        return element_name;
+    }
+    
+    // Resolved on demand; most elements are only matched by local name
+    std::string_view ns() const {
+        return resolve(element_prefix);
+    }
+    
+    // The whole start tag of the current element, '<' to '>'
+    std::string_view tag() const {
+        return start_tag;
+    }
+    
+    std::string_view value() const {
+        return text;
+    }
+    
+    bool emptyElement() const {
+        return pending_end;
+    }
+    
+    int level() const {
+        return depth;
+    }
+    
+    // Offset in the input just past the last token
+    size_t offset() const {
+        return pos - begin;
+    }
+    
+    // Offset of the last tag's '<'
+    size_t tagOffset() const {
+        return tag_begin - begin;
+    }
+    
+    // Unprefixed attribute of the current start tag, raw
+    std::string_view attribute(std::string_view attribute_name) const {
+        std::string_view attribute_value;
+        const char* p = start_tag.data() + 1;
+        while (!isNameEnd(*p)) {
+            p++;
+        }
+        readAttributes(p, start_tag.data() + start_tag.size(), [&](std::string_view qname, std::string_view v) {
+            if (qname == attribute_name) {
+                attribute_value = v;
+            }
+        });
+        return attribute_value;
+    }
+    
+    std::string_view resolve(std::string_view prefix) const {
+        for (int i = binding_count - 1; i >= 0; i--) {
+            if (bindings[i].prefix.view() == prefix) {
+                return bindings[i].uri.view();
+            }
+        }
+        return prefix == "xml" ? "http://www.w3.org/XML/1998/namespace" : "";
+    }
+    
+    // Skips the rest of the current element, leaving the reader on its END
+    bool skipElement() {
+        int target = depth - 1;
+        Event event;
+        while ((event = next()) != ERROR && event != DONE) {
+            if (event == END && depth == target) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+private:
+    // Plain pointers and lengths rather than string_views, so the stacks
+    // are left uninitialized instead of being cleared for every request
+    struct Span {
+        const char* data;
+        size_t size;
         
-        // Initialize default media profiles
-        initializeMediaProfiles();
+        std::string_view view() const {
+            return std::string_view(data, size);
+        }
+    };
+    
+    struct Binding {
+        Span prefix;
+        Span uri;
+        int depth;
+    };
+    
+    const char* begin;
+    const char* pos;
+    const char* end;
+    const char* tag_begin = nullptr;
+    Span open[MAX_DEPTH];
+    int depth = 0;
+    Binding bindings[MAX_BINDINGS];
+    int binding_count = 0;
+    bool pending_end = false;
+    std::string_view element_prefix;
+    std::string_view element_name;
+    std::string_view start_tag;
+    std::string_view text;
+    
+    static constexpr auto NAME_END = [] {
+        std::array<bool, 256> table{};
+        for (unsigned char c : std::string_view(" \t\r\n>/=")) {
+            table[c] = true;
+        }
+        return table;
+    }();
+    
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+    
+    static bool isNameEnd(char c) {
+        return NAME_END[static_cast<unsigned char>(c)];
+    }
+    
+    // Reads attributes from `p`, just past the element name, and calls
+    // `visit(qualified name, raw value)` for each. Returns the position of
+    // the closing '>' or "/>", or nullptr if the tag is malformed.
+    template <typename Visit>
+    static const char* readAttributes(const char* p, const char* end, Visit visit) {
+        while (true) {
+            while (p < end && isSpace(*p)) {
+                p++;
+            }
+            if (p >= end) {
+                return nullptr;
+            }
+            if (*p == '>' || *p == '/') {
+                return *p == '>' || (p + 1 < end && p[1] == '>') ? p : nullptr;
+            }
+            const char* name_start = p;
+            while (p < end && !isNameEnd(*p)) {
+                p++;
+            }
+            std::string_view qname(name_start, p - name_start);
+            while (p < end && isSpace(*p)) {
+                p++;
+            }
+            if (p >= end || *p != '=' || qname.empty()) {
+                return nullptr;
+            }
+            for (p++; p < end && isSpace(*p); p++) {
+            }
+            if (p >= end || (*p != '"' && *p != '\'')) {
+                return nullptr;
+            }
+            // Values may contain '>', so the end of the tag is only looked
+            // for between attributes
+            const char* value_start = p + 1;
+            p = scanFor(value_start, end, *p, *p, *p);
+            if (p >= end) {
+                return nullptr;
+            }
+            visit(qname, std::string_view(value_start, p - value_start));
+            p++;
+        }
+    }
+    
+    void setName(std::string_view qname) {
+        size_t colon = qname.find(':');
+        element_prefix = colon == std::string_view::npos ? std::string_view() : qname.substr(0, colon);
+        element_name = colon == std::string_view::npos ? qname : qname.substr(colon + 1);
+    }
+    
+    Event readStartTag() {
+        tag_begin = pos;
+        const char* p = pos + 1;
+        while (p < end && !isNameEnd(*p)) {
+            p++;
+        }
+        std::string_view qname(pos + 1, p - pos - 1);
+        if (qname.empty() || depth == MAX_DEPTH) {
+            return ERROR;
+        }
+        bool overflow = false;
+        p = readAttributes(p, end, [&](std::string_view attribute_name, std::string_view uri) {
+            if (attribute_name.compare(0, 5, "xmlns") != 0 || (attribute_name.size() > 5 && attribute_name[5] != ':')) {
+                return;
+            }
+            if (binding_count == MAX_BINDINGS) {
+                overflow = true;
+                return;
+            }
+            std::string_view prefix = attribute_name.substr(std::min<size_t>(6, attribute_name.size()));
+            bindings[binding_count++] = Binding{{prefix.data(), prefix.size()}, {uri.data(), uri.size()}, depth + 1};
+        });
+        if (!p || overflow) {
+            return ERROR;
+        }
+        pending_end = *p == '/';
+        p += pending_end ? 2 : 1;
+        start_tag = std::string_view(pos, p - pos);
+        pos = p;
+        open[depth++] = Span{qname.data(), qname.size()};
+        setName(qname);
+        return START;
+    }
+    
+    Event readEndTag() {
+        tag_begin = pos;
+        const char* p = scanFor(pos, end, '>', '>', '>');
+        if (p >= end) {
+            return ERROR;
+        }
+        std::string_view qname(pos + 2, p - pos - 2);
+        while (!qname.empty() && isSpace(qname.back())) {
+            qname.remove_suffix(1);
+        }
+        pos = p + 1;
+        if (depth == 0) {
+            // Closing tag of whatever contains the fragment
+            pos = tag_begin;
+            return DONE;
+        }
+        if (qname != open[depth - 1].view()) {
+            return ERROR;
+        }
+        return closeElement();
+    }
+    
+    Event closeElement() {
+        std::string_view qname = open[depth - 1].view();
+        setName(qname);
+        depth--;
+        return END;
+    }
+    
+    // Comment, processing instruction or CDATA section at `pos`. Returns
+    // DONE once skipped, TEXT for CDATA content.
+    Event skipMarkup() {
+        std::string_view rest(pos, end - pos);
+        size_t close;
+        if (rest.compare(0, 4, "<!--") == 0) {
+            close = rest.find("-->", 4);
+            pos = close == std::string_view::npos ? end : pos + close + 3;
+            return close == std::string_view::npos ? ERROR : DONE;
+        }
+        if (rest.compare(0, 2, "<?") == 0) {
+            close = rest.find("?>", 2);
+            pos = close == std::string_view::npos ? end : pos + close + 2;
+            return close == std::string_view::npos ? ERROR : DONE;
+        }
+        if (rest.compare(0, 9, "<![CDATA[") == 0) {
+            close = rest.find("]]>", 9);
+            if (close == std::string_view::npos) {
+                return ERROR;
+            }
+            text = rest.substr(9, close - 9);
+            pos += close + 3;
+            return TEXT;
+        }
+        return ERROR;
+    }
+};
+
+// A SOAP request read in one pass of the pull parser: the operation (first
+// child of Body), the leaf elements below it and the WS-Security
+// UsernameToken from the Header. All fields are views into the request.
+struct SoapMessage {
+    static const int MAX_FIELDS = 64;
+    
+    struct Field {
+        std::string_view name;
+        std::string_view text;
+    };
+    
+    struct UsernameToken {
+        std::string_view username;
+        std::string_view password;
+        std::string_view password_type;
+        std::string_view nonce;
+        std::string_view created;
+    };
+    
+    std::string_view operation;
+    std::string_view operation_ns;
+    std::string_view body;          // operation element, start tag to end tag
+    UsernameToken security;
+    Field fields[MAX_FIELDS];
+    int field_count = 0;
+    
+    // Raw text of the first leaf element with this local name below the
+    // operation, empty if there is none
+    std::string_view field(std::string_view name) const {
+        for (int i = 0; i < field_count; i++) {
+            if (fields[i].name == name) {
+                return fields[i].text;
+            }
+        }
+        return std::string_view();
+    }
+    
+    // Accepts SOAP 1.1 and 1.2 envelopes
+    bool parse(std::string_view xml) {
+        static constexpr std::string_view SOAP12 = "http://www.w3.org/2003/05/soap-envelope";
+        static constexpr std::string_view SOAP11 = "http://schemas.xmlsoap.org/soap/envelope/";
+        XmlPullParser parser(xml);
+        if (parser.next() != XmlPullParser::START || parser.name() != "Envelope" ||
+            (parser.ns() != SOAP12 && parser.ns() != SOAP11)) {
+            return false;
+        }
+        std::string_view envelope_ns = parser.ns();
+        XmlPullParser::Event event;
+        bool body_seen = false;
+        while ((event = parser.next()) == XmlPullParser::START) {
+            if (parser.ns() != envelope_ns) {
+                return false;
+            }
+            if (parser.name() == "Header" && !body_seen) {
+                if (!parseHeader(parser)) {
+                    return false;
+                }
+            } else if (parser.name() == "Body") {
+                body_seen = true;
+                if (!parseBody(parser, xml)) {
+                    return false;
+                }
+            } else {
+                return false;
+            }
+        }
+        return event == XmlPullParser::END && body_seen && parser.next() == XmlPullParser::DONE;
+    }
+    
+private:
+    // Leaves the parser on the END of Header
+    bool parseHeader(XmlPullParser& parser) {
+        static constexpr std::string_view WSSE =
+            "http://docs.oasis-open.org/wss/2004/01/oasis-200401-wss-wssecurity-secext-1.0.xsd";
+        int header_level = parser.level();
+        bool in_token = false;
+        std::string_view leaf;
+        std::string_view password_type;
+        XmlPullParser::Event event;
+        while ((event = parser.next()) != XmlPullParser::ERROR && event != XmlPullParser::DONE) {
+            if (event == XmlPullParser::END && parser.level() < header_level) {
+                return true;
+            }
+            if (event == XmlPullParser::START) {
+                if (parser.name() == "UsernameToken" && parser.ns() == WSSE) {
+                    in_token = true;
+                }
+                leaf = in_token ? parser.name() : std::string_view();
+                password_type = leaf == "Password" ? parser.attribute("Type") : password_type;
+            } else if (event == XmlPullParser::TEXT && !leaf.empty()) {
+                if (leaf == "Username") {
+                    security.username = parser.value();
+                } else if (leaf == "Password") {
+                    security.password = parser.value();
+                    security.password_type = password_type;
+                } else if (leaf == "Nonce") {
+                    security.nonce = parser.value();
+                } else if (leaf == "Created") {
+                    security.created = parser.value();
+                }
+            } else if (event == XmlPullParser::END) {
+                in_token = in_token && parser.name() != "UsernameToken";
+                leaf = std::string_view();
+            }
+        }
+        return false;
+    }
+    
+    // Leaves the parser on the END of Body
+    bool parseBody(XmlPullParser& parser, std::string_view xml) {
+        int body_level = parser.level();
+        XmlPullParser::Event event = parser.next();
+        if (event == XmlPullParser::END) {
+            return true;
+        }
+        if (event != XmlPullParser::START) {
+            return false;
+        }
+        operation = parser.name();
+        operation_ns = parser.ns();
+        size_t operation_start = parser.tagOffset();
+        
+        int operation_level = parser.level();
+        std::string_view leaf;
+        bool leaf_open = false;
+        while ((event = parser.next()) != XmlPullParser::ERROR && event != XmlPullParser::DONE) {
+            if (event == XmlPullParser::START) {
+                leaf = parser.name();
+                leaf_open = true;
+            } else if (event == XmlPullParser::TEXT && leaf_open) {
+                addField(leaf, parser.value());
+                leaf_open = false;
+            } else if (event == XmlPullParser::END) {
+                if (leaf_open) {
+                    addField(leaf, std::string_view());
+                    leaf_open = false;
+                }
+                if (parser.level() < operation_level) {
+                    body = xml.substr(operation_start, parser.offset() - operation_start);
+                    break;
+                }
+            }
+        }
+        if (event == XmlPullParser::ERROR || event == XmlPullParser::DONE) {
+            return false;
+        }
+        // Only one operation per Body
+        return parser.next() == XmlPullParser::END && parser.level() < body_level;
+    }
+    
+    void addField(std::string_view name, std::string_view text) {
+        if (field_count < MAX_FIELDS) {
+            fields[field_count++] = Field{name, text};
+        }
+    }
+};
+
+// Bump allocator for data that only lives while one request is handled on
+// the event loop thread. Blocks are kept when the arena is reset after the
+// request, so once it has grown to fit the largest request it stops
+// calling malloc.
+class RequestArena : public std::pmr::memory_resource {
+public:
+    static constexpr size_t BLOCK_SIZE = 16384;
+    
+    RequestArena() = default;
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+    
+    ~RequestArena() {
+        for (const auto& block : blocks) {
+            ::operator delete(block.data);
+        }
+    }
+    
+    // Everything allocated since the last reset must be gone by now
+    void reset() {
+        current = 0;
+        used = 0;
+    }
+    
+    size_t capacity() const {
+        size_t total = 0;
+        for (const auto& block : blocks) {
+            total += block.size;
+        }
+        return total;
+    }
+    
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+    
+    std::vector<Block> blocks;
+    size_t current = 0;     // block being filled
+    size_t used = 0;        // bytes used in it
+    
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        while (true) {
+            for (; current < blocks.size(); current++, used = 0) {
+                void* p = blocks[current].data + used;
+                size_t space = blocks[current].size - used;
+                if (std::align(alignment, bytes, p, space)) {
+                    used = blocks[current].size - space + bytes;
+                    return p;
+                }
+            }
+            size_t size = std::max(BLOCK_SIZE, bytes + alignment);
+            blocks.push_back(Block{static_cast<char*>(::operator new(size)), size});
+            current = blocks.size() - 1;
+        }
+    }
+    
+    void do_deallocate(void*, size_t, size_t) override {}
+    
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+using ArenaString = std::pmr::string;
+
+// Timer embedded in the object it belongs to (a connection, a subscription),
+// so arming and cancelling never allocate. `kind` tells the owner what fired.
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expires = 0;
+    int kind = 0;
+    void* owner = nullptr;
+    
+    bool armed() const {
+        return prev != nullptr;
+    }
+};
+
+// Hierarchical timing wheel driven by the event loop. The first level has
+// one slot per tick; each further level has slots covering a whole
+// revolution of the level below, and its timers are cascaded down when
+// that revolution comes around. Arming and cancelling are O(1), and a
+// timer is moved at most once per level however far away it is, so idle
+// deadlines of many connections cost nothing while they wait. Nodes live
+// in intrusive circular lists, one per slot.
+class TimerWheel {
+public:
+    static const uint64_t TICK_MS = 100;
+    
+private:
+    static const unsigned ROOT_BITS = 8;
+    static const unsigned LEVEL_BITS = 6;
+    static const unsigned LEVELS = 5;   // 2^32 ticks, over 13 years
+    static const size_t ROOT_SLOTS = size_t(1) << ROOT_BITS;
+    static const size_t LEVEL_SLOTS = size_t(1) << LEVEL_BITS;
+    static const uint64_t MAX_DELTA = (uint64_t(1) << (ROOT_BITS + (LEVELS - 1) * LEVEL_BITS)) - 1;
+    
+    // ROOT_SLOTS slots for level 0, then LEVEL_SLOTS for each level above
+    std::vector<TimerNode> slots;
+    uint64_t tick;      // next tick to expire
+    size_t count;
+    
+    static void link(TimerNode& head, TimerNode* node) {
+        node->next = &head;
+        node->prev = head.prev;
+        head.prev->next = node;
+        head.prev = node;
+    }
+    
+    static void unlink(TimerNode* node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+    }
+    
+    static bool empty(const TimerNode& head) {
+        return head.next == &head;
+    }
+    
+    TimerNode& levelSlot(unsigned level, uint64_t expires) {
+        unsigned shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+        return slots[ROOT_SLOTS + (level - 1) * LEVEL_SLOTS + ((expires >> shift) & (LEVEL_SLOTS - 1))];
+    }
+    
+    void place(TimerNode* node) {
+        uint64_t delta = node->expires - tick;
+        if (delta < ROOT_SLOTS) {
+            link(slots[node->expires & (ROOT_SLOTS - 1)], node);
+            return;
+        }
+        unsigned level = 1;
+        while (level < LEVELS - 1 && delta >= uint64_t(1) << (ROOT_BITS + level * LEVEL_BITS)) {
+            level++;
+        }
+        link(levelSlot(level, node->expires), node);
+    }
+    
+    // Spreads the slot of `level` that the current tick reached over the
+    // levels below. Returns that slot's index; the next level only comes
+    // around when it is 0.
+    size_t cascade(unsigned level) {
+        unsigned shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+        size_t index = (tick >> shift) & (LEVEL_SLOTS - 1);
+        TimerNode& head = slots[ROOT_SLOTS + (level - 1) * LEVEL_SLOTS + index];
+        while (!empty(head)) {
+            TimerNode* node = head.next;
+            unlink(node);
+            place(node);
+        }
+        return index;
+    }
+    
+public:
+    TimerWheel(uint64_t now_ms) : slots(ROOT_SLOTS + (LEVELS - 1) * LEVEL_SLOTS), tick(now_ms / TICK_MS + 1), count(0) {
+        for (auto& head : slots) {
+            head.prev = head.next = &head;
+        }
+    }
+    
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+    
+    void arm(TimerNode* node, uint64_t now_ms, uint64_t delay_ms) {
+        cancel(node);
+        uint64_t expires = (now_ms + delay_ms + TICK_MS - 1) / TICK_MS;
+        node->expires = std::min(std::max(expires, tick), tick + MAX_DELTA);
+        place(node);
+        count++;
+    }
+    
+    void cancel(TimerNode* node) {
+        if (!node->armed()) {
+            return;
+        }
+        unlink(node);
+        node->prev = node->next = nullptr;
+        count--;
+    }
+    
+    // Milliseconds the event loop may sleep: until the next occupied slot
+    // of the first level, or until the next cascade
+    int timeoutMs(uint64_t now_ms) const {
+        if (count == 0) {
+            return -1;
+        }
+        uint64_t next = tick;
+        if ((next & (ROOT_SLOTS - 1)) != 0) {
+            while (empty(slots[next & (ROOT_SLOTS - 1)]) && ((next + 1) & (ROOT_SLOTS - 1)) != 0) {
+                next++;
+            }
+            if (empty(slots[next & (ROOT_SLOTS - 1)])) {
+                next++;
+            }
+        }
+        return next * TICK_MS > now_ms ? static_cast<int>(next * TICK_MS - now_ms) : 0;
+    }
+    
+    // Fires every timer due at or before now. A slot's nodes are first moved
+    // to a local list so callbacks may freely arm or cancel other timers.
+    template <typename Callback>
+    void advance(uint64_t now_ms, Callback on_expire) {
+        uint64_t target = now_ms / TICK_MS;
+        if (count == 0) {
+            tick = std::max(tick, target + 1);
+            return;
+        }
+        while (tick <= target) {
+            size_t index = tick & (ROOT_SLOTS - 1);
+            for (unsigned level = 1; index == 0 && level < LEVELS; level++) {
+                index = cascade(level);
+            }
+            TimerNode& head = slots[tick & (ROOT_SLOTS - 1)];
+            tick++;
+            if (empty(head)) {
+                continue;
+            }
+            TimerNode expired;
+            expired.prev = head.prev;
+            expired.next = head.next;
+            expired.prev->next = expired.next->prev = &expired;
+            head.prev = head.next = &head;
+            while (!empty(expired)) {
+                TimerNode* node = expired.next;
+                unlink(node);
+                node->prev = node->next = nullptr;
+                count--;
+                on_expire(node);
+            }
+        }
+    }
+};
+
+// Minimal io_uring on the raw system calls, for the optional I/O backend.
+// Besides the submission and completion rings it registers one ring of
+// provided buffers that multishot receives fill, so idle connections do
+// not hold a read buffer each. Only used from the event loop thread.
+class IoRing {
+public:
+    static const uint16_t BUFFER_GROUP = 0;
+    
+    IoRing() = default;
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+    
+    ~IoRing() {
+        close();
+    }
+    
+    // `buffer_count` must be a power of two. Returns false when the kernel
+    // lacks io_uring or provided buffer rings (before 5.19); multishot
+    // receive further needs 6.0.
+    bool open(unsigned entries, unsigned buffer_count, unsigned buffer_size) {
+        struct io_uring_params params = {};
+        params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0 && errno == EINVAL) {
+            params = {};
+            fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        }
+        if (fd < 0) {
+            return false;
+        }
+        const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required) {
+            close();
+            return false;
+        }
+        
+        ring_size = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                                     params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+        void* ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        ring_memory = ring == MAP_FAILED ? nullptr : static_cast<char*>(ring);
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* entries_memory = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_SQES);
+        sqes = entries_memory == MAP_FAILED ? nullptr : static_cast<struct io_uring_sqe*>(entries_memory);
+        if (!ring_memory || !sqes) {
+            close();
+            return false;
+        }
+        sq_head = reinterpret_cast<unsigned*>(ring_memory + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(ring_memory + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(ring_memory + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        cq_head = reinterpret_cast<unsigned*>(ring_memory + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(ring_memory + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(ring_memory + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(ring_memory + params.cq_off.cqes);
+        // Submission slot i always holds entry i
+        unsigned* array = reinterpret_cast<unsigned*>(ring_memory + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; i++) {
+            array[i] = i;
+        }
+        local_tail = *sq_tail;
+        
+        buffer_ring_size = buffer_count * sizeof(struct io_uring_buf);
+        buffers_size = size_t(buffer_count) * buffer_size;
+        void* buffer_ring_memory = mmap(nullptr, buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void* buffers_memory = mmap(nullptr, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        buffer_ring = buffer_ring_memory == MAP_FAILED ? nullptr : static_cast<struct io_uring_buf_ring*>(buffer_ring_memory);
+        buffers = buffers_memory == MAP_FAILED ? nullptr : static_cast<char*>(buffers_memory);
+        if (!buffer_ring || !buffers) {
+            close();
+            return false;
+        }
+        struct io_uring_buf_reg registration = {};
+        registration.ring_addr = reinterpret_cast<uint64_t>(buffer_ring);
+        registration.ring_entries = buffer_count;
+        registration.bgid = BUFFER_GROUP;
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+            close();
+            return false;
+        }
+        this->buffer_count = buffer_count;
+        this->buffer_size = buffer_size;
+        for (unsigned id = 0; id < buffer_count; id++) {
+            recycleBuffer(id);
+        }
+        return true;
+    }
+    
+    void close() {
+        if (ring_memory) {
+            munmap(ring_memory, ring_size);
+        }
+        if (sqes) {
+            munmap(sqes, sqes_size);
+        }
+        if (buffer_ring) {
+            munmap(buffer_ring, buffer_ring_size);
+        }
+        if (buffers) {
+            munmap(buffers, buffers_size);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        ring_memory = nullptr;
+        sqes = nullptr;
+        buffer_ring = nullptr;
+        buffers = nullptr;
+        fd = -1;
+    }
+    
+    bool isOpen() const {
+        return fd >= 0;
+    }
+    
+    // Makes room for `count` submissions, submitting what is queued if the
+    // ring is full, so that linked entries go to the kernel together
+    void reserve(unsigned count) {
+        if (local_tail + count - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_entries) {
+            enter(0, -1);
+        }
+    }
+    
+    // Queues a cleared submission; it is handed to the kernel by the next
+    // submitAndWait()
+    struct io_uring_sqe* prepare(uint8_t opcode, int target, uint64_t user_data) {
+        reserve(1);
+        struct io_uring_sqe* sqe = &sqes[local_tail++ & sq_mask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = target;
+        sqe->user_data = user_data;
+        return sqe;
+    }
+    
+    // Submits the queued entries and, unless completions are already
+    // waiting, sleeps until one arrives or `timeout_ms` passes (-1 waits
+    // indefinitely). Takes no system call when there is nothing to submit
+    // and completions are ready.
+    void submitAndWait(int timeout_ms) {
+        bool ready = *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        if (!ready) {
+            enter(1, timeout_ms);
+        } else if (local_tail != __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) {
+            enter(0, -1);
+        }
+    }
+    
+    // Calls `handle(cqe)` for every completion posted so far
+    template <typename Handler>
+    void forEachCompletion(Handler handle) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe cqe = cqes[head++ & cq_mask];
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            handle(cqe);
+        }
+    }
+    
+    const char* buffer(unsigned id) const {
+        return buffers + size_t(id) * buffer_size;
+    }
+    
+    // Hands a provided buffer back to the kernel once its data was copied
+    void recycleBuffer(unsigned id) {
+        // Not through `bufs`: compiled as C++, the header's flexible array
+        // member lands 8 bytes into the ring instead of at its start
+        struct io_uring_buf& entry = reinterpret_cast<struct io_uring_buf*>(buffer_ring)[buffer_tail & (buffer_count - 1)];
+        entry.addr = reinterpret_cast<uint64_t>(buffer(id));
+        entry.len = buffer_size;
+        entry.bid = static_cast<uint16_t>(id);
+        buffer_tail++;
+        __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+    }
+    
+    // io_uring_enter calls made so far
+    uint64_t enterCalls() const {
+        return enters;
+    }
+    
+private:
+    int fd = -1;
+    char* ring_memory = nullptr;
+    size_t ring_size = 0;
+    struct io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned local_tail = 0;        // entries queued, published to *sq_tail on enter
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe* cqes = nullptr;
+    struct io_uring_buf_ring* buffer_ring = nullptr;
+    size_t buffer_ring_size = 0;
+    char* buffers = nullptr;
+    size_t buffers_size = 0;
+    unsigned buffer_count = 0;
+    unsigned buffer_size = 0;
+    uint16_t buffer_tail = 0;
+    uint64_t enters = 0;
+    
+    int enter(unsigned wait, int timeout_ms) {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        unsigned submit = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        struct __kernel_timespec timeout = {};
+        struct io_uring_getevents_arg arg = {};
+        if (timeout_ms >= 0) {
+            timeout.tv_sec = timeout_ms / 1000;
+            timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = reinterpret_cast<uint64_t>(&timeout);
+        }
+        enters++;
+        if (!wait) {
+            return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, 0, 0, nullptr, 0));
+        }
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait,
+                                        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)));
+    }
+};
+
+// Server side of the HTTPS listener. Clients that come back present a
+// session ticket and skip the full handshake; tickets are sealed with a
+// key the context makes at start-up, so resumption needs no server-side
+// session state. Where the kernel offers TLS offload (the "tls" ULP),
+// OpenSSL hands the connection's record layer to it after the handshake
+// and snapshots go out with sendfile() again.
+class TlsContext {
+private:
+    SSL_CTX* ctx = nullptr;
+    
+    // Ephemeral P-256 certificate for CN=<name>, for when none was given
+    static bool useSelfSigned(SSL_CTX* ctx, const char* name) {
+        EVP_PKEY* key = EVP_EC_gen("P-256");
+        X509* cert = X509_new();
+        bool ok = key && cert;
+        if (ok) {
+            X509_set_version(cert, 2);
+            ASN1_INTEGER_set(X509_get_serialNumber(cert), static_cast<long>(time(nullptr)));
+            X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+            X509_gmtime_adj(X509_getm_notAfter(cert), 365L * 24 * 3600);
+            X509_set_pubkey(cert, key);
+            X509_NAME* subject = X509_get_subject_name(cert);
+            X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>(name), -1, -1, 0);
+            X509_set_issuer_name(cert, subject);
+            ok = X509_sign(cert, key, EVP_sha256()) > 0 && SSL_CTX_use_certificate(ctx, cert) == 1 &&
+                 SSL_CTX_use_PrivateKey(ctx, key) == 1;
+        }
+        X509_free(cert);
+        EVP_PKEY_free(key);
+        return ok;
+    }
+    
+public:
+    TlsContext() = default;
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+    
+    ~TlsContext() {
+        SSL_CTX_free(ctx);
+    }
+    
+    // PEM certificate chain and key; a self-signed certificate when
+    // `certificate` is empty
+    bool open(const std::string& certificate, const std::string& key) {
+        ctx = SSL_CTX_new(TLS_server_method());
+        if (!ctx) {
+            return false;
+        }
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+        SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        // Stateless tickets for TLS 1.2 and 1.3; one per full handshake is
+        // enough for a client that reconnects for every request
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_num_tickets(ctx, 1);
+        SSL_CTX_set_timeout(ctx, 3600);
+        
+        bool loaded = certificate.empty() ?
+            useSelfSigned(ctx, "onvif-server") :
+            SSL_CTX_use_certificate_chain_file(ctx, certificate.c_str()) == 1 &&
+            SSL_CTX_use_PrivateKey_file(ctx, (key.empty() ? certificate : key).c_str(), SSL_FILETYPE_PEM) == 1 &&
+            SSL_CTX_check_private_key(ctx) == 1;
+        if (!loaded) {
+            ERR_print_errors_fp(stderr);
+            SSL_CTX_free(ctx);
+            ctx = nullptr;
+        }
+        return loaded;
+    }
+    
+    bool isOpen() const {
+        return ctx != nullptr;
+    }
+    
+    SSL* accept(int fd) {
+        SSL* ssl = SSL_new(ctx);
+        if (ssl && SSL_set_fd(ssl, fd) != 1) {
+            SSL_free(ssl);
+            return nullptr;
+        }
+        if (ssl) {
+            SSL_set_accept_state(ssl);
+        }
+        return ssl;
+    }
+    
+    // True once the kernel encrypts what is written to the socket
+    static bool kernelSend(SSL* ssl) {
+        return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+    }
+};
+
+// Lock-free broadcast log used to fan events out to subscriptions.
+// Publishers claim a sequence number and write the slot it maps to; each
+// subscription only keeps a cursor, so publishing costs the same no matter
+// how many subscribers there are. Every slot is guarded by its sequence word
+// like a seqlock, which lets readers detect a message that was overwritten
+// while they copied it. Holds the newest `capacity` messages.
+class EventLog {
+public:
+    static const size_t TOPIC_SIZE = 96;
+    static const size_t MESSAGE_SIZE = 1024;
+    
+    enum ReadResult {
+        READ_OK,
+        READ_PENDING,   // claimed but not yet written
+        READ_LOST       // already overwritten by a newer message
+    };
+    
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        uint32_t topic_length = 0;
+        uint32_t length = 0;
+        char topic[TOPIC_SIZE];
+        char message[MESSAGE_SIZE];
+    };
+    
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    std::atomic<uint64_t> head{0};
+    
+public:
+    explicit EventLog(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots.reset(new Slot[size]);
+        mask = size - 1;
+    }
+    
+    size_t capacity() const {
+        return mask + 1;
+    }
+    
+    // Sequence number the next message will get
+    uint64_t end() const {
+        return head.load(std::memory_order_acquire);
+    }
+    
+    // `fill` writes exactly `length` bytes of message into the slot
+    template <typename Fill>
+    bool publish(const char* topic, size_t topic_length, size_t length, Fill fill) {
+        if (topic_length > TOPIC_SIZE || length > MESSAGE_SIZE) {
+            return false;
+        }
+        uint64_t n = head.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = slots[n & mask];
+        slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(slot.topic, topic, topic_length);
+        slot.topic_length = topic_length;
+        fill(slot.message);
+        slot.length = length;
+        slot.seq.store(2 * n + 2, std::memory_order_release);
+        return true;
+    }
+    
+    // Calls visit(topic, topic_length, message, length) for message n. On
+    // READ_LOST whatever `visit` copied must be discarded.
+    template <typename Visit>
+    ReadResult read(uint64_t n, Visit visit) const {
+        const Slot& slot = slots[n & mask];
+        uint64_t before = slot.seq.load(std::memory_order_acquire);
+        if (before < 2 * n + 2) {
+            return READ_PENDING;
+        }
+        if (before > 2 * n + 2) {
+            return READ_LOST;
+        }
+        visit(slot.topic, static_cast<size_t>(slot.topic_length), slot.message, static_cast<size_t>(slot.length));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.seq.load(std::memory_order_relaxed) == before ? READ_OK : READ_LOST;
+    }
+};
+
+// Per-client token buckets for request rate limiting. Clients are hashed
+// into sets of a fixed table; a client missing from its set takes over
+// the entry that was used least recently, so the table never grows and a
+// flood of source addresses only evicts idle clients. Tokens are kept in
+// thousandths so refilling needs no floating point. Only the event loop
+// touches it, so it needs no locking.
+class RateLimiter {
+private:
+    static const size_t WAYS = 4;
+    
+    struct Bucket {
+        uint64_t key = 0;           // 0: unused
+        uint64_t tokens = 0;        // thousandths of a request
+        uint64_t last_ms = 0;
+    };
+    
+    std::unique_ptr<Bucket[]> buckets;
+    size_t set_mask = 0;
+    uint64_t rate = 0;              // requests per second
+    uint64_t burst = 0;             // thousandths
+    
+public:
+    // A rate of 0 admits everything
+    void configure(uint64_t requests_per_second, uint64_t burst_requests, size_t clients) {
+        rate = requests_per_second;
+        burst = std::max<uint64_t>(burst_requests, 1) * 1000;
+        size_t sets = 1;
+        while (sets * WAYS < clients) {
+            sets <<= 1;
+        }
+        buckets.reset(rate > 0 ? new Bucket[sets * WAYS] : nullptr);
+        set_mask = sets - 1;
+    }
+    
+    bool enabled() const {
+        return rate > 0;
+    }
+    
+    // Takes one request's token from the client's bucket
+    bool admit(uint64_t client, uint64_t now_ms) {
+        if (rate == 0) {
+            return true;
+        }
+        client |= 1;
+        Bucket* set = &buckets[((client * 0x9E3779B97F4A7C15ull) >> 32 & set_mask) * WAYS];
+        Bucket* bucket = set;
+        for (size_t i = 0; i < WAYS; i++) {
+            if (set[i].key == client) {
+                bucket = &set[i];
+                break;
+            }
+            if (set[i].last_ms < bucket->last_ms) {
+                bucket = &set[i];
+            }
+        }
+        if (bucket->key != client) {
+            bucket->key = client;
+            bucket->tokens = burst;
+        } else {
+            bucket->tokens = std::min(burst, bucket->tokens + (now_ms - bucket->last_ms) * rate);
+        }
+        bucket->last_ms = now_ms;
+        if (bucket->tokens < 1000) {
+            return false;
+        }
+        bucket->tokens -= 1000;
+        return true;
+    }
+    
+    // Folds a peer address into a bucket key; the port is left out
+    static uint64_t clientKey(const struct sockaddr_storage& address) {
+        if (address.ss_family == AF_INET) {
+            return reinterpret_cast<const struct sockaddr_in&>(address).sin_addr.s_addr;
+        }
+        if (address.ss_family == AF_INET6) {
+            const uint8_t* bytes = reinterpret_cast<const struct sockaddr_in6&>(address).sin6_addr.s6_addr;
+            uint64_t high, low;
+            memcpy(&high, bytes, 8);
+            memcpy(&low, bytes + 8, 8);
+            return (high * 0x9E3779B97F4A7C15ull) ^ low;
+        }
+        return 0;
+    }
+};
+
+// HTTP content codings the server can produce
+enum ContentEncoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,   // zlib format, as HTTP's "deflate" means
+    ENCODING_COUNT
+};
+
+// Reusable zlib compressor at one level. Each coding keeps its deflate
+// stream, set up on first use and only reset afterwards, and the output
+// buffer keeps its capacity, so once warmed up compressing a response
+// does not touch the heap. Only used from the event loop thread.
+class ResponseCompressor {
+private:
+    int level;
+    z_stream streams[ENCODING_COUNT];
+    bool ready[ENCODING_COUNT] = {};
+    
+public:
+    explicit ResponseCompressor(int level) : level(level) {}
+    
+    ResponseCompressor(const ResponseCompressor&) = delete;
+    ResponseCompressor& operator=(const ResponseCompressor&) = delete;
+    
+    ~ResponseCompressor() {
+        for (int i = 0; i < ENCODING_COUNT; i++) {
+            if (ready[i]) {
+                deflateEnd(&streams[i]);
+            }
+        }
+    }
+    
+    // Replaces `out` with `in` compressed in `encoding`
+    bool compress(std::string_view in, ContentEncoding encoding, std::string& out) {
+        z_stream& stream = streams[encoding];
+        if (!ready[encoding]) {
+            stream = z_stream();
+            int window_bits = encoding == ENCODING_GZIP ? 15 + 16 : 15;
+            if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return false;
+            }
+            ready[encoding] = true;
+        } else {
+            deflateReset(&stream);
+        }
+        out.resize(deflateBound(&stream, in.size()));
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        stream.avail_in = in.size();
+        stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        stream.avail_out = out.size();
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+            return false;
+        }
+        out.resize(stream.total_out);
+        return true;
+    }
+    
+    static const char* name(ContentEncoding encoding) {
+        return encoding == ENCODING_GZIP ? "gzip" : encoding == ENCODING_DEFLATE ? "deflate" : "identity";
+    }
+};
+
+// One PTZ axis moving with bounded acceleration. A command is turned into
+// a short list of constant-acceleration pieces up front, and the position
+// is only computed when someone asks for it, so an idle or moving head
+// costs nothing between requests. Reaching a limit stops the axis there.
+class PTZAxis {
+private:
+    struct Piece {
+        double t;   // start time, seconds
+        double p;   // position at t
+        double v;   // velocity at t
+        double a;   // constant acceleration until the next piece
+    };
+    
+    static const int MAX_PIECES = 5;
+    Piece pieces[MAX_PIECES];
+    int count;
+    double min_position;
+    double max_position;
+    double max_speed;
+    double acceleration;
+    
+    void add(double t, double p, double v, double a) {
+        pieces[count++] = Piece{t, p, v, a};
+    }
+    
+    // Appends a piece accelerating from (t, p, v) to velocity `target` and
+    // returns the state where it ends
+    void ramp(double& t, double& p, double& v, double target) {
+        if (v == target) {
+            return;
+        }
+        double a = target > v ? acceleration : -acceleration;
+        double duration = (target - v) / a;
+        add(t, p, v, a);
+        p += v * duration + 0.5 * a * duration * duration;
+        t += duration;
+        v = target;
+    }
+    
+public:
+    struct State {
+        double position;
+        double velocity;
+        bool moving;
+    };
+    
+    PTZAxis(double min, double max, double speed, double accel)
+        : count(0), min_position(min), max_position(max), max_speed(speed), acceleration(accel) {
+        add(0, std::max(min, std::min(max, 0.0)), 0, 0);
+    }
+    
+    State at(double t) const {
+        for (int i = 0; i < count; i++) {
+            const Piece& piece = pieces[i];
+            double end = i + 1 < count ? std::min(pieces[i + 1].t, t) : t;
+            if (end < piece.t) {
+                end = piece.t;
+            }
+            double dt = end - piece.t;
+            
+            // The extremes of a constant-acceleration piece are at its ends
+            // or where the velocity crosses zero
+            double p_end = piece.p + piece.v * dt + 0.5 * piece.a * dt * dt;
+            double lowest = std::min(piece.p, p_end);
+            double highest = std::max(piece.p, p_end);
+            if (piece.a != 0) {
+                double turn = -piece.v / piece.a;
+                if (turn > 0 && turn < dt) {
+                    double p_turn = piece.p + piece.v * turn + 0.5 * piece.a * turn * turn;
+                    lowest = std::min(lowest, p_turn);
+                    highest = std::max(highest, p_turn);
+                }
+            }
+            if (highest > max_position + 1e-9) {
+                return State{max_position, 0, false};
+            }
+            if (lowest < min_position - 1e-9) {
+                return State{min_position, 0, false};
+            }
+            
+            if (i + 1 == count || pieces[i + 1].t > t) {
+                double v = piece.v + piece.a * dt;
+                return State{p_end, v, v != 0 || piece.a != 0};
+            }
+        }
+        return State{pieces[0].p, 0, false};
+    }
+    
+    // Ramp to `speed` (fraction of max speed, -1..1), hold it until
+    // `timeout` seconds from now, then ramp down to a stop
+    void velocityMove(double now, double speed, double timeout) {
+        State s = at(now);
+        count = 0;
+        double t = now;
+        double p = s.position;
+        double v = s.velocity;
+        double target = std::max(-1.0, std::min(1.0, speed)) * max_speed;
+        double stop_at = now + timeout;
+        
+        // If the timeout expires before the target speed is reached, stop
+        // accelerating at that point
+        double reach = std::abs(target - v) / acceleration;
+        if (now + reach > stop_at) {
+            double a = target > v ? acceleration : -acceleration;
+            target = v + a * timeout;
+        }
+        ramp(t, p, v, target);
+        if (t < stop_at) {
+            add(t, p, v, 0);
+            p += v * (stop_at - t);
+            t = stop_at;
+        }
+        ramp(t, p, v, 0);
+        add(t, p, 0, 0);
+    }
+    
+    // Trapezoidal move to `target` at up to `speed` (fraction of max speed)
+    void positionMove(double now, double target, double speed) {
+        State s = at(now);
+        count = 0;
+        double t = now;
+        double p = s.position;
+        double v = s.velocity;
+        ramp(t, p, v, 0);
+        
+        target = std::max(min_position, std::min(max_position, target));
+        double distance = std::abs(target - p);
+        double direction = target > p ? 1.0 : -1.0;
+        double cruise = std::max(0.01, std::min(1.0, std::abs(speed))) * max_speed;
+        if (distance > 0) {
+            // Triangular profile when the cruise speed cannot be reached
+            double accel_distance = cruise * cruise / acceleration;
+            if (distance < accel_distance) {
+                cruise = std::sqrt(distance * acceleration);
+                accel_distance = distance;
+            }
+            ramp(t, p, v, direction * cruise);
+            double hold = (distance - accel_distance) / cruise;
+            if (hold > 0) {
+                add(t, p, v, 0);
+                p += v * hold;
+                t += hold;
+            }
+            ramp(t, p, v, 0);
+        }
+        add(t, target, 0, 0);
+    }
+    
+    void stop(double now) {
+        velocityMove(now, 0, 0);
+    }
+    
+    // Time at which the current command has played out
+    double finish() const {
+        return pieces[count - 1].t;
+    }
+};
+
+// Presets and preset tours of every profile, kept in a memory-mapped file
+// so that a restart maps the table back in instead of parsing anything.
+// The file is a header followed by one open-addressing hash table of
+// fixed-size records keyed by (device, profile, kind, id). Each profile also
+// has a LIST record that chains its presets and tours in creation order.
+// Without a path the table lives in anonymous memory. Servers of a
+// simulated fleet share one store under their own device ids, each use
+// holding mutex().
+class PresetStore {
+public:
+    enum Kind : uint32_t {
+        LIST = 1,
+        PRESET = 2,
+        TOUR = 3
+    };
+    
+    enum TourFlags : uint32_t {
+        TOUR_BACKWARD = 1
+    };
+    
+    static const int PROFILE_SIZE = 64;
+    static const int NAME_SIZE = 64;
+    static const int MAX_TOUR_SPOTS = 8;
+    
+    struct TourSpot {
+        uint32_t preset;
+        float speed;
+        float stay;         // seconds
+    };
+    
+    struct Record {
+        uint32_t state;
+        uint32_t kind;
+        uint32_t device;
+        uint32_t id;
+        uint32_t next;      // slot + 1 of the next record in the profile's list, 0 at the end
+        uint32_t spots;     // TOUR: spots in use
+        uint32_t recurring; // TOUR: laps, 0 to repeat until stopped
+        uint32_t flags;     // TOUR: TourFlags
+        char profile[PROFILE_SIZE];
+        char name[NAME_SIZE];
+        union {
+            struct {
+                double pan;
+                double tilt;
+                double zoom;
+            } position;
+            TourSpot spot[MAX_TOUR_SPOTS];
+        };
+    };
+    
+private:
+    enum State : uint32_t {
+        EMPTY = 0,
+        USED = 1,
+        REMOVED = 2
+    };
+    
+    struct Header {
+        char magic[8];
+        uint32_t capacity;  // records, a power of two
+        uint32_t used;
+        uint32_t removed;
+        uint32_t next_id;
+        char reserved[sizeof(Record) - 24];
+    };
+    
+    static constexpr char MAGIC[8] = {'O', 'N', 'V', 'P', 'T', 'Z', '0', '1'};
+    static const uint32_t INITIAL_CAPACITY = 1024;
+    
+    std::string path;
+    int fd;
+    Header* header;
+    Record* records;
+    size_t mapped;
+    std::mutex access;
+    
+    static size_t fileSize(uint32_t capacity) {
+        return sizeof(Header) + size_t(capacity) * sizeof(Record);
+    }
+    
+    static uint32_t hash(uint32_t device, const char* profile, uint32_t kind, uint32_t id) {
+        uint32_t h = 2166136261u;
+        auto mix = [&h](uint32_t value) {
+            for (int i = 0; i < 4; i++) {
+                h = (h ^ ((value >> (i * 8)) & 0xff)) * 16777619u;
+            }
+        };
+        mix(device);
+        mix(kind);
+        mix(id);
+        for (const char* c = profile; *c; c++) {
+            h = (h ^ static_cast<unsigned char>(*c)) * 16777619u;
+        }
+        return h;
+    }
+    
+    // Maps a table of `capacity` records, backed by `file` or anonymous
+    // memory when file < 0. A fresh file is sized and initialized.
+    static Header* map(int file, uint32_t capacity, bool initialize) {
+        size_t size = fileSize(capacity);
+        if (file >= 0 && initialize && ftruncate(file, size) < 0) {
+            return nullptr;
+        }
+        void* memory = file >= 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0)
+                                 : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return nullptr;
+        }
+        Header* mapped_header = static_cast<Header*>(memory);
+        if (initialize) {
+            memcpy(mapped_header->magic, MAGIC, sizeof(MAGIC));
+            mapped_header->capacity = capacity;
+            mapped_header->next_id = 1;
+        }
+        return mapped_header;
+    }
+    
+    void unmap() {
+        if (header) {
+            munmap(header, mapped);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        header = nullptr;
+        records = nullptr;
+        fd = -1;
+    }
+    
+    void attach(Header* mapped_header, int file) {
+        header = mapped_header;
+        records = reinterpret_cast<Record*>(header + 1);
+        mapped = fileSize(header->capacity);
+        fd = file;
+    }
+    
+    // Slot for the key: the record if present, otherwise the first free
+    // slot on its probe sequence
+    Record* probe(uint32_t device, const char* profile, uint32_t kind, uint32_t id, bool& found) const {
+        uint32_t mask = header->capacity - 1;
+        Record* free_slot = nullptr;
+        for (uint32_t i = hash(device, profile, kind, id) & mask;; i = (i + 1) & mask) {
+            Record* r = &records[i];
+            if (r->state == EMPTY) {
+                found = false;
+                return free_slot ? free_slot : r;
+            }
+            if (r->state == REMOVED) {
+                free_slot = free_slot ? free_slot : r;
+            } else if (r->kind == kind && r->id == id && r->device == device && strcmp(r->profile, profile) == 0) {
+                found = true;
+                return r;
+            }
+        }
+    }
+    
+    Record* place(const Record& source) {
+        bool found;
+        Record* r = probe(source.device, source.profile, source.kind, source.id, found);
+        if (!found) {
+            if (r->state == REMOVED) {
+                header->removed--;
+            }
+            header->used++;
+        }
+        *r = source;
+        r->state = USED;
+        r->next = 0;
+        return r;
+    }
+    
+    Record* at(uint32_t link) const {
+        return link ? &records[link - 1] : nullptr;
+    }
+    
+    uint32_t link(const Record* r) const {
+        return static_cast<uint32_t>(r - records) + 1;
+    }
+    
+    // Rehashes into a table of `capacity` records. File-backed stores write
+    // the new table next to the old one and rename it into place.
+    bool rehash(uint32_t capacity) {
+        std::string temporary = path.empty() ? "" : path + ".tmp";
+        int file = -1;
+        if (!temporary.empty()) {
+            file = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (file < 0) {
+                return false;
+            }
+        }
+        Header* fresh = map(file, capacity, true);
+        if (!fresh) {
+            if (file >= 0) {
+                close(file);
+                unlink(temporary.c_str());
+            }
+            return false;
+        }
+        
+        PresetStore old;
+        old.attach(header, fd);
+        attach(fresh, file);
+        header->next_id = old.header->next_id;
+        for (uint32_t i = 0; i < old.header->capacity; i++) {
+            const Record& list = old.records[i];
+            if (list.state != USED || list.kind != LIST) {
+                continue;
+            }
+            Record* tail = place(list);
+            for (const Record* r = old.at(list.next); r; r = old.at(r->next)) {
+                Record* copy = place(*r);
+                tail->next = link(copy);
+                tail = copy;
+            }
+        }
+        if (!temporary.empty() && rename(temporary.c_str(), path.c_str()) < 0) {
+            unmap();
+            attach(old.header, old.fd);
+            old.header = nullptr;
+            old.fd = -1;
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+    
+public:
+    PresetStore() : fd(-1), header(nullptr), records(nullptr), mapped(0) {}
+    
+    ~PresetStore() {
+        unmap();
+    }
+    
+    PresetStore(const PresetStore&) = delete;
+    PresetStore& operator=(const PresetStore&) = delete;
+    
+    // Maps the store at `file`, creating it if needed, or an anonymous store
+    // when `file` is empty. Fails on files that are not preset stores.
+    bool open(const std::string& file) {
+        unmap();
+        path = file;
+        if (path.empty()) {
+            Header* fresh = map(-1, INITIAL_CAPACITY, true);
+            if (fresh) {
+                attach(fresh, -1);
+            }
+            return fresh != nullptr;
+        }
+        
+        int descriptor = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        if (descriptor < 0 || fstat(descriptor, &st) < 0) {
+            if (descriptor >= 0) {
+                close(descriptor);
+            }
+            return false;
+        }
+        Header stored;
+        bool empty = st.st_size == 0;
+        if (!empty && (size_t(st.st_size) < sizeof(Header) ||
+                       pread(descriptor, &stored, sizeof(stored), 0) != ssize_t(sizeof(stored)) ||
+                       memcmp(stored.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+                       stored.capacity == 0 || (stored.capacity & (stored.capacity - 1)) != 0 ||
+                       size_t(st.st_size) != fileSize(stored.capacity))) {
+            close(descriptor);
+            return false;
+        }
+        Header* mapped_header = map(descriptor, empty ? INITIAL_CAPACITY : stored.capacity, empty);
+        if (!mapped_header) {
+            close(descriptor);
+            return false;
+        }
+        attach(mapped_header, descriptor);
+        return true;
+    }
+    
+    bool isOpen() const {
+        return header != nullptr;
+    }
+    
+    std::mutex& mutex() {
+        return access;
+    }
+    
+    uint32_t size() const {
+        return header->used;
+    }
+    
+    uint32_t nextId() {
+        return header->next_id++;
+    }
+    
+    Record* find(uint32_t device, const std::string& profile, uint32_t kind, uint32_t id) const {
+        bool found;
+        Record* r = probe(device, profile.c_str(), kind, id, found);
+        return found ? r : nullptr;
+    }
+    
+    // Adds a preset or tour record at the end of its profile's list, or
+    // returns the existing one. Invalidates other record pointers.
+    Record* insert(uint32_t device, const std::string& profile, uint32_t kind, uint32_t id) {
+        if (profile.size() >= PROFILE_SIZE) {
+            return nullptr;
+        }
+        Record* existing = find(device, profile, kind, id);
+        if (existing) {
+            return existing;
+        }
+        // Keep the table at most 3/4 full, counting tombstones, with room
+        // for the record and a new list head
+        uint32_t capacity = header->capacity;
+        while (uint64_t(header->used + 2) * 4 > uint64_t(capacity) * 3) {
+            capacity *= 2;
+        }
+        if (capacity != header->capacity || uint64_t(header->used + header->removed + 2) * 4 > uint64_t(capacity) * 3) {
+            if (!rehash(capacity)) {
+                return nullptr;
+            }
+        }
+        
+        Record key = {};
+        key.device = device;
+        key.kind = LIST;
+        memcpy(key.profile, profile.c_str(), profile.size() + 1);
+        Record* tail = find(device, profile, LIST, 0);
+        if (!tail) {
+            tail = place(key);
+        }
+        while (tail->next) {
+            tail = at(tail->next);
+        }
+        key.kind = kind;
+        key.id = id;
+        Record* r = place(key);
+        tail->next = link(r);
+        return r;
+    }
+    
+    void remove(Record* r) {
+        Record* previous = find(r->device, r->profile, LIST, 0);
+        while (previous && previous->next != link(r)) {
+            previous = at(previous->next);
+        }
+        if (previous) {
+            previous->next = r->next;
+        }
+        r->state = REMOVED;
+        header->used--;
+        header->removed++;
+    }
+    
+    // Visits the presets and tours of a profile in creation order
+    template <typename Visit>
+    void forEach(uint32_t device, const std::string& profile, Visit visit) const {
+        const Record* list = find(device, profile, LIST, 0);
+        for (const Record* r = list ? at(list->next) : nullptr; r; r = at(r->next)) {
+            visit(*r);
+        }
+    }
+};
+
+// Simulated pan/tilt/zoom head inside the advertised generic spaces
+struct PTZHead {
+    static constexpr double PAN_TILT_MIN = -1.0;
+    static constexpr double PAN_TILT_MAX = 1.0;
+    static constexpr double ZOOM_MIN = 0.0;
+    static constexpr double ZOOM_MAX = 1.0;
+    static constexpr double PAN_TILT_SPEED = 1.0;       // units per second at speed 1.0
+    static constexpr double ZOOM_SPEED = 0.5;
+    static constexpr double PAN_TILT_ACCELERATION = 2.0;
+    static constexpr double ZOOM_ACCELERATION = 1.0;
+    static constexpr double DEFAULT_TIMEOUT = 5.0;      // DefaultPTZTimeout
+    
+    static constexpr double MIN_TOUR_STAY = 0.1;       // keeps a tour of identical spots from spinning
+    
+    PTZAxis pan;
+    PTZAxis tilt;
+    PTZAxis zoom;
+    
+    // A running preset tour. Spots are resolved to positions when the tour
+    // starts and played out lazily, like the moves themselves.
+    struct Tour {
+        struct Spot {
+            double pan;
+            double tilt;
+            double zoom;
+            double speed;
+            double stay;
+        };
+        uint32_t id = 0;            // 0 when no tour is running
+        bool paused = false;
+        std::vector<Spot> spots;
+        size_t spot = 0;            // spot being approached or dwelt at
+        uint32_t laps_left = 0;     // 0 to repeat until stopped
+        double leave_at = 0;        // when the head moves on from `spot`
+        double lap_started = -1;
+        double lap_length = 0;      // length of a full lap once one has been seen
+    } tour;
+    
+    void moveTo(double t, const Tour::Spot& spot) {
+        pan.positionMove(t, spot.pan, spot.speed);
+        tilt.positionMove(t, spot.tilt, spot.speed);
+        zoom.positionMove(t, spot.zoom, spot.speed);
+        tour.leave_at = std::max(pan.finish(), std::max(tilt.finish(), zoom.finish())) +
+                        std::max(spot.stay, MIN_TOUR_STAY);
+    }
+    
+    void startTour(double now, uint32_t id, std::vector<Tour::Spot> spots, uint32_t laps) {
+        tour = Tour();
+        tour.id = id;
+        tour.spots = std::move(spots);
+        tour.laps_left = laps;
+        moveTo(now, tour.spots[0]);
+    }
+    
+    // Replays the tour up to `now`, issuing each spot's move at the time it
+    // would have started. Whole laps are skipped once the tour is periodic.
+    void advanceTour(double now) {
+        while (tour.id && !tour.paused && tour.leave_at <= now) {
+            double t = tour.leave_at;
+            if (++tour.spot == tour.spots.size()) {
+                tour.spot = 0;
+                if (tour.laps_left && --tour.laps_left == 0) {
+                    tour.id = 0;
+                    break;
+                }
+                if (tour.lap_started >= 0) {
+                    tour.lap_length = t - tour.lap_started;
+                }
+                if (tour.lap_length > 0 && now - t > tour.lap_length) {
+                    uint64_t skip = static_cast<uint64_t>((now - t) / tour.lap_length);
+                    if (tour.laps_left) {
+                        skip = std::min<uint64_t>(skip, tour.laps_left - 1);
+                        tour.laps_left -= static_cast<uint32_t>(skip);
+                    }
+                    t += skip * tour.lap_length;
+                }
+                tour.lap_started = t;
+            }
+            moveTo(t, tour.spots[tour.spot]);
+        }
+    }
+    
+    void pauseTour(double now) {
+        advanceTour(now);
+        if (tour.id && !tour.paused) {
+            tour.paused = true;
+            pan.stop(now);
+            tilt.stop(now);
+            zoom.stop(now);
+        }
+    }
+    
+    void resumeTour(double now) {
+        if (tour.id && tour.paused) {
+            tour.paused = false;
+            tour.lap_started = -1;
+            moveTo(now, tour.spots[tour.spot]);
+        }
+    }
+    
+    PTZHead()
+        : pan(PAN_TILT_MIN, PAN_TILT_MAX, PAN_TILT_SPEED, PAN_TILT_ACCELERATION),
+          tilt(PAN_TILT_MIN, PAN_TILT_MAX, PAN_TILT_SPEED, PAN_TILT_ACCELERATION),
+          zoom(ZOOM_MIN, ZOOM_MAX, ZOOM_SPEED, ZOOM_ACCELERATION) {}
+    
+    static double now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+class OnvifServer {
+    // onvif_bench.cpp times the renderers, the parser and the I/O paths
+    // directly; onvif_alloc_test.cpp counts allocations on the request path
+    friend class OnvifServerBench;
+    friend class OnvifAllocTest;
+    
+public:
+    enum IoBackend {
+        IO_EPOLL,
+        IO_URING
+    };
+    
+private:
+    int server_socket;
+    int port;
+    int rtsp_port;                      // in stream URIs; the RTSP server is not simulated
+    bool dual_stack;                    // listeners take IPv6 as well as IPv4 clients
+    std::string device_uuid;
+    std::string device_name;
+    std::string manufacturer;
+    std::string model;
+    std::string serial_number;
+    std::string firmware_version;
+    
+    // Media profiles and the video encoder configurations they reference
+    struct VideoEncoderConfig {
+        std::string token;
+        std::string name;
+        std::string encoding;       // H264, H265 or JPEG
+        int width;
+        int height;
+        int framerate;
+        int bitrate;                // bits per second
+        int quality;
+        int gov_length;
+        std::string codec_profile;  // Baseline/Main/High for H.264, Main for H.265
+    };
+    
+    struct MediaProfile {
+        std::string token;
+        std::string name;
+        std::string video_encoder_token;    // empty when none is attached
+        std::string audio_encoder_token;
+        bool fixed;
+        uint32_t stream;    // /stream<n>, never handed to another profile
+    };
+    
+    // How a stream is delivered; indexes the stream URI table
+    enum StreamTransport {
+        STREAM_UNICAST,     // RTSP with RTP over UDP or interleaved over TCP
+        STREAM_MULTICAST,
+        STREAM_TUNNEL,      // RTSP over HTTP
+        STREAM_TRANSPORTS
+    };
+    static constexpr const char* STREAM_SCHEMES[STREAM_TRANSPORTS] = {"rtsp://", "rtsp://", "http://"};
+    
+    // What a cached response was rendered from, see cachedResponse()
+    enum ConfigDependency {
+        DEPENDS_PROFILES = 1 << 0,
+        DEPENDS_ENCODERS = 1 << 1,
+        DEPENDENCY_COUNT = 2
+    };
+    
+    // Media configuration. A published MediaConfig is never modified: a
+    // change copies it, edits the copy and swaps the pointer, so a request
+    // renders from one consistent version even while the device is being
+    // reconfigured. `version` counts changes and changed[i] is the version
+    // that last touched dependency i.
+    struct MediaConfig {
+        std::vector<MediaProfile> profiles;
+        std::vector<VideoEncoderConfig> encoders;
+        uint32_t next_profile = 1;
+        uint32_t next_stream = 1;
+        uint64_t version = 0;
+        uint64_t changed[DEPENDENCY_COUNT] = {};
+        // Stream URIs per profile and transport after the host, parallel
+        // to `profiles`. Filled in by publishConfig, so answering
+        // GetStreamUri only prepends the address the client reached.
+        std::vector<std::array<std::string, STREAM_TRANSPORTS>> stream_paths;
+        
+        const MediaProfile* findProfile(std::string_view token) const {
+            for (const auto& profile : profiles) {
+                if (profile.token == token) {
+                    return &profile;
+                }
+            }
+            return nullptr;
+        }
+        
+        const VideoEncoderConfig* findEncoder(std::string_view token) const {
+            for (const auto& encoder : encoders) {
+                if (encoder.token == token) {
+                    return &encoder;
+                }
+            }
+            return nullptr;
+        }
+        
+        const VideoEncoderConfig* encoderOf(const MediaProfile& profile) const {
+            return profile.video_encoder_token.empty() ? nullptr : findEncoder(profile.video_encoder_token);
+        }
+        
+        int useCount(const std::string& encoder) const {
+            int count = 0;
+            for (const auto& profile : profiles) {
+                count += profile.video_encoder_token == encoder;
+            }
+            return count;
+        }
+        
+        size_t index(const MediaProfile& profile) const {
+            return &profile - profiles.data();
+        }
+        
+        const std::string& streamPath(const MediaProfile& profile, StreamTransport transport) const {
+            return stream_paths[index(profile)][transport];
+        }
+    };
+    
+    static const int SOURCE_WIDTH = 1920;
+    static const int SOURCE_HEIGHT = 1080;
+    static const size_t MAX_PROFILES = 32;
+    
+    std::shared_ptr<const MediaConfig> media_config;    // swapped under server_mutex
+    mutable std::mutex server_mutex;
+    // stop() may be called from any thread: it sets `draining` and wakes the
+    // event loop, which drains connections and then clears `running`
+    std::atomic<bool> running;
+    std::atomic<bool> draining;
+    bool verbose;
+    
+    // Device clock as set by SetSystemDateAndTime. `time_zone` is the POSIX
+    // TZ string reported back; local time is UTC plus `zone_offset` seconds.
+    CoarseClock clock;
+    bool ntp_time;
+    bool daylight_savings;
+    std::string time_zone;
+    int64_t zone_offset;
+    
+    // Pre-encoded JPEG still per profile, served from /snapshot/<token>.
+    // The HTTP headers (up to the Connection header) are rendered once when
+    // the image is set, and the bytes live in a memfd for sendfile().
+    struct SnapshotImage {
+        bool synthetic = false;
+        std::string jpeg;
+        std::string etag;
+        std::string ok_header;
+        std::string not_modified;
+        int fd = -1;
+        
+        ~SnapshotImage() {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    };
+    
+    std::map<std::string, std::shared_ptr<const SnapshotImage>> snapshots;
+    
+    // SOAP responses that only depend on configuration, rendered on first
+    // use. Keys name the service and operation plus any arguments that
+    // select the response. Each entry remembers the configuration version
+    // it was rendered from and which parts of the configuration it used.
+    // Compressed variants are made the first time a client accepts them and
+    // dropped with the response when it is rendered again.
+    // Only touched from the event loop thread.
+    struct CachedResponse {
+        std::string response;
+        unsigned depends;
+        uint64_t version;
+        std::string encoded[ENCODING_COUNT];
+    };
+    
+    static const size_t MAX_CACHED_RESPONSES = 4096;
+    std::unordered_map<std::pmr::string, CachedResponse> response_cache;
+    
+    // Request-scoped strings: cache keys and the like. Reset once each
+    // request has been answered.
+    RequestArena request_arena;
+    
+    // Response rendered for the request being answered, when it did not
+    // come from response_cache
+    std::string rendered_response;
+    // Cache entry the request being answered came from, if any
+    CachedResponse* answered_entry = nullptr;
+    
+    // Responses smaller than this go out as they are
+    static const size_t MIN_COMPRESSED_SIZE = 512;
+    // Cached variants are compressed once, so as small as zlib gets them;
+    // rendered responses as fast as possible into compressed_response
+    ResponseCompressor cache_compressor{Z_BEST_COMPRESSION};
+    ResponseCompressor response_compressor{Z_BEST_SPEED};
+    std::string compressed_response;
+    uint64_t cache_compressions = 0;
+    uint64_t response_compressions = 0;
+    
+    // PTZ heads by profile token, created on first use. Only touched from
+    // the event loop thread.
+    std::unordered_map<std::string, PTZHead> ptz_heads;
+    std::shared_ptr<PresetStore> presets;
+    uint32_t preset_device;             // key of this server's records in `presets`
+    
+    enum TimerKind {
+        TIMER_PULL_TIMEOUT,
+        TIMER_SUBSCRIPTION_EXPIRY,
+        TIMER_CONSUMER_RETRY,
+        TIMER_CONSUMER_TIMEOUT,
+        TIMER_CLOCK,
+        TIMER_DRAIN,
+        // Connection deadlines, one at a time in Connection::timer
+        TIMER_HEADER,
+        TIMER_BODY,
+        TIMER_IDLE,
+        TIMER_WRITE
+    };
+    
+    // Client connection owned by the event loop. Requests are parsed out of
+    // `in`; `out` (followed by an optional snapshot file) is the pending response.
+    // `writing` means EPOLLOUT is watched, or with io_uring that a send or a
+    // writability poll is in flight. A closed connection stays allocated
+    // until the ring has completed every operation that refers to it.
+    struct Connection {
+        int fd;
+        std::string in;
+        std::string out;
+        size_t out_offset = 0;
+        std::shared_ptr<const SnapshotImage> file;
+        off_t file_offset = 0;
+        bool keep_alive = true;
+        bool writing = false;
+        uint32_t parked_subscription = 0;
+        TimerNode timer;                // pull timeout or connection deadline
+        unsigned ring_operations = 0;
+        bool retired = false;
+        uint64_t client = 0;            // RateLimiter key of the peer address
+        // HTTPS connections are read and written through OpenSSL on the
+        // epoll path, whichever backend serves plain HTTP
+        SSL* ssl = nullptr;
+        bool handshaking = false;
+        bool served = false;            // answered a request already
+        int local_address = -1;         // index into local_addresses, see localAddress()
+    };
+    
+    // An address clients reached the server on, as XAddrs and stream URIs
+    // name it. The listeners are bound to the wildcard address, so a
+    // connection learns its own with getsockname the first time a response
+    // needs it. Entry 0 is localhost, for connections without one. Entries
+    // are never removed; a host has few addresses.
+    struct LocalAddress {
+        struct sockaddr_storage address;
+        std::string host;               // "192.0.2.1" or "[2001:db8::1]"
+        std::string base;               // scheme, host and port: "http://192.0.2.1:8080"
+    };
+    std::deque<LocalAddress> local_addresses;
+    
+    // Pull-point subscription. Its queue is the window of the event log
+    // between `cursor` and the log end, bounded by the log capacity; when a
+    // subscriber falls further behind, the oldest messages are dropped.
+    struct Consumer;
+    
+    struct Subscription {
+        uint32_t id;
+        std::string filter;
+        uint64_t cursor = 0;
+        time_t termination = 0;
+        Connection* waiter = nullptr;
+        size_t waiter_limit = 0;
+        TimerNode expiry;
+        
+        // Push subscriptions (WS-BaseNotification Subscribe)
+        Consumer* consumer = nullptr;
+        std::string consumer_path;
+    };
+    
+    // Outbound keep-alive HTTP connection to one notification consumer
+    // (host:port), shared by all its push subscriptions. At most one Notify
+    // is in flight; messages stay in the event log until the consumer
+    // acknowledges them, so a slow consumer only falls behind, and on
+    // failure the same batch is retried with exponential backoff.
+    struct Consumer {
+        std::string key;
+        std::string host;
+        struct sockaddr_storage address;
+        socklen_t address_length = 0;
+        int fd = -1;
+        bool connecting = false;
+        std::string out;
+        size_t out_offset = 0;
+        std::string in;
+        std::vector<uint32_t> subscriptions;
+        size_t next = 0;
+        uint32_t inflight = 0;          // subscription being delivered
+        uint64_t inflight_end = 0;      // cursor after the batch
+        int failures = 0;
+        TimerNode timer;
+    };
+    
+    static const size_t MAX_SUBSCRIPTIONS = 100000;
+    static const size_t MAX_NOTIFY_BATCH = 32;
+    static const uint64_t NOTIFY_TIMEOUT_MS = 10000;
+    // Time a response may go without the client reading any of it
+    static const uint64_t WRITE_TIMEOUT_MS = 30000;
+    static const size_t MAX_REQUEST_SIZE = 1 << 20;
+    
+    // Answers for clients over a limit, sent as they are
+    static constexpr std::string_view BUSY_RESPONSE =
+        "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+    static constexpr std::string_view BUSY_CLOSE_RESPONSE =
+        "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    
+    int epoll_fd;
+    int wake_fd;
+    TimerWheel timers;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    
+    // With the io_uring backend, client sockets are accepted, read and
+    // written through `ring`; epoll_fd still watches the wake eventfd and
+    // notification consumers, and the ring polls it. Completions carry the
+    // connection pointer with the operation in its low bits.
+    enum RingOperation : uint64_t {
+        RING_ACCEPT,
+        RING_EPOLL,
+        RING_RECV,
+        RING_SEND,
+        RING_WRITABLE,
+        RING_SHUTDOWN,
+        RING_CLOSE,
+        RING_REJECT,                    // 503 to a connection over the limit
+        RING_OPERATION_MASK = 7
+    };
+    
+    static const unsigned RING_ENTRIES = 256;
+    static const unsigned RING_BUFFERS = 128;
+    static const unsigned RING_BUFFER_SIZE = 4096;
+    
+    IoBackend io_backend;
+    IoRing ring;
+    std::vector<std::unique_ptr<Connection>> retired;
+    // System calls the event loop made for client connections, for onvif_bench
+    uint64_t loop_syscalls;
+    std::unordered_map<uint32_t, std::unique_ptr<Subscription>> subscriptions;
+    uint32_t next_subscription_id;
+    TimerNode clock_timer;
+    
+    std::unique_ptr<EventLog> events;
+    size_t event_backlog;
+    uint64_t dispatched_end;
+    std::unordered_set<uint32_t> parked;
+    std::unordered_map<std::string, std::unique_ptr<Consumer>> consumers;
+    std::unordered_map<int, Consumer*> consumer_fds;
+    
+    // Connections whose parked request was answered and that may have
+    // pipelined requests waiting
+    std::vector<int> resumed;
+    std::vector<struct epoll_event> poll_events;    // for poll()
+    
+    // Graceful shutdown, driven by the event loop once stop() was called.
+    // Connections still open when `drain_timer` fires are closed.
+    bool drain_started;
+    uint64_t drain_timeout_ms;
+    TimerNode drain_timer;
+    uint64_t requests_served;
+    
+    // Admission control. Connections beyond max_connections get a 503 and
+    // are closed right away; requests beyond a client's rate get a 503.
+    size_t max_connections;
+    int listen_backlog;
+    RateLimiter rate_limiter;
+    uint64_t rejected_connections;
+    uint64_t rate_limited_requests;
+    
+    // Connection deadlines: for a request's headers from its first byte
+    // (or from accept), for its body once the headers are in, and for a
+    // keep-alive connection between requests
+    uint64_t header_timeout_ms;
+    uint64_t body_timeout_ms;
+    uint64_t idle_timeout_ms;
+    uint64_t timed_out_connections;
+    
+    // HTTPS listener, off unless tls_port was set
+    int tls_port;
+    std::string tls_certificate;
+    std::string tls_key;
+    TlsContext tls;
+    int tls_socket;
+    uint64_t tls_handshakes;
+    uint64_t tls_resumptions;
+    uint64_t ktls_connections;
+
+public:
+    OnvifServer(int port = 8080)
+        : server_socket(-1), port(port), rtsp_port(port + 1), dual_stack(false), running(false), draining(false), verbose(false),
+          ntp_time(false), daylight_savings(false), time_zone("UTC"), zone_offset(0),
+          preset_device(0), epoll_fd(-1), wake_fd(-1), timers(steadyMs()), io_backend(IO_EPOLL), loop_syscalls(0), next_subscription_id(1),
+          event_backlog(1024), dispatched_end(0), drain_started(false), drain_timeout_ms(10000), requests_served(0),
+          max_connections(4096), listen_backlog(SOMAXCONN), rejected_connections(0), rate_limited_requests(0),
+          header_timeout_ms(10000), body_timeout_ms(30000), idle_timeout_ms(60000), timed_out_connections(0),
+          tls_port(-1), tls_socket(-1), tls_handshakes(0), tls_resumptions(0), ktls_connections(0) {
+        device_uuid = "urn:uuid:12345678-1234-1234-1234-123456789012";
+        device_name = "ONVIF Camera";
+        manufacturer = "Sample Manufacturer";
+        model = "Sample Model";
+        serial_number = "123456789";
+        firmware_version = "1.0.0";
+        
+        // Initialize default media profiles
+        initializeMediaProfiles();
+        
+        // Until real frames are provided every profile serves a gray image
+        std::shared_ptr<const MediaConfig> config = mediaConfig();
+        for (const auto& profile : config->profiles) {
+            refreshSyntheticSnapshot(*config, profile);
+        }
+    }
+    
+    ~OnvifServer() {
+        stop();
+        for (int fd : {server_socket, tls_socket, epoll_fd, wake_fd}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    
+    void setVerbose(bool enabled) {
+        verbose = enabled;
+    }
+    
+    // Serial number and hardware id, so that the devices of a simulated
+    // fleet can be told apart
+    void setIdentity(const std::string& serial, const std::string& uuid) {
+        serial_number = serial;
+        device_uuid = uuid;
+    }
+    
+    // How long stop() waits for in-flight requests before closing what is left
+    void setDrainTimeout(uint64_t ms) {
+        drain_timeout_ms = ms;
+    }
+    
+    // Port named in stream URIs, port + 1 unless set
+    void setRtspPort(int port) {
+        rtsp_port = port;
+        publishConfig(std::make_shared<MediaConfig>(*mediaConfig()), DEPENDS_PROFILES);
+    }
+    
+    // Serves HTTPS on `port` as well (0 picks a free one) with a PEM
+    // certificate chain and key, or a self-signed certificate when none is
+    // given. Takes effect at start().
+    void setTls(int port, const std::string& certificate, const std::string& key) {
+        tls_port = port;
+        tls_certificate = certificate;
+        tls_key = key;
+    }
+    
+    void setConnectionTimeouts(uint64_t header_ms, uint64_t body_ms, uint64_t idle_ms) {
+        header_timeout_ms = header_ms;
+        body_timeout_ms = body_ms;
+        idle_timeout_ms = idle_ms;
+    }
+    
+    void setMaxConnections(size_t count) {
+        max_connections = std::max<size_t>(count, 1);
+    }
+    
+    // Length of the kernel's accept queue; takes effect at start()
+    void setListenBacklog(int backlog) {
+        listen_backlog = backlog;
+    }
+    
+    // Requests per second allowed from one client address, with bursts of
+    // up to `burst` requests; 0 turns rate limiting off
+    void setRateLimit(uint64_t requests_per_second, uint64_t burst) {
+        rate_limiter.configure(requests_per_second, burst, max_connections * 4);
+    }
+    
+    // Takes effect at start(), which falls back to epoll when the kernel
+    // cannot set up io_uring
+    void setIoBackend(IoBackend backend) {
+        io_backend = backend;
+    }
+    
+    IoBackend ioBackend() const {
+        return ring.isOpen() ? IO_URING : IO_EPOLL;
+    }
+    
+    // Number of events kept for subscribers; takes effect at start()
+    void setEventBacklog(size_t size) {
+        event_backlog = std::max<size_t>(size, 1);
+    }
+    
+    // Log that event sources publish into; valid after start()
+    EventLog* eventLog() {
+        return events.get();
+    }
+    
+    // Tell the event loop that new events were published
+    void notifyEvents() {
+        wake();
+    }
+    
+    // Publish an event to every matching subscription. `message` is the
+    // tt:Message element. Safe to call from any thread after start().
+    bool postEvent(const std::string& topic, const std::string& message) {
+        std::string notification = renderNotification(topic, message);
+        if (!events || !events->publish(topic.data(), topic.size(), notification.size(),
+                [&](char* out) { memcpy(out, notification.data(), notification.size()); })) {
+            return false;
+        }
+        wake();
+        return true;
+    }
+    
+    static std::string renderNotification(const std::string& topic, const std::string& message) {
+        return "<wsnt:NotificationMessage>\n"
+               "<wsnt:Topic Dialect=\"http://www.onvif.org/ver10/tev/topicExpression/ConcreteSet\">" + topic + "</wsnt:Topic>\n"
+               "<wsnt:Message>" + message + "</wsnt:Message>\n"
+               "</wsnt:NotificationMessage>\n";
+    }
+    
+    // Replace the cached still for a profile. Safe to call while serving.
+    void setSnapshot(const std::string& token, const std::string& jpeg, bool synthetic = false) {
+        auto image = sharedSnapshot(jpeg, synthetic);
+        std::lock_guard<std::mutex> lock(server_mutex);
+        snapshots[token] = image;
+    }
+    
+    // Servers in one process share identical stills, so the devices of a
+    // simulated fleet hold one memfd per image rather than one per profile
+    static std::shared_ptr<const SnapshotImage> sharedSnapshot(const std::string& jpeg, bool synthetic) {
+        // FNV-1a over the image is good enough to identify a version
+        uint64_t hash = 1469598103934665603ULL;
+        for (unsigned char c : jpeg) {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+        static std::mutex images_mutex;
+        static std::map<std::pair<uint64_t, bool>, std::weak_ptr<const SnapshotImage>> images;
+        std::lock_guard<std::mutex> images_lock(images_mutex);
+        auto known = images.find({hash, synthetic});
+        if (known != images.end()) {
+            std::shared_ptr<const SnapshotImage> shared = known->second.lock();
+            if (shared && shared->jpeg == jpeg) {
+                return shared;
+            }
+        }
+        
+        auto image = std::make_shared<SnapshotImage>();
+        image->synthetic = synthetic;
+        image->jpeg = jpeg;
+        char etag[24];
+        snprintf(etag, sizeof(etag), "\"%016llx\"", static_cast<unsigned long long>(hash));
+        image->etag = etag;
+        
+        image->ok_header = "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: image/jpeg\r\n"
+                           "Content-Length: " + std::to_string(jpeg.size()) + "\r\n"
+                           "ETag: " + image->etag + "\r\n"
+                           "Cache-Control: no-cache\r\n";
+        image->not_modified = "HTTP/1.1 304 Not Modified\r\n"
+                              "ETag: " + image->etag + "\r\n";
+        
+        image->fd = memfd_create("snapshot", MFD_CLOEXEC);
+        if (image->fd >= 0 && write(image->fd, jpeg.data(), jpeg.size()) != static_cast<ssize_t>(jpeg.size())) {
+            close(image->fd);
+            image->fd = -1;
+        }
+        // Stills nobody holds any more, e.g. resizes for an old encoder setting
+        for (auto it = images.begin(); it != images.end();) {
+            it = it->second.expired() ? images.erase(it) : std::next(it);
+        }
+        images[{hash, synthetic}] = image;
+        return image;
+    }
+    
+    // Keeps PTZ presets and tours in `path` across restarts. Without it they
+    // only live as long as the process.
+    bool openPresetStore(const std::string& path) {
+        auto store = std::make_shared<PresetStore>();
+        if (!store->open(path)) {
+            return false;
+        }
+        setPresetStore(std::move(store), preset_device);
+        return true;
+    }
+    
+    // Keeps presets and tours in `store` under `device`, so that the
+    // devices of a simulated fleet share one table
+    void setPresetStore(std::shared_ptr<PresetStore> store, uint32_t device) {
+        presets = std::move(store);
+        preset_device = device;
+    }
+    
+    bool loadSnapshotFile(const std::string& token, const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        std::string jpeg((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        setSnapshot(token, jpeg);
+        return true;
+    }
+    
+    std::vector<std::string> profileTokens() const {
+        std::vector<std::string> tokens;
+        for (const auto& profile : mediaConfig()->profiles) {
+            tokens.push_back(profile.token);
+        }
+        return tokens;
+    }
+    
+private:
+    void initializeMediaProfiles() {
+        auto config = std::make_shared<MediaConfig>();
+        config->encoders = {
+            {"VideoEncoder_1", "MainStream", "H264", 1920, 1080, 30, 4000000, 1, 30, "Baseline"},
+            {"VideoEncoder_2", "SubStream", "H264", 640, 480, 15, 1000000, 1, 30, "Baseline"},
+            // Media2-era streams; the ver10 media service cannot describe H.265
+            {"VideoEncoder_3", "H265Stream", "H265", 1920, 1080, 25, 2000000, 1, 30, "Main"},
+            {"VideoEncoder_4", "MjpegStream", "JPEG", 640, 360, 5, 2000000, 1, 0, ""},
+        };
+        config->profiles = {
+            {"Profile_1", "MainStream", "VideoEncoder_1", "AudioEncoder_1", true, 1},
+            {"Profile_2", "SubStream", "VideoEncoder_2", "AudioEncoder_2", false, 2},
+            {"Profile_3", "H265Stream", "VideoEncoder_3", "AudioEncoder_1", false, 3},
+            {"Profile_4", "MjpegStream", "VideoEncoder_4", "AudioEncoder_2", false, 4},
+        };
+        config->next_profile = 5;
+        config->next_stream = 5;
+        publishConfig(config, DEPENDS_PROFILES | DEPENDS_ENCODERS);
+    }
+    
+    std::shared_ptr<const MediaConfig> mediaConfig() const {
+        std::lock_guard<std::mutex> lock(server_mutex);
+        return media_config;
+    }
+    
+    // Makes `next` the current configuration. Changes are only made from
+    // the event loop thread, so copying the current version, editing the
+    // copy and publishing it never loses an update.
+    void publishConfig(std::shared_ptr<MediaConfig> next, unsigned depends) {
+        next->stream_paths.resize(next->profiles.size());
+        for (size_t i = 0; i < next->profiles.size(); i++) {
+            std::string path = ":" + std::to_string(rtsp_port) + "/stream" + std::to_string(next->profiles[i].stream);
+            next->stream_paths[i] = {path, path + "/multicast", path};
+        }
+        std::lock_guard<std::mutex> lock(server_mutex);
+        next->version = media_config ? media_config->version + 1 : 1;
+        for (int i = 0; i < DEPENDENCY_COUNT; i++) {
+            if (depends & (1u << i)) {
+                next->changed[i] = next->version;
+            }
+        }
+        media_config = std::move(next);
+    }
+    
+    // Baseline JPEG of a uniform mid-gray frame. Each 8x8 block only has a
+    // zero DC difference and an end-of-block, so with one-symbol Huffman
+    // tables the scan is two zero bits per block.
+    static std::string buildSyntheticJpeg(int width, int height) {
+        std::string jpeg = "\xFF\xD8";
+        
+        // Quantization table, all ones
+        jpeg += std::string("\xFF\xDB\x00\x43\x00", 5) + std::string(64, '\x01');
+        
+        // Frame header: 8-bit precision, one grayscale component
+        jpeg += std::string("\xFF\xC0\x00\x0B\x08", 5);
+        jpeg += static_cast<char>(height >> 8);
+        jpeg += static_cast<char>(height & 0xFF);
+        jpeg += static_cast<char>(width >> 8);
+        jpeg += static_cast<char>(width & 0xFF);
+        jpeg += std::string("\x01\x01\x11\x00", 4);
+        
+        // DC and AC Huffman tables, each with a single 1-bit code for symbol 0
+        const std::string one_code = std::string("\x01", 1) + std::string(15, '\x00') + std::string(1, '\x00');
+        jpeg += std::string("\xFF\xC4\x00\x14\x00", 5) + one_code;
+        jpeg += std::string("\xFF\xC4\x00\x14\x10", 5) + one_code;
+        
+        // Start of scan
+        jpeg += std::string("\xFF\xDA\x00\x08\x01\x01\x00\x00\x3F\x00", 10);
+        
+        size_t blocks = static_cast<size_t>((width + 7) / 8) * ((height + 7) / 8);
+        size_t bits = blocks * 2;
+        jpeg += std::string(bits / 8, '\x00');
+        if (bits % 8) {
+            jpeg += static_cast<char>(0xFF >> (bits % 8));
+        }
+        
+        jpeg += "\xFF\xD9";
+        return jpeg;
+    }
+    
+    // xs:dateTime of `time` into a sink, see renderXml
+    template <typename Out>
+    static void renderTime(Out& out, int64_t time) {
+        char text[CoarseClock::TEXT_LENGTH];
+        CoarseClock::format(time, text);
+        out << std::string_view(text, CoarseClock::TEXT_LENGTH);
+    }
+    
+    // Seconds in an xs:duration such as PT60S, PT1M30S, PT0.5S or P1D
+    static double parseSeconds(const std::string& text, double fallback) {
+        if (text.empty() || text[0] != 'P') {
+            return fallback;
+        }
+        double seconds = 0;
+        double value = 0;
+        double scale = 0;   // place value of the next digit after a '.'
+        bool in_time = false;
+        for (size_t i = 1; i < text.size(); i++) {
+            char c = text[i];
+            if (c >= '0' && c <= '9') {
+                if (scale > 0) {
+                    value += (c - '0') * scale;
+                    scale /= 10;
+                } else {
+                    value = value * 10 + (c - '0');
+                }
+                continue;
+            }
+            switch (c) {
+                case 'T': in_time = true; break;
+                case 'D': seconds += value * 86400; break;
+                case 'H': seconds += value * 3600; break;
+                case 'M': seconds += in_time ? value * 60 : value * 2592000; break;
+                case 'S': seconds += value; break;
+                case '.': scale = 0.1; continue;
+                default: return fallback;
+            }
+            value = 0;
+            scale = 0;
+        }
+        return seconds;
+    }
+    
+    static long parseDuration(const std::string& text, long fallback) {
+        return static_cast<long>(parseSeconds(text, fallback));
+    }
+    
+    // Seconds from now until a termination time given either as a duration
+    // or as an absolute xs:dateTime
+    long parseTermination(const std::string& text, long fallback) const {
+        if (!text.empty() && text[0] >= '0' && text[0] <= '9') {
+            int64_t termination;
+            if (CoarseClock::parse(text, termination)) {
+                return std::max(0L, static_cast<long>(termination - clock.now()));
+            }
+            return fallback;
+        }
+        return parseDuration(text, fallback);
+    }
+    
+    // The helpers below walk a request or a fragment of one with the pull
+    // parser and match elements by local name, ignoring the namespace
+    // prefix, e.g. "ProfileToken" matches <trt:ProfileToken>.
+    
+    // Text content of the first element with the given local name. Entities
+    // are left in, since the text is echoed back into responses as is.
+    static std::string getElementText(std::string_view xml, std::string_view name) {
+        XmlPullParser parser(xml);
+        XmlPullParser::Event event;
+        while ((event = parser.next()) != XmlPullParser::DONE && event != XmlPullParser::ERROR) {
+            if (event == XmlPullParser::START && parser.name() == name) {
+                return !parser.emptyElement() && parser.next() == XmlPullParser::TEXT ? std::string(parser.value()) : "";
+            }
+        }
+        return "";
+    }
+    
+    // Markup between the start and end tags of the first element with the
+    // given local name, or the start tag itself for an empty element. With
+    // `from`, the search starts there and `from` is moved past the element
+    // (or to npos) so repeated elements can be walked.
+    static std::string getElementXml(std::string_view xml, std::string_view name, size_t* from = nullptr) {
+        XmlPullParser parser(xml, from ? *from : 0);
+        if (from) {
+            *from = std::string::npos;
+        }
+        XmlPullParser::Event event;
+        while ((event = parser.next()) != XmlPullParser::DONE && event != XmlPullParser::ERROR) {
+            if (event != XmlPullParser::START || parser.name() != name) {
+                continue;
+            }
+            if (parser.emptyElement()) {
+                if (from) {
+                    *from = parser.offset();
+                }
+                return std::string(parser.tag());
+            }
+            size_t content = parser.offset();
+            if (!parser.skipElement()) {
+                return "";
+            }
+            if (from) {
+                *from = parser.offset();
+            }
+            return std::string(xml.substr(content, parser.tagOffset() - content));
+        }
+        return "";
+    }
+    
+    // Start tag of the first element with the given local name, for
+    // reading its attributes
+    static std::string getStartTag(std::string_view xml, std::string_view name) {
+        XmlPullParser parser(xml);
+        XmlPullParser::Event event;
+        while ((event = parser.next()) != XmlPullParser::DONE && event != XmlPullParser::ERROR) {
+            if (event == XmlPullParser::START && parser.name() == name) {
+                return std::string(parser.tag());
+            }
+        }
+        return "";
+    }
+    
+    // Value of an attribute in the first start tag of `xml`
+    static std::string getAttribute(std::string_view xml, std::string_view name) {
+        XmlPullParser parser(xml);
+        return parser.next() == XmlPullParser::START ? std::string(parser.attribute(name)) : "";
+    }
+    
+    static std::string_view getHeader(std::string_view request, std::string_view name) {
+        size_t header_end = request.find("\r\n\r\n");
+        size_t pos = request.find("\r\n");
+        while (pos != std::string::npos && pos < header_end) {
+            size_t line = pos + 2;
+            size_t colon = request.find(':', line);
+            pos = request.find("\r\n", line);
+            if (colon == std::string::npos || colon > pos || colon - line != name.size() ||
+                strncasecmp(request.data() + line, name.data(), name.size()) != 0) {
+                continue;
+            }
+            size_t value = request.find_first_not_of(" \t", colon + 1);
+            return request.substr(value, pos - value);
+        }
+        return "";
+    }
+    
+    // Preferred coding in an Accept-Encoding header: gzip, then deflate,
+    // unless the client refused it with q=0
+    static ContentEncoding acceptedEncoding(std::string_view header) {
+        bool allowed[ENCODING_COUNT] = {};
+        while (!header.empty()) {
+            size_t end = std::min(header.find(','), header.size());
+            std::string_view item = header.substr(0, end);
+            header.remove_prefix(std::min(end + 1, header.size()));
+            
+            size_t semicolon = std::min(item.find(';'), item.size());
+            std::string_view coding = item.substr(0, semicolon);
+            coding.remove_prefix(std::min(coding.find_first_not_of(" \t"), coding.size()));
+            coding = coding.substr(0, coding.find_last_not_of(" \t") + 1);
+            // q=0, q=0. or q=0.000
+            std::string_view parameters = item.substr(semicolon);
+            size_t q = parameters.find("q=");
+            std::string_view weight = q == std::string_view::npos ? "" : parameters.substr(q + 2);
+            weight = weight.substr(0, weight.find_first_not_of("0123456789."));
+            bool refused = !weight.empty() && weight.find_first_not_of("0.") == std::string_view::npos;
+            if (equalsIgnoreCase(coding, "gzip") || equalsIgnoreCase(coding, "x-gzip")) {
+                allowed[ENCODING_GZIP] = !refused;
+            } else if (equalsIgnoreCase(coding, "deflate")) {
+                allowed[ENCODING_DEFLATE] = !refused;
+            }
+        }
+        return allowed[ENCODING_GZIP] ? ENCODING_GZIP : allowed[ENCODING_DEFLATE] ? ENCODING_DEFLATE : ENCODING_IDENTITY;
+    }
+    
+    // Content-Length and similar decimal header values; 0 when absent
+    static size_t parseSize(std::string_view text) {
+        size_t value = 0;
+        std::from_chars(text.data(), text.data() + text.size(), value);
+        return value;
+    }
+    
+    static bool equalsIgnoreCase(std::string_view text, std::string_view expected) {
+        return text.size() == expected.size() && strncasecmp(text.data(), expected.data(), text.size()) == 0;
+    }
+    
+    static constexpr char SOAP_ENVELOPE_START[] =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<SOAP-ENV:Envelope xmlns:SOAP-ENV=\"http://www.w3.org/2003/05/soap-envelope\" "
+        "xmlns:tds=\"http://www.onvif.org/ver10/device/wsdl\" "
+        "xmlns:trt=\"http://www.onvif.org/ver10/media/wsdl\" "
+        "xmlns:tr2=\"http://www.onvif.org/ver20/media/wsdl\" "
+        "xmlns:tptz=\"http://www.onvif.org/ver20/ptz/wsdl\" "
+        "xmlns:tev=\"http://www.onvif.org/ver10/events/wsdl\" "
+        "xmlns:wsnt=\"http://docs.oasis-open.org/wsn/b-2\" "
+        "xmlns:wsa=\"http://www.w3.org/2005/08/addressing\" "
+        "xmlns:tt=\"http://www.onvif.org/ver10/schema\" "
+        "xmlns:tns1=\"http://www.onvif.org/ver10/topics\">\n"
+        "<SOAP-ENV:Body>\n";
+    static constexpr char SOAP_ENVELOPE_END[] =
+        "</SOAP-ENV:Body>\n"
+        "</SOAP-ENV:Envelope>";
+    
+    // Envelope around the body written by `body(out)`, see renderXml
+    template <typename Body>
+    static std::string renderSoapEnvelope(Body body) {
+        return renderXml([&](auto& out) {
+            out << SOAP_ENVELOPE_START;
+            body(out);
+            out << SOAP_ENVELOPE_END;
+        });
+    }
+    
+    std::string generateSoapEnvelope(const std::string& body) {
+        return renderSoapEnvelope([&](auto& out) { out << body; });
+    }
+    
+    std::string handleGetDeviceInformation() {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tds:GetDeviceInformationResponse>\n"
+                   "<tds:Manufacturer>" << manufacturer << "</tds:Manufacturer>\n"
+                   "<tds:Model>" << model << "</tds:Model>\n"
+                   "<tds:FirmwareVersion>" << firmware_version << "</tds:FirmwareVersion>\n"
+                   "<tds:SerialNumber>" << serial_number << "</tds:SerialNumber>\n"
+                   "<tds:HardwareId>" << device_uuid << "</tds:HardwareId>\n"
+                   "</tds:GetDeviceInformationResponse>";
+        });
+    }
+    
+    std::string handleGetCapabilities(const LocalAddress& local) {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tds:GetCapabilitiesResponse>\n"
+                   "<tds:Capabilities>\n"
+                   "<tds:Device>\n"
+                   "<tds:XAddr>" << local.base << "/onvif/device_service</tds:XAddr>\n"
+                   "<tds:Network>\n"
+                   "<tds:IPFilter>false</tds:IPFilter>\n"
+                   "<tds:ZeroConfiguration>false</tds:ZeroConfiguration>\n"
+                   "<tds:IPVersion6>" << (dual_stack ? "true" : "false") << "</tds:IPVersion6>\n"
+                   "<tds:DynDNS>false</tds:DynDNS>\n"
+                   "</tds:Network>\n"
+                   "<tds:System>\n"
+                   "<tds:DiscoveryResolve>false</tds:DiscoveryResolve>\n"
+                   "<tds:DiscoveryBye>false</tds:DiscoveryBye>\n"
+                   "<tds:RemoteDiscovery>false</tds:RemoteDiscovery>\n"
+                   "<tds:SystemBackup>false</tds:SystemBackup>\n"
+                   "<tds:SystemLogging>false</tds:SystemLogging>\n"
+                   "<tds:FirmwareUpgrade>false</tds:FirmwareUpgrade>\n"
+                   "</tds:System>\n"
+                   "<tds:IO>\n"
+                   "<tds:InputConnectors>0</tds:InputConnectors>\n"
+                   "<tds:RelayOutputs>0</tds:RelayOutputs>\n"
+                   "</tds:IO>\n"
+                   "<tds:Security>\n"
+                   "<tds:TLS1.1>false</tds:TLS1.1>\n"
+                   "<tds:TLS1.2>" << (tls_port >= 0 ? "true" : "false") << "</tds:TLS1.2>\n"
+                   "<tds:OnboardKeyGeneration>false</tds:OnboardKeyGeneration>\n"
+                   "<tds:AccessPolicyConfig>false</tds:AccessPolicyConfig>\n"
+                   "<tds:X.509Token>false</tds:X.509Token>\n"
+                   "<tds:SAMLToken>false</tds:SAMLToken>\n"
+                   "<tds:KerberosToken>false</tds:KerberosToken>\n"
+                   "<tds:RELToken>false</tds:RELToken>\n"
+                   "</tds:Security>\n"
+                   "</tds:Device>\n"
+                   "<tds:Events>\n"
+                   "<tds:XAddr>" << local.base << "/onvif/event_service</tds:XAddr>\n"
+                   "<tds:WSSubscriptionPolicySupport>false</tds:WSSubscriptionPolicySupport>\n"
+                   "<tds:WSPullPointSupport>true</tds:WSPullPointSupport>\n"
+                   "<tds:WSPausableSubscriptionManagerInterfaceSupport>false</tds:WSPausableSubscriptionManagerInterfaceSupport>\n"
+                   "</tds:Events>\n"
+                   "<tds:Media>\n"
+                   "<tds:XAddr>" << local.base << "/onvif/media_service</tds:XAddr>\n"
+                   "<tds:StreamingCapabilities>\n"
+                   "<tds:RTPMulticast>true</tds:RTPMulticast>\n"
+                   "<tds:RTP_TCP>true</tds:RTP_TCP>\n"
+                   "<tds:RTP_RTSP_TCP>true</tds:RTP_RTSP_TCP>\n"
+                   "</tds:StreamingCapabilities>\n"
+                   "</tds:Media>\n"
+                   "<tds:PTZ>\n"
+                   "<tds:XAddr>" << local.base << "/onvif/ptz_service</tds:XAddr>\n"
+                   "</tds:PTZ>\n"
+                   "</tds:Capabilities>\n"
+                   "</tds:GetCapabilitiesResponse>";
+        });
+    }
+    
+    template <typename Out>
+    static void renderVideoEncoderConfiguration(Out& out, const MediaConfig& config, const VideoEncoderConfig& encoder,
+                                                std::string_view element) {
+        out << "<" << element << " token=\"" << encoder.token << "\">\n"
+               "<trt:Name>" << encoder.name << "</trt:Name>\n"
+               "<trt:UseCount>" << config.useCount(encoder.token) << "</trt:UseCount>\n"
+               "<trt:Encoding>" << encoder.encoding << "</trt:Encoding>\n"
+               "<trt:Resolution>\n"
+               "<trt:Width>" << encoder.width << "</trt:Width>\n"
+               "<trt:Height>" << encoder.height << "</trt:Height>\n"
+               "</trt:Resolution>\n"
+               "<trt:Quality>" << encoder.quality << "</trt:Quality>\n"
+               "<trt:RateControl>\n"
+               "<trt:FrameRateLimit>" << encoder.framerate << "</trt:FrameRateLimit>\n"
+               "<trt:EncodingInterval>1</trt:EncodingInterval>\n"
+               "<trt:BitrateLimit>" << encoder.bitrate << "</trt:BitrateLimit>\n"
+               "</trt:RateControl>\n";
+        if (encoder.encoding == "H264") {
+            out << "<trt:H264>\n"
+                   "<trt:GovLength>" << encoder.gov_length << "</trt:GovLength>\n"
+                   "<trt:H264Profile>" << encoder.codec_profile << "</trt:H264Profile>\n"
+                   "</trt:H264>\n";
+        }
+        out << "</" << element << ">\n";
+    }
+    
+    std::string handleGetProfiles(const MediaConfig& config) {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<trt:GetProfilesResponse>\n";
+            for (const auto& profile : config.profiles) {
+                const VideoEncoderConfig* encoder = config.encoderOf(profile);
+                out << "<trt:Profiles token=\"" << profile.token << "\" fixed=\"" << (profile.fixed ? "true" : "false") << "\">\n"
+                       "<trt:Name>" << profile.name << "</trt:Name>\n"
+                       "<trt:VideoSourceConfiguration token=\"VideoSource_1\" fixed=\"true\">\n"
+                       "<trt:Name>VideoSourceConfig</trt:Name>\n"
+                       "<trt:UseCount>" << config.profiles.size() << "</trt:UseCount>\n"
+                       "<trt:SourceToken>VideoSource_1</trt:SourceToken>\n"
+                       "<trt:Bounds x=\"0\" y=\"0\" width=\"" << (encoder ? encoder->width : SOURCE_WIDTH) <<
+                       "\" height=\"" << (encoder ? encoder->height : SOURCE_HEIGHT) << "\"/>\n"
+                       "</trt:VideoSourceConfiguration>\n";
+                if (encoder && encoder->encoding != "H265") {
+                    renderVideoEncoderConfiguration(out, config, *encoder, "trt:VideoEncoderConfiguration");
+                }
+                out << "</trt:Profiles>\n";
+            }
+            out << "</trt:GetProfilesResponse>";
+        });
+    }
+    
+    // Encoder configurations the ver10 service can describe
+    std::string handleGetVideoEncoderConfigurations(const MediaConfig& config) {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<trt:GetVideoEncoderConfigurationsResponse>\n";
+            for (const auto& encoder : config.encoders) {
+                if (encoder.encoding != "H265") {
+                    renderVideoEncoderConfiguration(out, config, encoder, "trt:Configurations");
+                }
+            }
+            out << "</trt:GetVideoEncoderConfigurationsResponse>";
+        });
+    }
+    
+    std::string handleGetVideoEncoderConfiguration(const MediaConfig& config, const VideoEncoderConfig& encoder) {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<trt:GetVideoEncoderConfigurationResponse>\n";
+            renderVideoEncoderConfiguration(out, config, encoder, "trt:Configuration");
+            out << "</trt:GetVideoEncoderConfigurationResponse>";
+        });
+    }
+    
+    // StreamSetup of a ver10 GetStreamUri request: Stream is RTP-Unicast
+    // or RTP-Multicast, Transport/Protocol one of UDP, TCP, RTSP or HTTP.
+    // Both may be left out for a unicast stream.
+    static bool parseStreamSetup(std::string_view stream, std::string_view protocol, StreamTransport& transport) {
+        if (protocol != "" && protocol != "UDP" && protocol != "TCP" && protocol != "RTSP" && protocol != "HTTP") {
+            return false;
+        }
+        if (stream == "" || stream == "RTP-Unicast") {
+            transport = protocol == "HTTP" ? STREAM_TUNNEL : STREAM_UNICAST;
+            return true;
+        }
+        if (stream == "RTP-Multicast" && protocol != "HTTP" && protocol != "TCP") {
+            transport = STREAM_MULTICAST;
+            return true;
+        }
+        return false;
+    }
+    
+    std::string handleGetStreamUri(const MediaConfig& config, const LocalAddress& local, const MediaProfile& profile,
+                                   StreamTransport transport) {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<trt:GetStreamUriResponse>\n"
+                   "<trt:MediaUri>\n"
+                   "<trt:Uri>" << STREAM_SCHEMES[transport] << local.host << config.streamPath(profile, transport) << "</trt:Uri>\n"
+                   "<trt:InvalidAfterConnect>false</trt:InvalidAfterConnect>\n"
+                   "<trt:InvalidAfterReboot>false</trt:InvalidAfterReboot>\n"
+                   "<trt:Timeout>PT60S</trt:Timeout>\n"
+                   "</trt:MediaUri>\n"
+                   "</trt:GetStreamUriResponse>";
+        });
+    }
+    
+    std::string handleGetSnapshotUri(const MediaConfig& config, const LocalAddress& local, std::string_view request) {
+        // Without a ProfileToken, the first profile's still as GetStreamUri does
+        std::string token = getElementText(request, "ProfileToken");
+        const MediaProfile* profile = token.empty() && !config.profiles.empty() ? &config.profiles.front()
+                                                                                 : config.findProfile(token);
+        if (!profile) {
+            return generateFault("Sender", "No such profile");
+        }
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<trt:GetSnapshotUriResponse>\n"
+                   "<trt:MediaUri>\n"
+                   "<trt:Uri>" << local.base << "/snapshot/" << profile->token << "</trt:Uri>\n"
+                   "<trt:InvalidAfterConnect>false</trt:InvalidAfterConnect>\n"
+                   "<trt:InvalidAfterReboot>false</trt:InvalidAfterReboot>\n"
+                   "<trt:Timeout>PT0S</trt:Timeout>\n"
+                   "</trt:MediaUri>\n"
+                   "</trt:GetSnapshotUriResponse>";
+        });
+    }
+    
+    struct ServiceInfo {
+        const char* ns;
+        const char* path;
+        int major;
+        int minor;
+    };
+    
+    static constexpr ServiceInfo SERVICES[] = {
+        {"http://www.onvif.org/ver10/device/wsdl", "device_service", 2, 0},
+        {"http://www.onvif.org/ver10/media/wsdl", "media_service", 2, 0},
+        {"http://www.onvif.org/ver20/media/wsdl", "media2_service", 2, 0},
+        {"http://www.onvif.org/ver20/ptz/wsdl", "ptz_service", 2, 0},
+        {"http://www.onvif.org/ver10/events/wsdl", "event_service", 2, 0},
+    };
+    
+    std::string handleGetServices(const LocalAddress& local) {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tds:GetServicesResponse>\n";
+            for (const auto& service : SERVICES) {
+                out << "<tds:Service>\n"
+                       "<tds:Namespace>" << service.ns << "</tds:Namespace>\n"
+                       "<tds:XAddr>" << local.base << "/onvif/" << service.path << "</tds:XAddr>\n"
+                       "<tds:Version><tt:Major>" << service.major << "</tt:Major>"
+                       "<tt:Minor>" << service.minor << "</tt:Minor></tds:Version>\n"
+                       "</tds:Service>\n";
+            }
+            out << "</tds:GetServicesResponse>";
+        });
+    }
+    
+    // Media2 service (ver20). Encodings use the Media2 names (H264, H265,
+    // JPEG) and bitrates are in kbit/s.
+    
+    enum ConfigurationType {
+        CONFIG_VIDEO_SOURCE = 1,
+        CONFIG_VIDEO_ENCODER = 2,
+        CONFIG_PTZ = 4,
+        CONFIG_ALL = 7
+    };
+    
+    // Bitmask of the configuration types listed in a Media2 GetProfiles
+    // request; none means names only
+    static int parseConfigurationTypes(const SoapMessage& request) {
+        static const struct {
+            const char* name;
+            int type;
+        } names[] = {
+            {"All", CONFIG_ALL},
+            {"VideoSource", CONFIG_VIDEO_SOURCE},
+            {"VideoEncoder", CONFIG_VIDEO_ENCODER},
+            {"PTZ", CONFIG_PTZ},
+        };
+        int types = 0;
+        for (int i = 0; i < request.field_count; i++) {
+            for (const auto& name : names) {
+                if (request.fields[i].name == "Type" && request.fields[i].text == name.name) {
+                    types |= name.type;
+                }
+            }
+        }
+        return types;
+    }
+    
+    template <typename Out>
+    static void renderMedia2Encoder(Out& out, const MediaConfig& config, const VideoEncoderConfig& encoder,
+                                    std::string_view element) {
+        out << "<" << element << " token=\"" << encoder.token << "\"";
+        if (!encoder.codec_profile.empty()) {
+            out << " GovLength=\"" << encoder.gov_length << "\" Profile=\"" << encoder.codec_profile << "\"";
+        }
+        out << ">\n"
+               "<tt:Name>" << encoder.name << "</tt:Name>\n"
+               "<tt:UseCount>" << config.useCount(encoder.token) << "</tt:UseCount>\n"
+               "<tt:Encoding>" << encoder.encoding << "</tt:Encoding>\n"
+               "<tt:Resolution>\n"
+               "<tt:Width>" << encoder.width << "</tt:Width>\n"
+               "<tt:Height>" << encoder.height << "</tt:Height>\n"
+               "</tt:Resolution>\n"
+               "<tt:RateControl ConstantBitRate=\"false\">\n"
+               "<tt:FrameRateLimit>" << encoder.framerate << "</tt:FrameRateLimit>\n"
+               "<tt:BitrateLimit>" << encoder.bitrate / 1000 << "</tt:BitrateLimit>\n"
+               "</tt:RateControl>\n"
+               "<tt:Quality>" << encoder.quality << "</tt:Quality>\n"
+               "</" << element << ">\n";
+    }
+    
+    template <typename Out>
+    static void renderMedia2Profile(Out& out, const MediaConfig& config, const MediaProfile& profile, int types) {
+        const VideoEncoderConfig* encoder = config.encoderOf(profile);
+        out << "<tr2:Profiles token=\"" << profile.token << "\" fixed=\"" << (profile.fixed ? "true" : "false") << "\">\n"
+               "<tr2:Name>" << profile.name << "</tr2:Name>\n";
+        if (types) {
+            out << "<tr2:Configurations>\n";
+        }
+        if (types & CONFIG_VIDEO_SOURCE) {
+            out << "<tr2:VideoSource token=\"VideoSource_1\">\n"
+                   "<tt:Name>VideoSourceConfig</tt:Name>\n"
+                   "<tt:UseCount>" << config.profiles.size() << "</tt:UseCount>\n"
+                   "<tt:SourceToken>VideoSource_1</tt:SourceToken>\n"
+                   "<tt:Bounds x=\"0\" y=\"0\" width=\"" << (encoder ? encoder->width : SOURCE_WIDTH) <<
+                   "\" height=\"" << (encoder ? encoder->height : SOURCE_HEIGHT) << "\"/>\n"
+                   "</tr2:VideoSource>\n";
+        }
+        if ((types & CONFIG_VIDEO_ENCODER) && encoder) {
+            renderMedia2Encoder(out, config, *encoder, "tr2:VideoEncoder");
+        }
+        if (types & CONFIG_PTZ) {
+            out << "<tr2:PTZ token=\"PTZConfig_1\">\n"
+                   "<tt:Name>PTZ Configuration</tt:Name>\n"
+                   "<tt:UseCount>" << config.profiles.size() << "</tt:UseCount>\n"
+                   "<tt:NodeToken>PTZNode_1</tt:NodeToken>\n"
+                   "</tr2:PTZ>\n";
+        }
+        if (types) {
+            out << "</tr2:Configurations>\n";
+        }
+        out << "</tr2:Profiles>\n";
+    }
+    
+    std::string handleMedia2GetProfiles(const MediaConfig& config, std::string_view token, int types) {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tr2:GetProfilesResponse>\n";
+            for (const auto& profile : config.profiles) {
+                if (token.empty() || profile.token == token) {
+                    renderMedia2Profile(out, config, profile, types);
+                }
+            }
+            out << "</tr2:GetProfilesResponse>";
+        });
+    }
+    
+    // Media2 names the transport in a single Protocol element
+    static bool parseStreamProtocol(std::string_view protocol, StreamTransport& transport) {
+        if (protocol == "RtspUnicast" || protocol == "RTSP") {
+            transport = STREAM_UNICAST;
+        } else if (protocol == "RtspMulticast") {
+            transport = STREAM_MULTICAST;
+        } else if (protocol == "RtspOverHttp") {
+            transport = STREAM_TUNNEL;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    
+    std::string handleMedia2GetStreamUri(const MediaConfig& config, const LocalAddress& local, const MediaProfile& profile,
+                                         StreamTransport transport) {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tr2:GetStreamUriResponse>\n"
+                   "<tr2:Uri>" << STREAM_SCHEMES[transport] << local.host << config.streamPath(profile, transport) << "</tr2:Uri>\n"
+                   "</tr2:GetStreamUriResponse>";
+        });
+    }
+    
+    // What GetVideoEncoderConfigurationOptions advertises, and so what
+    // SetVideoEncoderConfiguration accepts
+    struct EncodingOptions {
+        const char* encoding;
+        const char* profiles;   // codec profiles, nullptr when there are none
+        int max_bitrate;        // kbit/s
+    };
+    
+    static constexpr EncodingOptions ENCODINGS[] = {
+        {"H264", "Baseline Main High", 16384},
+        {"H265", "Main", 16384},
+        {"JPEG", nullptr, 32768},
+    };
+    static constexpr int RESOLUTIONS[][2] = {{1920, 1080}, {1280, 720}, {640, 480}, {640, 360}, {320, 240}};
+    static constexpr int FRAME_RATES[] = {30, 25, 15, 10, 5, 1};
+    static const int MIN_BITRATE = 64;
+    static const int MAX_GOV_LENGTH = 300;
+    
+    static bool validEncoder(const VideoEncoderConfig& encoder) {
+        const EncodingOptions* options = nullptr;
+        for (const auto& candidate : ENCODINGS) {
+            if (encoder.encoding == candidate.encoding) {
+                options = &candidate;
+            }
+        }
+        bool resolution = false;
+        for (const auto& r : RESOLUTIONS) {
+            resolution |= encoder.width == r[0] && encoder.height == r[1];
+        }
+        bool framerate = false;
+        for (int rate : FRAME_RATES) {
+            framerate |= encoder.framerate == rate;
+        }
+        if (!options || !resolution || !framerate ||
+            encoder.bitrate / 1000 < MIN_BITRATE || encoder.bitrate / 1000 > options->max_bitrate ||
+            encoder.quality < 1 || encoder.quality > 100 || encoder.name.empty()) {
+            return false;
+        }
+        if (!options->profiles) {
+            return encoder.codec_profile.empty();
+        }
+        std::string profiles = std::string(" ") + options->profiles + " ";
+        return encoder.gov_length >= 1 && encoder.gov_length <= MAX_GOV_LENGTH &&
+               profiles.find(" " + encoder.codec_profile + " ") != std::string::npos;
+    }
+    
+    std::string handleGetVideoEncoderConfigurationOptions() {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tr2:GetVideoEncoderConfigurationOptionsResponse>\n";
+            for (const auto& encoding : ENCODINGS) {
+                out << "<tr2:Options";
+                if (encoding.profiles) {
+                    out << " GovLengthRange=\"1 " << MAX_GOV_LENGTH << "\" ProfilesSupported=\"" << encoding.profiles << "\"";
+                }
+                out << " FrameRatesSupported=\"";
+                for (int rate : FRAME_RATES) {
+                    out << rate << (rate == FRAME_RATES[std::size(FRAME_RATES) - 1] ? "" : " ");
+                }
+                out << "\" ConstantBitRateSupported=\"true\">\n"
+                       "<tt:Encoding>" << encoding.encoding << "</tt:Encoding>\n"
+                       "<tt:QualityRange><tt:Min>1</tt:Min><tt:Max>100</tt:Max></tt:QualityRange>\n";
+                for (const auto& resolution : RESOLUTIONS) {
+                    out << "<tt:ResolutionsAvailable><tt:Width>" << resolution[0] << "</tt:Width>"
+                           "<tt:Height>" << resolution[1] << "</tt:Height></tt:ResolutionsAvailable>\n";
+                }
+                out << "<tt:BitrateRange><tt:Min>" << MIN_BITRATE << "</tt:Min><tt:Max>" << encoding.max_bitrate <<
+                       "</tt:Max></tt:BitrateRange>\n"
+                       "</tr2:Options>\n";
+            }
+            out << "</tr2:GetVideoEncoderConfigurationOptionsResponse>";
+        });
+    }
+    
+    std::string handleMedia2GetVideoEncoderConfigurations(const MediaConfig& config, std::string_view token,
+                                                          std::string_view profile_token) {
+        const MediaProfile* profile = profile_token.empty() ? nullptr : config.findProfile(profile_token);
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tr2:GetVideoEncoderConfigurationsResponse>\n";
+            for (const auto& encoder : config.encoders) {
+                if ((token.empty() || encoder.token == token) && (!profile || profile->video_encoder_token == encoder.token)) {
+                    renderMedia2Encoder(out, config, encoder, "tr2:Configurations");
+                }
+            }
+            out << "</tr2:GetVideoEncoderConfigurationsResponse>";
+        });
+    }
+    
+    // Media configuration changes. Each copies the current MediaConfig,
+    // edits the copy and publishes it with the dependencies it touched, so
+    // only cached responses rendered from those are rebuilt.
+    
+    // Regenerates the gray still of a profile at its encoder's resolution,
+    // unless a real image was provided
+    void refreshSyntheticSnapshot(const MediaConfig& config, const MediaProfile& profile) {
+        {
+            std::lock_guard<std::mutex> lock(server_mutex);
+            auto it = snapshots.find(profile.token);
+            if (it != snapshots.end() && !it->second->synthetic) {
+                return;
+            }
+        }
+        const VideoEncoderConfig* encoder = config.encoderOf(profile);
+        setSnapshot(profile.token, buildSyntheticJpeg(encoder ? encoder->width : SOURCE_WIDTH,
+                                                      encoder ? encoder->height : SOURCE_HEIGHT), true);
+    }
+    
+    // Whole decimal text in [0, max], without sign, spaces or trailing text
+    static bool parseNumber(const std::string& text, int max, int& value) {
+        int parsed;
+        auto result = std::from_chars(text.data(), text.data() + text.size(), parsed);
+        if (result.ec != std::errc() || result.ptr != text.data() + text.size() || parsed < 0 || parsed > max) {
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+    
+    // Applies the fields present in a ver10 or Media2 encoder configuration.
+    // `tag` is the start tag, which carries the Media2 codec attributes.
+    // Returns false when a number is malformed or out of range; Media2
+    // gives the bitrate in kbit/s, which must not overflow once scaled.
+    static bool parseEncoder(const std::string& xml, const std::string& tag, bool media2, VideoEncoderConfig& encoder) {
+        std::string text;
+        if (!(text = getElementText(xml, "Name")).empty()) {
+            encoder.name = text;
+        }
+        if (!(text = getElementText(xml, "Encoding")).empty() && text != encoder.encoding) {
+            // A new encoding starts from its first codec profile
+            encoder.encoding = text;
+            encoder.codec_profile.clear();
+            for (const auto& options : ENCODINGS) {
+                if (text == options.encoding && options.profiles) {
+                    encoder.codec_profile = std::string(options.profiles).substr(0, std::string(options.profiles).find(' '));
+                    encoder.gov_length = encoder.gov_length ? encoder.gov_length : 30;
+                }
+            }
+        }
+        if (!(text = getElementText(xml, "Width")).empty() && !parseNumber(text, INT_MAX, encoder.width)) {
+            return false;
+        }
+        if (!(text = getElementText(xml, "Height")).empty() && !parseNumber(text, INT_MAX, encoder.height)) {
+            return false;
+        }
+        if (!(text = getElementText(xml, "Quality")).empty()) {
+            // xs:float; only the range validEncoder accepts is of interest
+            char* end;
+            double quality = std::strtod(text.c_str(), &end);
+            if (*end != '\0' || !(quality >= 0 && quality <= 100)) {
+                return false;
+            }
+            encoder.quality = static_cast<int>(std::lround(quality));
+        }
+        if (!(text = getElementText(xml, "FrameRateLimit")).empty() && !parseNumber(text, INT_MAX, encoder.framerate)) {
+            return false;
+        }
+        if (!(text = getElementText(xml, "BitrateLimit")).empty()) {
+            int bitrate;
+            if (!parseNumber(text, media2 ? INT_MAX / 1000 : INT_MAX, bitrate)) {
+                return false;
+            }
+            encoder.bitrate = bitrate * (media2 ? 1000 : 1);
+        }
+        if (media2) {
+            if (!(text = getAttribute(tag, "GovLength")).empty() && !parseNumber(text, INT_MAX, encoder.gov_length)) {
+                return false;
+            }
+            if (!(text = getAttribute(tag, "Profile")).empty()) {
+                encoder.codec_profile = text;
+            }
+        } else if (encoder.encoding == "H264") {
+            if (!(text = getElementText(xml, "GovLength")).empty() && !parseNumber(text, INT_MAX, encoder.gov_length)) {
+                return false;
+            }
+            if (!(text = getElementText(xml, "H264Profile")).empty()) {
+                encoder.codec_profile = text;
+            }
+        }
+        return true;
+    }
+    
+    std::string handleSetVideoEncoderConfiguration(const MediaConfig& config, std::string_view request, bool media2) {
+        std::string tag = getStartTag(request, "Configuration");
+        const VideoEncoderConfig* current = config.findEncoder(getAttribute(tag, "token"));
+        if (!current) {
+            return generateFault("Sender", "No such configuration");
+        }
+        VideoEncoderConfig encoder = *current;
+        if (!parseEncoder(getElementXml(request, "Configuration"), tag, media2, encoder) ||
+            !validEncoder(encoder) || (!media2 && encoder.encoding == "H265")) {
+            return generateFault("Sender", "Configuration not supported");
+        }
+        
+        auto next = std::make_shared<MediaConfig>(config);
+        for (auto& candidate : next->encoders) {
+            if (candidate.token == encoder.token) {
+                candidate = encoder;
+            }
+        }
+        publishConfig(next, DEPENDS_ENCODERS);
+        if (encoder.width != current->width || encoder.height != current->height) {
+            for (const auto& profile : next->profiles) {
+                if (profile.video_encoder_token == encoder.token) {
+                    refreshSyntheticSnapshot(*next, profile);
+                }
+            }
+        }
+        return generateSoapEnvelope(media2 ? "<tr2:SetVideoEncoderConfigurationResponse/>" :
+                                             "<trt:SetVideoEncoderConfigurationResponse/>");
+    }
+    
+    // Adds a profile and returns its token, or an empty token and a fault
+    std::string createProfile(const MediaConfig& config, const std::string& name, std::string token,
+                              const std::string& encoder, std::string& fault) {
+        if (config.profiles.size() >= MAX_PROFILES) {
+            fault = generateFault("Receiver", "Maximum number of profiles reached");
+        } else if (name.empty()) {
+            fault = generateFault("Sender", "Profile name missing");
+        } else if (!token.empty() && config.findProfile(token)) {
+            fault = generateFault("Sender", "Profile token already exists");
+        } else if (!encoder.empty() && !config.findEncoder(encoder)) {
+            fault = generateFault("Sender", "No such configuration");
+        }
+        if (!fault.empty()) {
+            return "";
+        }
+        
+        auto next = std::make_shared<MediaConfig>(config);
+        while (token.empty() || next->findProfile(token)) {
+            token = "Profile_" + std::to_string(next->next_profile++);
+        }
+        // A client may still hold the URI of a deleted profile, so stream
+        // numbers are not reused
+        next->profiles.push_back(MediaProfile{token, name, encoder, "", false, next->next_stream++});
+        publishConfig(next, DEPENDS_PROFILES);
+        refreshSyntheticSnapshot(*next, next->profiles.back());
+        return token;
+    }
+    
+    // Returns a fault, or an empty string once the profile is gone
+    std::string deleteProfile(const MediaConfig& config, const std::string& token) {
+        const MediaProfile* profile = config.findProfile(token);
+        if (!profile) {
+            return generateFault("Sender", "No such profile");
+        }
+        if (profile->fixed) {
+            return generateFault("Sender", "Fixed profile cannot be deleted");
+        }
+        auto next = std::make_shared<MediaConfig>(config);
+        next->profiles.erase(next->profiles.begin() + config.index(*profile));
+        publishConfig(next, DEPENDS_PROFILES);
+        {
+            std::lock_guard<std::mutex> lock(server_mutex);
+            snapshots.erase(token);
+        }
+        ptz_heads.erase(token);
+        return "";
+    }
+    
+    // Attaches an encoder configuration to a profile, or detaches it when
+    // `encoder` is empty. Returns a fault or an empty string.
+    std::string setProfileEncoder(const MediaConfig& config, const std::string& token, const std::string& encoder) {
+        const MediaProfile* profile = config.findProfile(token);
+        if (!profile) {
+            return generateFault("Sender", "No such profile");
+        }
+        if (!encoder.empty() && !config.findEncoder(encoder)) {
+            return generateFault("Sender", "No such configuration");
+        }
+        auto next = std::make_shared<MediaConfig>(config);
+        MediaProfile& changed = next->profiles[config.index(*profile)];
+        changed.video_encoder_token = encoder;
+        publishConfig(next, DEPENDS_PROFILES);
+        refreshSyntheticSnapshot(*next, changed);
+        return "";
+    }
+    
+    // Media2 counterpart of cachedOperation
+    const std::string* cachedMedia2Operation(Connection* conn, const MediaConfig& config, const SoapMessage& request) {
+        if (request.operation == "GetProfiles") {
+            std::string_view token = request.field("Token");
+            if (!token.empty() && !config.findProfile(token)) {
+                rendered_response = generateFault("Sender", "No such profile");
+                return &rendered_response;
+            }
+            int types = parseConfigurationTypes(request);
+            char type_digit[] = {char('0' + types), '/', '\0'};
+            return &cachedResponse(config, cacheKey("media2/GetProfiles/", type_digit, token),
+                                   DEPENDS_PROFILES | DEPENDS_ENCODERS, [&] {
+                return handleMedia2GetProfiles(config, token, types);
+            });
+        }
+        if (request.operation == "GetStreamUri") {
+            StreamTransport transport;
+            const MediaProfile* profile = config.findProfile(request.field("ProfileToken"));
+            if (!profile || !parseStreamProtocol(request.field("Protocol"), transport)) {
+                rendered_response = generateFault("Sender", profile ? "Unsupported stream protocol" : "No such profile");
+                return &rendered_response;
+            }
+            char transport_digit[] = {char('0' + transport), '/', '\0'};
+            const LocalAddress& local = localAddress(conn);
+            return &cachedResponse(config, cacheKey("media2/GetStreamUri/", local.host, "/", transport_digit, profile->token),
+                                   DEPENDS_PROFILES, [&] { return handleMedia2GetStreamUri(config, local, *profile, transport); });
+        }
+        if (request.operation == "GetVideoEncoderConfigurationOptions") {
+            std::string_view token = request.field("ProfileToken");
+            if (!token.empty() && !config.findProfile(token)) {
+                rendered_response = generateFault("Sender", "No such profile");
+                return &rendered_response;
+            }
+            return &cachedResponse(config, cacheKey("media2/GetVideoEncoderConfigurationOptions"), 0, [&] {
+                return handleGetVideoEncoderConfigurationOptions();
+            });
+        }
+        if (request.operation == "GetVideoEncoderConfigurations") {
+            std::string_view token = request.field("ConfigurationToken");
+            std::string_view profile = request.field("ProfileToken");
+            if ((!token.empty() && !config.findEncoder(token)) || (!profile.empty() && !config.findProfile(profile))) {
+                rendered_response = generateFault("Sender", "No such configuration");
+                return &rendered_response;
+            }
+            return &cachedResponse(config, cacheKey("media2/GetVideoEncoderConfigurations/", token, "/", profile),
+                                   DEPENDS_PROFILES | DEPENDS_ENCODERS, [&] {
+                return handleMedia2GetVideoEncoderConfigurations(config, token, profile);
+            });
+        }
+        return nullptr;
+    }
+    
+    std::string processMedia2Request(const MediaConfig& config, std::string_view operation, std::string_view request) {
+        if (operation == "SetVideoEncoderConfiguration") {
+            return handleSetVideoEncoderConfiguration(config, request, true);
+        }
+        if (operation == "CreateProfile") {
+            // Only VideoEncoder configurations are selectable; the video
+            // source and PTZ configuration are shared by every profile
+            std::string encoder;
+            size_t from = 0;
+            while (from != std::string::npos) {
+                std::string configuration = getElementXml(request, "Configuration", &from);
+                if (getElementText(configuration, "Type") == "VideoEncoder") {
+                    encoder = getElementText(configuration, "Token");
+                }
+            }
+            std::string fault;
+            std::string token = createProfile(config, getElementText(request, "Name"), "", encoder, fault);
+            if (token.empty()) {
+                return fault;
+            }
+            return renderSoapEnvelope([&](auto& out) {
+                out << "<tr2:CreateProfileResponse>\n"
+                       "<tr2:Token>" << token << "</tr2:Token>\n"
+                       "</tr2:CreateProfileResponse>";
+            });
+        }
+        if (operation == "DeleteProfile") {
+            std::string fault = deleteProfile(config, getElementText(request, "Token"));
+            return fault.empty() ? generateSoapEnvelope("<tr2:DeleteProfileResponse/>") : fault;
+        }
+        if (operation == "AddConfiguration" || operation == "RemoveConfiguration") {
+            bool add = operation == "AddConfiguration";
+            std::string fault;
+            size_t from = 0;
+            while (from != std::string::npos && fault.empty()) {
+                std::string configuration = getElementXml(request, "Configuration", &from);
+                if (getElementText(configuration, "Type") == "VideoEncoder") {
+                    std::string encoder = getElementText(configuration, "Token");
+                    if (add && encoder.empty()) {
+                        // Without a token, the first configuration is attached
+                        encoder = config.encoders.empty() ? "" : config.encoders.front().token;
+                    }
+                    fault = setProfileEncoder(*mediaConfig(), getElementText(request, "ProfileToken"), add ? encoder : "");
+                }
+            }
+            if (!fault.empty()) {
+                return fault;
+            }
+            return generateSoapEnvelope(add ? "<tr2:AddConfigurationResponse/>" : "<tr2:RemoveConfigurationResponse/>");
+        }
+        return generateFault("Receiver", "Method not implemented");
+    }
+    
+    template <typename Out>
+    static void renderDateTime(Out& out, std::string_view element, int64_t time) {
+        CoarseClock::Civil c = CoarseClock::toCivil(time);
+        out << "<tt:" << element << ">\n"
+               "<tt:Date>\n"
+               "<tt:Year>" << c.year << "</tt:Year>\n"
+               "<tt:Month>" << c.month << "</tt:Month>\n"
+               "<tt:Day>" << c.day << "</tt:Day>\n"
+               "</tt:Date>\n"
+               "<tt:Time>\n"
+               "<tt:Hour>" << c.hour << "</tt:Hour>\n"
+               "<tt:Minute>" << c.minute << "</tt:Minute>\n"
+               "<tt:Second>" << c.second << "</tt:Second>\n"
+               "</tt:Time>\n"
+               "</tt:" << element << ">\n";
+    }
+    
+    // UTC offset in seconds of a POSIX TZ string such as "UTC", "CET-1CEST"
+    // or "<+0530>-5:30". DST rules are not interpreted; `dst` reports
+    // whether the zone names a daylight saving variant.
+    static bool parseTimeZone(const std::string& tz, int64_t& offset, bool& dst) {
+        size_t i = 0;
+        if (i < tz.size() && tz[i] == '<') {
+            i = tz.find('>');
+            if (i == std::string::npos) {
+                return false;
+            }
+            i++;
+        } else {
+            while (i < tz.size() && isalpha(static_cast<unsigned char>(tz[i]))) {
+                i++;
+            }
+            if (i < 3) {
+                return false;
+            }
+        }
+        if (i == tz.size()) {
+            offset = 0;
+            dst = false;
+            return true;
+        }
+        int sign = 1;
+        if (tz[i] == '+' || tz[i] == '-') {
+            sign = tz[i] == '-' ? -1 : 1;
+            i++;
+        }
+        int64_t parts[3] = {0, 0, 0};
+        int part = 0;
+        bool digits = false;
+        for (; i < tz.size() && part < 3; i++) {
+            if (tz[i] >= '0' && tz[i] <= '9') {
+                parts[part] = parts[part] * 10 + (tz[i] - '0');
+                digits = true;
+            } else if (tz[i] == ':') {
+                part++;
+            } else {
+                break;
+            }
+        }
+        if (!digits || parts[0] > 24 || parts[1] > 59 || parts[2] > 59) {
+            return false;
+        }
+        // POSIX offsets are west of Greenwich, so "CET-1" is UTC+1
+        offset = -sign * (parts[0] * 3600 + parts[1] * 60 + parts[2]);
+        dst = i < tz.size() && (isalpha(static_cast<unsigned char>(tz[i])) || tz[i] == '<');
+        return true;
+    }
+    
+    std::string handleGetSystemDateAndTime() {
+        int64_t utc = clock.now();
+        bool dst = false;
+        int64_t ignored;
+        parseTimeZone(time_zone, ignored, dst);
+        int64_t local = utc + zone_offset + (daylight_savings && dst ? 3600 : 0);
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tds:GetSystemDateAndTimeResponse>\n"
+                   "<tds:SystemDateAndTime>\n"
+                   "<tt:DateTimeType>" << (ntp_time ? "NTP" : "Manual") << "</tt:DateTimeType>\n"
+                   "<tt:DaylightSavings>" << (daylight_savings ? "true" : "false") << "</tt:DaylightSavings>\n"
+                   "<tt:TimeZone>\n"
+                   "<tt:TZ>" << time_zone << "</tt:TZ>\n"
+                   "</tt:TimeZone>\n";
+            renderDateTime(out, "UTCDateTime", utc);
+            renderDateTime(out, "LocalDateTime", local);
+            out << "</tds:SystemDateAndTime>\n"
+                   "</tds:GetSystemDateAndTimeResponse>";
+        });
+    }
+    
+    // Sets the device clock offset from the host, for simulating cameras
+    // whose clocks are off. Switching to NTP puts the clock back in sync.
+    std::string handleSetSystemDateAndTime(std::string_view request) {
+        std::string type = getElementText(request, "DateTimeType");
+        if (type != "Manual" && type != "NTP") {
+            return generateFault("Sender", "Invalid DateTimeType");
+        }
+        std::string tz = getElementText(request, "TZ");
+        int64_t offset = zone_offset;
+        bool dst;
+        if (!tz.empty() && !parseTimeZone(tz, offset, dst)) {
+            return generateFault("Sender", "Invalid time zone");
+        }
+        
+        int64_t device_time = 0;
+        std::string utc = getElementXml(request, "UTCDateTime");
+        if (type == "Manual" && !utc.empty()) {
+            CoarseClock::Civil c;
+            c.year = std::atoi(getElementText(utc, "Year").c_str());
+            c.month = std::strtoul(getElementText(utc, "Month").c_str(), nullptr, 10);
+            c.day = std::strtoul(getElementText(utc, "Day").c_str(), nullptr, 10);
+            c.hour = std::strtoul(getElementText(utc, "Hour").c_str(), nullptr, 10);
+            c.minute = std::strtoul(getElementText(utc, "Minute").c_str(), nullptr, 10);
+            c.second = std::strtoul(getElementText(utc, "Second").c_str(), nullptr, 10);
+            if (c.year < 1970 || c.month < 1 || c.month > 12 || c.day < 1 || c.day > 31 ||
+                c.hour > 23 || c.minute > 59 || c.second > 59) {
+                return generateFault("Sender", "Invalid date and time");
+            }
+            device_time = CoarseClock::fromCivil(c);
+        }
+        
+        ntp_time = type == "NTP";
+        daylight_savings = getElementText(request, "DaylightSavings") == "true";
+        if (!tz.empty()) {
+            time_zone = tz;
+            zone_offset = offset;
+        }
+        if (ntp_time) {
+            clock.setOffset(0);
+        } else if (!utc.empty()) {
+            clock.set(device_time);
+        }
+        return generateSoapEnvelope("<tds:SetSystemDateAndTimeResponse/>");
+    }
+    
+    std::string handlePTZGetConfigurations() {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tptz:GetConfigurationsResponse>\n"
+                   "<tptz:PTZConfiguration token=\"PTZConfig_1\">\n"
+                   "<tptz:Name>PTZ Configuration</tptz:Name>\n"
+                   "<tptz:UseCount>1</tptz:UseCount>\n"
+                   "<tptz:NodeToken>PTZNode_1</tptz:NodeToken>\n"
+                   "<tptz:DefaultAbsolutePantTiltPositionSpace>http://www.onvif.org/ver10/tptz/PanTiltSpaces/PositionGenericSpace</tptz:DefaultAbsolutePantTiltPositionSpace>\n"
+                   "<tptz:DefaultAbsoluteZoomPositionSpace>http://www.onvif.org/ver10/tptz/ZoomSpaces/PositionGenericSpace</tptz:DefaultAbsoluteZoomPositionSpace>\n"
+                   "<tptz:DefaultRelativePanTiltTranslationSpace>http://www.onvif.org/ver10/tptz/PanTiltSpaces/TranslationGenericSpace</tptz:DefaultRelativePanTiltTranslationSpace>\n"
+                   "<tptz:DefaultRelativeZoomTranslationSpace>http://www.onvif.org/ver10/tptz/ZoomSpaces/TranslationGenericSpace</tptz:DefaultRelativeZoomTranslationSpace>\n"
+                   "<tptz:DefaultContinuousPanTiltVelocitySpace>http://www.onvif.org/ver10/tptz/PanTiltSpaces/VelocityGenericSpace</tptz:DefaultContinuousPanTiltVelocitySpace>\n"
+                   "<tptz:DefaultContinuousZoomVelocitySpace>http://www.onvif.org/ver10/tptz/ZoomSpaces/VelocityGenericSpace</tptz:DefaultContinuousZoomVelocitySpace>\n"
+                   "<tptz:DefaultPTZSpeed>\n"
+                   "<tptz:PanTilt x=\"1.0\" y=\"1.0\" space=\"http://www.onvif.org/ver10/tptz/PanTiltSpaces/GenericSpeedSpace\"/>\n"
+                   "<tptz:Zoom x=\"1.0\" space=\"http://www.onvif.org/ver10/tptz/ZoomSpaces/ZoomGenericSpeedSpace\"/>\n"
+                   "</tptz:DefaultPTZSpeed>\n"
+                   "<tptz:DefaultPTZTimeout>PT5S</tptz:DefaultPTZTimeout>\n"
+                   "<tptz:PanTiltLimits>\n"
+                   "<tptz:Range>\n"
+                   "<tptz:URI>http://www.onvif.org/ver10/tptz/PanTiltSpaces/PositionGenericSpace</tptz:URI>\n"
+                   "<tptz:XRange>\n"
+                   "<tptz:Min>-1.0</tptz:Min>\n"
+                   "<tptz:Max>1.0</tptz:Max>\n"
+                   "</tptz:XRange>\n"
+                   "<tptz:YRange>\n"
+                   "<tptz:Min>-1.0</tptz:Min>\n"
+                   "<tptz:Max>1.0</tptz:Max>\n"
+                   "</tptz:YRange>\n"
+                   "</tptz:Range>\n"
+                   "</tptz:PanTiltLimits>\n"
+                   "<tptz:ZoomLimits>\n"
+                   "<tptz:Range>\n"
+                   "<tptz:URI>http://www.onvif.org/ver10/tptz/ZoomSpaces/PositionGenericSpace</tptz:URI>\n"
+                   "<tptz:XRange>\n"
+                   "<tptz:Min>0.0</tptz:Min>\n"
+                   "<tptz:Max>1.0</tptz:Max>\n"
+                   "</tptz:XRange>\n"
+                   "</tptz:Range>\n"
+                   "</tptz:ZoomLimits>\n"
+                   "</tptz:PTZConfiguration>\n"
+                   "</tptz:GetConfigurationsResponse>";
+        });
+    }
+    
+    // PTZ service
+    
+    // Head of a profile with any running tour played out up to `now`
+    PTZHead* findPTZHead(const std::string& token, double now) {
+        auto it = ptz_heads.find(token);
+        if (it != ptz_heads.end()) {
+            it->second.advanceTour(now);
+            return &it->second;
+        }
+        return mediaConfig()->findProfile(token) ? &ptz_heads[token] : nullptr;
+    }
+    
+    // Reads the x (and y) attributes of a PanTilt or Zoom vector element
+    static bool getVector(const std::string& xml, const std::string& name, double& x, double* y) {
+        std::string element = getElementXml(xml, name);
+        std::string x_text = getAttribute(element, "x");
+        if (x_text.empty()) {
+            return false;
+        }
+        x = std::atof(x_text.c_str());
+        if (y) {
+            *y = std::atof(getAttribute(element, "y").c_str());
+        }
+        return true;
+    }
+    
+    // Coordinate text kept on the stack, written to the sinks as a string_view
+    struct Coordinate {
+        char text[32];
+        int length;
+        
+        operator std::string_view() const {
+            return std::string_view(text, length);
+        }
+    };
+    
+    static Coordinate formatCoordinate(double value) {
+        Coordinate coordinate;
+        coordinate.length = snprintf(coordinate.text, sizeof(coordinate.text), "%.6f", std::abs(value) < 5e-7 ? 0.0 : value);
+        return coordinate;
+    }
+    
+    std::string handleContinuousMove(std::string_view request) {
+        double now = PTZHead::now();
+        PTZHead* head = findPTZHead(getElementText(request, "ProfileToken"), now);
+        if (!head) {
+            return generateFault("Sender", "No such profile");
+        }
+        head->tour.id = 0;
+        std::string velocity = getElementXml(request, "Velocity");
+        double timeout = parseSeconds(getElementText(request, "Timeout"), PTZHead::DEFAULT_TIMEOUT);
+        timeout = timeout > 0 ? timeout : PTZHead::DEFAULT_TIMEOUT;
+        double x, y;
+        if (getVector(velocity, "PanTilt", x, &y)) {
+            head->pan.velocityMove(now, x, timeout);
+            head->tilt.velocityMove(now, y, timeout);
+        }
+        if (getVector(velocity, "Zoom", x, nullptr)) {
+            head->zoom.velocityMove(now, x, timeout);
+        }
+        return generateSoapEnvelope("<tptz:ContinuousMoveResponse/>");
+    }
+    
+    std::string handleAbsoluteMove(std::string_view request, bool relative) {
+        double now = PTZHead::now();
+        PTZHead* head = findPTZHead(getElementText(request, "ProfileToken"), now);
+        if (!head) {
+            return generateFault("Sender", "No such profile");
+        }
+        head->tour.id = 0;
+        std::string target = getElementXml(request, relative ? "Translation" : "Position");
+        std::string speed = getElementXml(request, "Speed");
+        double x, y;
+        double speed_x = 1.0, speed_y = 1.0, speed_zoom = 1.0;
+        getVector(speed, "PanTilt", speed_x, &speed_y);
+        getVector(speed, "Zoom", speed_zoom, nullptr);
+        
+        if (getVector(target, "PanTilt", x, &y)) {
+            if (relative) {
+                x += head->pan.at(now).position;
+                y += head->tilt.at(now).position;
+            }
+            head->pan.positionMove(now, x, speed_x);
+            head->tilt.positionMove(now, y, speed_y);
+        }
+        if (getVector(target, "Zoom", x, nullptr)) {
+            if (relative) {
+                x += head->zoom.at(now).position;
+            }
+            head->zoom.positionMove(now, x, speed_zoom);
+        }
+        return generateSoapEnvelope(relative ? "<tptz:RelativeMoveResponse/>" : "<tptz:AbsoluteMoveResponse/>");
+    }
+    
+    std::string handleStop(std::string_view request) {
+        double now = PTZHead::now();
+        PTZHead* head = findPTZHead(getElementText(request, "ProfileToken"), now);
+        if (!head) {
+            return generateFault("Sender", "No such profile");
+        }
+        head->tour.id = 0;
+        if (getElementText(request, "PanTilt") != "false") {
+            head->pan.stop(now);
+            head->tilt.stop(now);
+        }
+        if (getElementText(request, "Zoom") != "false") {
+            head->zoom.stop(now);
+        }
+        return generateSoapEnvelope("<tptz:StopResponse/>");
+    }
+    
+    std::string handleGetStatus(std::string_view request) {
+        double now = PTZHead::now();
+        PTZHead* head = findPTZHead(getElementText(request, "ProfileToken"), now);
+        if (!head) {
+            return generateFault("Sender", "No such profile");
+        }
+        PTZAxis::State pan = head->pan.at(now);
+        PTZAxis::State tilt = head->tilt.at(now);
+        PTZAxis::State zoom = head->zoom.at(now);
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tptz:GetStatusResponse>\n"
+                   "<tptz:PTZStatus>\n"
+                   "<tt:Position>\n"
+                   "<tt:PanTilt x=\"" << formatCoordinate(pan.position) << "\" y=\"" << formatCoordinate(tilt.position) <<
+                   "\" space=\"http://www.onvif.org/ver10/tptz/PanTiltSpaces/PositionGenericSpace\"/>\n"
+                   "<tt:Zoom x=\"" << formatCoordinate(zoom.position) <<
+                   "\" space=\"http://www.onvif.org/ver10/tptz/ZoomSpaces/PositionGenericSpace\"/>\n"
+                   "</tt:Position>\n"
+                   "<tt:MoveStatus>\n"
+                   "<tt:PanTilt>" << (pan.moving || tilt.moving ? "MOVING" : "IDLE") << "</tt:PanTilt>\n"
+                   "<tt:Zoom>" << (zoom.moving ? "MOVING" : "IDLE") << "</tt:Zoom>\n"
+                   "</tt:MoveStatus>\n"
+                   "<tt:UtcTime>" << std::string_view(clock.text(), CoarseClock::TEXT_LENGTH) << "</tt:UtcTime>\n"
+                   "</tptz:PTZStatus>\n"
+                   "</tptz:GetStatusResponse>";
+        });
+    }
+    
+    // Presets and preset tours. Tokens are "Preset_<id>" and "Tour_<id>"
+    // with ids unique across the store, so a token maps straight to its
+    // record key.
+    
+    static const int MAX_PRESETS = 64;
+    static const int MAX_PRESET_TOURS = 16;
+    
+    static bool parseToken(const std::string& token, const char* prefix, uint32_t& id) {
+        size_t length = strlen(prefix);
+        if (token.compare(0, length, prefix) != 0 || token.size() == length || token.size() > length + 10) {
+            return false;
+        }
+        char* end;
+        unsigned long value = std::strtoul(token.c_str() + length, &end, 10);
+        id = static_cast<uint32_t>(value);
+        return *end == '\0' && value > 0 && value <= UINT32_MAX;
+    }
+    
+    // Copies request text into a fixed record field without splitting an
+    // entity reference
+    static void copyName(char* field, size_t size, const std::string& text) {
+        size_t length = std::min(text.size(), size - 1);
+        size_t amp = text.rfind('&', length);
+        if (length < text.size() && amp != std::string::npos && text.find(';', amp) >= length) {
+            length = amp;
+        }
+        memcpy(field, text.data(), length);
+        field[length] = '\0';
+    }
+    
+    // Record names are NUL-terminated arrays and go out as string_views;
+    // the sinks would take a char array for a literal of its full size
+    template <typename Out>
+    static void renderPreset(Out& out, const PresetStore::Record& r) {
+        out << "<tptz:Preset token=\"Preset_" << r.id << "\">\n"
+               "<tt:Name>" << std::string_view(r.name) << "</tt:Name>\n"
+               "<tt:PTZPosition>\n"
+               "<tt:PanTilt x=\"" << formatCoordinate(r.position.pan) << "\" y=\"" << formatCoordinate(r.position.tilt) <<
+               "\" space=\"http://www.onvif.org/ver10/tptz/PanTiltSpaces/PositionGenericSpace\"/>\n"
+               "<tt:Zoom x=\"" << formatCoordinate(r.position.zoom) <<
+               "\" space=\"http://www.onvif.org/ver10/tptz/ZoomSpaces/PositionGenericSpace\"/>\n"
+               "</tt:PTZPosition>\n"
+               "</tptz:Preset>\n";
+    }
+    
+    template <typename Out>
+    static void renderPresetTour(Out& out, const PresetStore::Record& r, const PTZHead* head, std::string_view element) {
+        const char* state = "Idle";
+        if (head && head->tour.id == r.id) {
+            state = head->tour.paused ? "Paused" : "Touring";
+        }
+        out << "<" << element << " token=\"Tour_" << r.id << "\">\n"
+               "<tt:Name>" << std::string_view(r.name) << "</tt:Name>\n"
+               "<tt:Status><tt:State>" << state << "</tt:State></tt:Status>\n"
+               "<tt:AutoStart>false</tt:AutoStart>\n"
+               "<tt:StartingCondition>\n"
+               "<tt:RecurringTime>" << r.recurring << "</tt:RecurringTime>\n"
+               "<tt:Direction>" << ((r.flags & PresetStore::TOUR_BACKWARD) ? "Backward" : "Forward") << "</tt:Direction>\n"
+               "</tt:StartingCondition>\n";
+        for (uint32_t i = 0; i < r.spots; i++) {
+            const PresetStore::TourSpot& spot = r.spot[i];
+            char stay[32];
+            int stay_length = snprintf(stay, sizeof(stay), "PT%gS", spot.stay);
+            Coordinate speed = formatCoordinate(spot.speed);
+            out << "<tt:TourSpot>\n"
+                   "<tt:PresetDetail><tt:PresetToken>Preset_" << spot.preset << "</tt:PresetToken></tt:PresetDetail>\n"
+                   "<tt:Speed><tt:PanTilt x=\"" << speed << "\" y=\"" << speed <<
+                   "\"/><tt:Zoom x=\"" << speed << "\"/></tt:Speed>\n"
+                   "<tt:StayTime>" << std::string_view(stay, stay_length) << "</tt:StayTime>\n"
+                   "</tt:TourSpot>\n";
+        }
+        out << "</" << element << ">\n";
+    }
+    
+    int countRecords(const std::string& profile, uint32_t kind) {
+        int count = 0;
+        presets->forEach(preset_device, profile, [&](const PresetStore::Record& r) {
+            count += r.kind == kind;
+        });
+        return count;
+    }
+    
+    std::string handleSetPreset(std::string_view request) {
+        std::lock_guard<std::mutex> lock(presets->mutex());
+        double now = PTZHead::now();
+        std::string profile = getElementText(request, "ProfileToken");
+        PTZHead* head = findPTZHead(profile, now);
+        if (!head) {
+            return generateFault("Sender", "No such profile");
+        }
+        std::string token = getElementText(request, "PresetToken");
+        std::string name = getElementText(request, "PresetName");
+        uint32_t id = 0;
+        PresetStore::Record* r = nullptr;
+        if (!token.empty()) {
+            if (!parseToken(token, "Preset_", id) || !(r = presets->find(preset_device, profile, PresetStore::PRESET, id))) {
+                return generateFault("Sender", "No such preset");
+            }
+        } else {
+            if (countRecords(profile, PresetStore::PRESET) >= MAX_PRESETS) {
+                return generateFault("Receiver", "Too many presets");
+            }
+            id = presets->nextId();
+            r = presets->insert(preset_device, profile, PresetStore::PRESET, id);
+            if (!r) {
+                return generateFault("Receiver", "Preset store full");
+            }
+            if (name.empty()) {
+                name = "Preset " + std::to_string(id);
+            }
+        }
+        if (!name.empty()) {
+            copyName(r->name, sizeof(r->name), name);
+        }
+        r->position.pan = head->pan.at(now).position;
+        r->position.tilt = head->tilt.at(now).position;
+        r->position.zoom = head->zoom.at(now).position;
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tptz:SetPresetResponse>\n"
+                   "<tptz:PresetToken>Preset_" << id << "</tptz:PresetToken>\n"
+                   "</tptz:SetPresetResponse>";
+        });
+    }
+    
+    std::string handleGetPresets(std::string_view request) {
+        std::lock_guard<std::mutex> lock(presets->mutex());
+        std::string profile = getElementText(request, "ProfileToken");
+        if (!findPTZHead(profile, PTZHead::now())) {
+            return generateFault("Sender", "No such profile");
+        }
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tptz:GetPresetsResponse>\n";
+            presets->forEach(preset_device, profile, [&](const PresetStore::Record& r) {
+                if (r.kind == PresetStore::PRESET) {
+                    renderPreset(out, r);
+                }
+            });
+            out << "</tptz:GetPresetsResponse>";
+        });
+    }
+    
+    std::string handleGotoPreset(std::string_view request) {
+        std::lock_guard<std::mutex> lock(presets->mutex());
+        double now = PTZHead::now();
+        std::string profile = getElementText(request, "ProfileToken");
+        PTZHead* head = findPTZHead(profile, now);
+        if (!head) {
+            return generateFault("Sender", "No such profile");
+        }
+        uint32_t id;
+        const PresetStore::Record* r = nullptr;
+        if (!parseToken(getElementText(request, "PresetToken"), "Preset_", id) ||
+            !(r = presets->find(preset_device, profile, PresetStore::PRESET, id))) {
+            return generateFault("Sender", "No such preset");
+        }
+        std::string speed = getElementXml(request, "Speed");
+        double speed_x = 1.0, speed_y = 1.0, speed_zoom = 1.0;
+        getVector(speed, "PanTilt", speed_x, &speed_y);
+        getVector(speed, "Zoom", speed_zoom, nullptr);
+        head->tour.id = 0;
+        head->pan.positionMove(now, r->position.pan, speed_x);
+        head->tilt.positionMove(now, r->position.tilt, speed_y);
+        head->zoom.positionMove(now, r->position.zoom, speed_zoom);
+        return generateSoapEnvelope("<tptz:GotoPresetResponse/>");
+    }
+    
+    std::string handleRemovePreset(std::string_view request) {
+        std::lock_guard<std::mutex> lock(presets->mutex());
+        std::string profile = getElementText(request, "ProfileToken");
+        if (!findPTZHead(profile, PTZHead::now())) {
+            return generateFault("Sender", "No such profile");
+        }
+        uint32_t id;
+        PresetStore::Record* r = nullptr;
+        if (!parseToken(getElementText(request, "PresetToken"), "Preset_", id) ||
+            !(r = presets->find(preset_device, profile, PresetStore::PRESET, id))) {
+            return generateFault("Sender", "No such preset");
+        }
+        presets->remove(r);
+        return generateSoapEnvelope("<tptz:RemovePresetResponse/>");
+    }
+    
+    std::string handleCreatePresetTour(std::string_view request) {
+        std::lock_guard<std::mutex> lock(presets->mutex());
+        std::string profile = getElementText(request, "ProfileToken");
+        if (!findPTZHead(profile, PTZHead::now())) {
+            return generateFault("Sender", "No such profile");
+        }
+        if (countRecords(profile, PresetStore::TOUR) >= MAX_PRESET_TOURS) {
+            return generateFault("Receiver", "Too many preset tours");
+        }
+        uint32_t id = presets->nextId();
+        PresetStore::Record* r = presets->insert(preset_device, profile, PresetStore::TOUR, id);
+        if (!r) {
+            return generateFault("Receiver", "Preset store full");
+        }
+        copyName(r->name, sizeof(r->name), "Tour " + std::to_string(id));
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tptz:CreatePresetTourResponse>\n"
+                   "<tptz:PresetTourToken>Tour_" << id << "</tptz:PresetTourToken>\n"
+                   "</tptz:CreatePresetTourResponse>";
+        });
+    }
+    
+    PresetStore::Record* findTour(const std::string& profile, const std::string& token) {
+        uint32_t id;
+        return parseToken(token, "Tour_", id) ? presets->find(preset_device, profile, PresetStore::TOUR, id) : nullptr;
+    }
+    
+    std::string handleModifyPresetTour(std::string_view request) {
+        std::lock_guard<std::mutex> lock(presets->mutex());
+        std::string profile = getElementText(request, "ProfileToken");
+        PresetStore::Record* r = findTour(profile, getAttribute(getStartTag(request, "PresetTour"), "token"));
+        if (!r) {
+            return generateFault("Sender", "No such preset tour");
+        }
+        
+        PresetStore::TourSpot spots[PresetStore::MAX_TOUR_SPOTS];
+        uint32_t count = 0;
+        size_t from = 0;
+        while (from != std::string::npos) {
+            std::string spot = getElementXml(request, "TourSpot", &from);
+            if (spot.empty()) {
+                break;
+            }
+            if (count == PresetStore::MAX_TOUR_SPOTS) {
+                return generateFault("Sender", "Too many tour spots");
+            }
+            uint32_t preset;
+            if (!parseToken(getElementText(spot, "PresetToken"), "Preset_", preset) ||
+                !presets->find(preset_device, profile, PresetStore::PRESET, preset)) {
+                return generateFault("Sender", "No such preset");
+            }
+            double speed = 1.0, ignored;
+            getVector(getElementXml(spot, "Speed"), "PanTilt", speed, &ignored);
+            spots[count++] = PresetStore::TourSpot{preset, static_cast<float>(speed),
+                                                   static_cast<float>(parseSeconds(getElementText(spot, "StayTime"), 0))};
+        }
+        
+        std::string name = getElementText(request, "Name");
+        if (!name.empty()) {
+            copyName(r->name, sizeof(r->name), name);
+        }
+        r->recurring = static_cast<uint32_t>(std::max(0L, std::atol(getElementText(request, "RecurringTime").c_str())));
+        r->flags = getElementText(request, "Direction") == "Backward" ? uint32_t(PresetStore::TOUR_BACKWARD) : 0;
+        r->spots = count;
+        std::copy(spots, spots + count, r->spot);
+        return generateSoapEnvelope("<tptz:ModifyPresetTourResponse/>");
+    }
+    
+    std::string handleGetPresetTours(std::string_view request) {
+        std::lock_guard<std::mutex> lock(presets->mutex());
+        std::string profile = getElementText(request, "ProfileToken");
+        PTZHead* head = findPTZHead(profile, PTZHead::now());
+        if (!head) {
+            return generateFault("Sender", "No such profile");
+        }
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tptz:GetPresetToursResponse>\n";
+            presets->forEach(preset_device, profile, [&](const PresetStore::Record& r) {
+                if (r.kind == PresetStore::TOUR) {
+                    renderPresetTour(out, r, head, "tptz:PresetTour");
+                }
+            });
+            out << "</tptz:GetPresetToursResponse>";
+        });
+    }
+    
+    std::string handleGetPresetTour(std::string_view request) {
+        std::lock_guard<std::mutex> lock(presets->mutex());
+        std::string profile = getElementText(request, "ProfileToken");
+        PTZHead* head = findPTZHead(profile, PTZHead::now());
+        const PresetStore::Record* r = findTour(profile, getElementText(request, "PresetTourToken"));
+        if (!head || !r) {
+            return generateFault("Sender", "No such preset tour");
+        }
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tptz:GetPresetTourResponse>\n";
+            renderPresetTour(out, *r, head, "tptz:PresetTour");
+            out << "</tptz:GetPresetTourResponse>";
+        });
+    }
+    
+    std::string handleOperatePresetTour(std::string_view request) {
+        std::lock_guard<std::mutex> lock(presets->mutex());
+        double now = PTZHead::now();
+        std::string profile = getElementText(request, "ProfileToken");
+        PTZHead* head = findPTZHead(profile, now);
+        const PresetStore::Record* r = findTour(profile, getElementText(request, "PresetTourToken"));
+        if (!head || !r) {
+            return generateFault("Sender", "No such preset tour");
+        }
+        std::string operation = getElementText(request, "Operation");
+        bool current = head->tour.id == r->id;
+        if (operation == "Start") {
+            if (current && head->tour.paused) {
+                head->resumeTour(now);
+            } else if (!current) {
+                // Resolve spots now; presets removed since the tour was
+                // modified are skipped
+                std::vector<PTZHead::Tour::Spot> spots;
+                for (uint32_t i = 0; i < r->spots; i++) {
+                    const PresetStore::TourSpot& spot = r->spot[i];
+                    const PresetStore::Record* preset = presets->find(preset_device, profile, PresetStore::PRESET, spot.preset);
+                    if (preset) {
+                        spots.push_back(PTZHead::Tour::Spot{preset->position.pan, preset->position.tilt,
+                                                            preset->position.zoom, spot.speed, spot.stay});
+                    }
+                }
+                if (spots.empty()) {
+                    return generateFault("Receiver", "Preset tour has no presets");
+                }
+                if (r->flags & PresetStore::TOUR_BACKWARD) {
+                    std::reverse(spots.begin(), spots.end());
+                }
+                head->startTour(now, r->id, std::move(spots), r->recurring);
+            }
+        } else if (operation == "Stop") {
+            if (current) {
+                head->tour.id = 0;
+                head->pan.stop(now);
+                head->tilt.stop(now);
+                head->zoom.stop(now);
+            }
+        } else if (operation == "Pause") {
+            if (current) {
+                head->pauseTour(now);
+            }
+        } else {
+            return generateFault("Sender", "Unsupported preset tour operation");
+        }
+        return generateSoapEnvelope("<tptz:OperatePresetTourResponse/>");
+    }
+    
+    std::string handleRemovePresetTour(std::string_view request) {
+        std::lock_guard<std::mutex> lock(presets->mutex());
+        std::string profile = getElementText(request, "ProfileToken");
+        if (!findPTZHead(profile, PTZHead::now())) {
+            return generateFault("Sender", "No such profile");
+        }
+        PresetStore::Record* r = findTour(profile, getElementText(request, "PresetTourToken"));
+        if (!r) {
+            return generateFault("Sender", "No such preset tour");
+        }
+        auto it = ptz_heads.find(profile);
+        if (it != ptz_heads.end() && it->second.tour.id == r->id) {
+            it->second.tour.id = 0;
+        }
+        presets->remove(r);
+        return generateSoapEnvelope("<tptz:RemovePresetTourResponse/>");
+    }
+    
+    std::string generateFault(std::string_view code, std::string_view reason) {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<SOAP-ENV:Fault>\n"
+                   "<SOAP-ENV:Code>\n"
+                   "<SOAP-ENV:Value>SOAP-ENV:" << code << "</SOAP-ENV:Value>\n"
+                   "</SOAP-ENV:Code>\n"
+                   "<SOAP-ENV:Reason>\n"
+                   "<SOAP-ENV:Text>" << reason << "</SOAP-ENV:Text>\n"
+                   "</SOAP-ENV:Reason>\n"
+                   "</SOAP-ENV:Fault>";
+        });
+    }
+    
+    // Event service
+    
+    template <typename Out>
+    static void renderSubscriptionReference(Out& out, const LocalAddress& local, uint32_t id) {
+        out << "<wsa:Address>" << local.base << "/onvif/events/subscription_" << id << "</wsa:Address>\n";
+    }
+    
+    // The filter (a TopicExpression with any "//." already cut off) must
+    // match whole path segments: it selects the topic it names and every
+    // topic below it, so tns1:VideoSource/Motion does not select
+    // tns1:VideoSource/MotionAlarm. Without a filter every topic matches.
+    static bool topicMatches(const std::string& filter, const char* topic, size_t length) {
+        if (filter.empty()) {
+            return true;
+        }
+        size_t n = filter.size();
+        return length >= n && memcmp(topic, filter.data(), n) == 0 &&
+               (length == n || topic[n] == '/' || filter[n - 1] == '/');
+    }
+    
+    std::string handleCreatePullPointSubscription(const LocalAddress& local, std::string_view request) {
+        if (subscriptions.size() >= MAX_SUBSCRIPTIONS) {
+            return generateFault("Receiver", "Maximum number of subscriptions reached");
+        }
+        
+        std::unique_ptr<Subscription> sub(new Subscription());
+        sub->id = next_subscription_id++;
+        sub->filter = getElementText(request, "TopicExpression");
+        size_t wildcard = sub->filter.find("//.");
+        if (wildcard != std::string::npos) {
+            sub->filter.erase(wildcard);
+        }
+        
+        long seconds = parseTermination(getElementText(request, "InitialTerminationTime"), 60);
+        time_t now = clock.now();
+        sub->termination = now + seconds;
+        sub->cursor = events->end();
+        sub->expiry.kind = TIMER_SUBSCRIPTION_EXPIRY;
+        sub->expiry.owner = sub.get();
+        timers.arm(&sub->expiry, steadyMs(), seconds * 1000);
+        
+        const Subscription& created = *sub;
+        subscriptions[sub->id] = std::move(sub);
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tev:CreatePullPointSubscriptionResponse>\n"
+                   "<tev:SubscriptionReference>\n";
+            renderSubscriptionReference(out, local, created.id);
+            out << "</tev:SubscriptionReference>\n"
+                   "<wsnt:CurrentTime>";
+            renderTime(out, now);
+            out << "</wsnt:CurrentTime>\n"
+                   "<wsnt:TerminationTime>";
+            renderTime(out, created.termination);
+            out << "</wsnt:TerminationTime>\n"
+                   "</tev:CreatePullPointSubscriptionResponse>";
+        });
+    }
+    
+    // Moves the cursor past messages the filter rejects and reports whether
+    // a matching message is ready
+    bool hasMessages(Subscription* sub) {
+        uint64_t end = events->end();
+        if (end - sub->cursor > events->capacity()) {
+            sub->cursor = end - events->capacity();
+        }
+        while (sub->cursor < end) {
+            bool matched = false;
+            EventLog::ReadResult result = events->read(sub->cursor, [&](const char* topic, size_t topic_length, const char*, size_t) {
+                matched = topicMatches(sub->filter, topic, topic_length);
+            });
+            if (result == EventLog::READ_PENDING) {
+                return false;
+            }
+            if (result == EventLog::READ_OK && matched) {
+                return true;
+            }
+            sub->cursor++;
+        }
+        return false;
+    }
+    
+    std::string handleGetEventProperties() {
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tev:GetEventPropertiesResponse>\n"
+                   "<tev:TopicNamespaceLocation>http://www.onvif.org/onvif/ver10/topics/topicns.xml</tev:TopicNamespaceLocation>\n"
+                   "<wsnt:FixedTopicSet>true</wsnt:FixedTopicSet>\n"
+                   "<wstop:TopicSet xmlns:wstop=\"http://docs.oasis-open.org/wsn/t-1\">\n"
+                   "<tns1:VideoSource>\n"
+                   "<MotionAlarm wstop:topic=\"true\"/>\n"
+                   "<GlobalSceneChange><ImagingService wstop:topic=\"true\"/></GlobalSceneChange>\n"
+                   "</tns1:VideoSource>\n"
+                   "<tns1:Device>\n"
+                   "<Trigger><DigitalInput wstop:topic=\"true\"/></Trigger>\n"
+                   "</tns1:Device>\n"
+                   "</wstop:TopicSet>\n"
+                   "<wsnt:TopicExpressionDialect>http://www.onvif.org/ver10/tev/topicExpression/ConcreteSet</wsnt:TopicExpressionDialect>\n"
+                   "<tev:MessageContentFilterDialect>http://www.onvif.org/ver10/tev/messageContentFilter/ItemFilter</tev:MessageContentFilterDialect>\n"
+                   "<tev:MessageContentSchemaLocation>http://www.onvif.org/onvif/ver10/schema/onvif.xsd</tev:MessageContentSchemaLocation>\n"
+                   "</tev:GetEventPropertiesResponse>";
+        });
+    }
+    
+    // Appends up to `limit` matching messages and returns how many were added
+    size_t readMessages(Subscription* sub, size_t limit, std::string& messages) {
+        size_t added = 0;
+        while (added < limit && hasMessages(sub)) {
+            size_t mark = messages.size();
+            EventLog::ReadResult result = events->read(sub->cursor, [&](const char*, size_t, const char* message, size_t length) {
+                messages.append(message, length);
+            });
+            if (result == EventLog::READ_OK) {
+                added++;
+            } else {
+                messages.resize(mark);
+            }
+            sub->cursor++;
+        }
+        return added;
+    }
+    
+    std::string renderPullMessages(Subscription* sub, size_t limit) {
+        std::string messages;
+        readMessages(sub, limit, messages);
+        
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<tev:PullMessagesResponse>\n"
+                   "<tev:CurrentTime>" << std::string_view(clock.text(), CoarseClock::TEXT_LENGTH) << "</tev:CurrentTime>\n"
+                   "<tev:TerminationTime>";
+            renderTime(out, sub->termination);
+            out << "</tev:TerminationTime>\n" << messages <<
+                   "</tev:PullMessagesResponse>";
+        });
+    }
+    
+    // Answers without waiting when messages are queued; otherwise the
+    // connection is parked on the subscription until an event arrives or
+    // the timeout fires, and an empty string is returned.
+    std::string handlePullMessages(Connection* conn, Subscription* sub, std::string_view request) {
+        long limit = std::atol(getElementText(request, "MessageLimit").c_str());
+        if (limit <= 0) {
+            limit = 100;
+        }
+        long timeout = std::min(parseDuration(getElementText(request, "Timeout"), 10), 600L);
+        
+        if (timeout <= 0 || hasMessages(sub)) {
+            return renderPullMessages(sub, limit);
+        }
+        
+        // A newer pull replaces one that is still waiting
+        if (sub->waiter) {
+            completePull(sub);
+        }
+        sub->waiter = conn;
+        sub->waiter_limit = limit;
+        parked.insert(sub->id);
+        conn->parked_subscription = sub->id;
+        conn->timer.kind = TIMER_PULL_TIMEOUT;
+        conn->timer.owner = conn;
+        timers.arm(&conn->timer, steadyMs(), timeout * 1000);
+        return "";
+    }
+    
+    std::string handleRenew(Subscription* sub, std::string_view request) {
+        long seconds = parseTermination(getElementText(request, "TerminationTime"), 60);
+        time_t now = clock.now();
+        sub->termination = now + seconds;
+        timers.arm(&sub->expiry, steadyMs(), seconds * 1000);
+        
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<wsnt:RenewResponse>\n"
+                   "<wsnt:TerminationTime>";
+            renderTime(out, sub->termination);
+            out << "</wsnt:TerminationTime>\n"
+                   "<wsnt:CurrentTime>";
+            renderTime(out, now);
+            out << "</wsnt:CurrentTime>\n"
+                   "</wsnt:RenewResponse>";
+        });
+    }
+    
+    // Answers a parked PullMessages with whatever is queued (possibly nothing).
+    // Pipelined requests on that connection are picked up after the current
+    // loop iteration, so callers may keep iterating subscriptions.
+    void completePull(Subscription* sub) {
+        Connection* conn = sub->waiter;
+        sub->waiter = nullptr;
+        parked.erase(sub->id);
+        conn->parked_subscription = 0;
+        timers.cancel(&conn->timer);
+        queueResponse(conn, "200 OK", "application/soap+xml; charset=utf-8", renderPullMessages(sub, sub->waiter_limit));
+        int fd = conn->fd;
+        if (flush(conn)) {
+            resumed.push_back(fd);
+        }
+    }
+    
+    void removeSubscription(Subscription* sub) {
+        if (sub->waiter) {
+            completePull(sub);
+        }
+        if (sub->consumer) {
+            Consumer* consumer = sub->consumer;
+            auto& list = consumer->subscriptions;
+            list.erase(std::remove(list.begin(), list.end(), sub->id), list.end());
+            if (list.empty()) {
+                closeConsumer(consumer);
+                consumers.erase(consumer->key);
+            }
+        }
+        timers.cancel(&sub->expiry);
+        subscriptions.erase(sub->id);
+    }
+    
+    // Push delivery
+    
+    std::string handleSubscribe(const LocalAddress& local, std::string_view request) {
+        if (subscriptions.size() >= MAX_SUBSCRIPTIONS) {
+            return generateFault("Receiver", "Maximum number of subscriptions reached");
+        }
+        
+        // http://host[:port]/path inside ConsumerReference
+        size_t reference = request.find("ConsumerReference");
+        std::string address = reference == std::string::npos ? "" : getElementText(request.substr(reference), "Address");
+        static const std::string scheme = "http://";
+        if (address.compare(0, scheme.size(), scheme) != 0) {
+            return generateFault("Sender", "Unsupported ConsumerReference address");
+        }
+        size_t path_start = address.find('/', scheme.size());
+        std::string authority = address.substr(scheme.size(), path_start - scheme.size());
+        std::string path = path_start == std::string::npos ? "/" : address.substr(path_start);
+        
+        Consumer* consumer = findConsumer(authority);
+        if (!consumer) {
+            return generateFault("Sender", "ConsumerReference address must be an IP address and port");
+        }
+        
+        std::unique_ptr<Subscription> sub(new Subscription());
+        sub->id = next_subscription_id++;
+        sub->filter = getElementText(request, "TopicExpression");
+        size_t wildcard = sub->filter.find("//.");
+        if (wildcard != std::string::npos) {
+            sub->filter.erase(wildcard);
+        }
+        sub->cursor = events->end();
+        sub->consumer = consumer;
+        sub->consumer_path = path;
+        consumer->subscriptions.push_back(sub->id);
+        
+        long seconds = parseTermination(getElementText(request, "InitialTerminationTime"), 60);
+        time_t now = clock.now();
+        sub->termination = now + seconds;
+        sub->expiry.kind = TIMER_SUBSCRIPTION_EXPIRY;
+        sub->expiry.owner = sub.get();
+        timers.arm(&sub->expiry, steadyMs(), seconds * 1000);
+        
+        const Subscription& created = *sub;
+        subscriptions[sub->id] = std::move(sub);
+        return renderSoapEnvelope([&](auto& out) {
+            out << "<wsnt:SubscribeResponse>\n"
+                   "<wsnt:SubscriptionReference>\n";
+            renderSubscriptionReference(out, local, created.id);
+            out << "</wsnt:SubscriptionReference>\n"
+                   "<wsnt:CurrentTime>";
+            renderTime(out, now);
+            out << "</wsnt:CurrentTime>\n"
+                   "<wsnt:TerminationTime>";
+            renderTime(out, created.termination);
+            out << "</wsnt:TerminationTime>\n"
+                   "</wsnt:SubscribeResponse>";
+        });
+    }
+    
+    Consumer* findConsumer(const std::string& authority) {
+        auto it = consumers.find(authority);
+        if (it != consumers.end()) {
+            return it->second.get();
+        }
+        
+        std::string host = authority;
+        std::string service = "80";
+        size_t colon = authority.rfind(':');
+        if (colon != std::string::npos && authority.find(']', colon) == std::string::npos) {
+            host = authority.substr(0, colon);
+            service = authority.substr(colon + 1);
+        }
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        
+        // IP literals only: resolving a host name would block the event
+        // loop, and with it every client, for as long as DNS takes
+        struct addrinfo hints = {};
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+        struct addrinfo* result = nullptr;
+        if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0 || !result) {
+            return nullptr;
+        }
+        
+        std::unique_ptr<Consumer> consumer(new Consumer());
+        consumer->key = authority;
+        consumer->host = authority;
+        memcpy(&consumer->address, result->ai_addr, result->ai_addrlen);
+        consumer->address_length = result->ai_addrlen;
+        consumer->timer.owner = consumer.get();
+        freeaddrinfo(result);
+        
+        Consumer* raw = consumer.get();
+        consumers[authority] = std::move(consumer);
+        return raw;
+    }
+    
+    void closeConsumer(Consumer* consumer) {
+        if (consumer->fd >= 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, consumer->fd, nullptr);
+            close(consumer->fd);
+            consumer_fds.erase(consumer->fd);
+            consumer->fd = -1;
+        }
+        consumer->connecting = false;
+        consumer->out.clear();
+        consumer->out_offset = 0;
+        consumer->in.clear();
+        consumer->inflight = 0;
+        timers.cancel(&consumer->timer);
+    }
+    
+    void consumerFailed(Consumer* consumer) {
+        closeConsumer(consumer);
+        consumer->failures = std::min(consumer->failures + 1, 6);
+        consumer->timer.kind = TIMER_CONSUMER_RETRY;
+        timers.arm(&consumer->timer, steadyMs(), 500ULL << consumer->failures);
+    }
+    
+    // Sends the next batch if the consumer is idle. Subscriptions sharing the
+    // consumer take turns; each Notify carries up to MAX_NOTIFY_BATCH messages.
+    void startDelivery(Consumer* consumer) {
+        if (consumer->inflight || (consumer->timer.armed() && consumer->timer.kind == TIMER_CONSUMER_RETRY)) {
+            return;
+        }
+        
+        Subscription* sub = nullptr;
+        for (size_t i = 0; i < consumer->subscriptions.size() && !sub; i++) {
+            size_t index = (consumer->next + i) % consumer->subscriptions.size();
+            auto it = subscriptions.find(consumer->subscriptions[index]);
+            if (it != subscriptions.end() && hasMessages(it->second.get())) {
+                sub = it->second.get();
+                consumer->next = index + 1;
+            }
+        }
+        if (!sub) {
+            return;
+        }
+        
+        uint64_t start = sub->cursor;
+        std::string messages;
+        readMessages(sub, MAX_NOTIFY_BATCH, messages);
+        consumer->inflight = sub->id;
+        consumer->inflight_end = sub->cursor;
+        // Delivery only counts once acknowledged
+        sub->cursor = start;
+        
+        std::string body = renderSoapEnvelope([&](auto& out) { out << "<wsnt:Notify>\n" << messages << "</wsnt:Notify>"; });
+        consumer->out = "POST " + sub->consumer_path + " HTTP/1.1\r\n"
+                        "Host: " + consumer->host + "\r\n"
+                        "Content-Type: application/soap+xml; charset=utf-8\r\n"
+                        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                        "\r\n" + body;
+        consumer->out_offset = 0;
+        consumer->in.clear();
+        consumer->timer.kind = TIMER_CONSUMER_TIMEOUT;
+        timers.arm(&consumer->timer, steadyMs(), NOTIFY_TIMEOUT_MS);
+        
+        if (consumer->fd < 0) {
+            int fd = socket(consumer->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                consumerFailed(consumer);
+                return;
+            }
+            consumer->fd = fd;
+            consumer_fds[fd] = consumer;
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLOUT;
+            ev.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+            if (connect(fd, reinterpret_cast<struct sockaddr*>(&consumer->address), consumer->address_length) < 0) {
+                if (errno != EINPROGRESS) {
+                    consumerFailed(consumer);
+                    return;
+                }
+                consumer->connecting = true;
+                return;
+            }
+        }
+        writeConsumer(consumer);
+    }
+    
+    void writeConsumer(Consumer* consumer) {
+        while (consumer->out_offset < consumer->out.size()) {
+            ssize_t sent = send(consumer->fd, consumer->out.data() + consumer->out_offset,
+                                consumer->out.size() - consumer->out_offset, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    consumerFailed(consumer);
+                    return;
+                }
+                struct epoll_event ev = {};
+                ev.events = EPOLLIN | EPOLLOUT;
+                ev.data.fd = consumer->fd;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, consumer->fd, &ev);
+                return;
+            }
+            consumer->out_offset += sent;
+        }
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = consumer->fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, consumer->fd, &ev);
+    }
+    
+    void readConsumer(Consumer* consumer) {
+        char buffer[4096];
+        while (true) {
+            ssize_t bytes_read = read(consumer->fd, buffer, sizeof(buffer));
+            if (bytes_read > 0) {
+                consumer->in.append(buffer, bytes_read);
+                continue;
+            }
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            // Closed by the consumer: a failure only if a Notify was pending
+            if (consumer->inflight) {
+                consumerFailed(consumer);
+            } else {
+                closeConsumer(consumer);
+            }
+            return;
+        }
+        
+        size_t header_end = consumer->in.find("\r\n\r\n");
+        if (!consumer->inflight || header_end == std::string::npos) {
+            return;
+        }
+        std::string headers = consumer->in.substr(0, header_end + 4);
+        size_t content_length = parseSize(getHeader(headers, "Content-Length"));
+        if (consumer->in.size() < header_end + 4 + content_length) {
+            return;
+        }
+        
+        int status = headers.size() > 12 ? std::atoi(headers.c_str() + 9) : 0;
+        if (status < 200 || status >= 300) {
+            consumerFailed(consumer);
+            return;
+        }
+        
+        auto it = subscriptions.find(consumer->inflight);
+        if (it != subscriptions.end()) {
+            it->second->cursor = std::max(it->second->cursor, consumer->inflight_end);
+        }
+        consumer->inflight = 0;
+        consumer->failures = 0;
+        consumer->in.clear();
+        timers.cancel(&consumer->timer);
+        if (equalsIgnoreCase(getHeader(headers, "Connection"), "close")) {
+            closeConsumer(consumer);
+        }
+        startDelivery(consumer);
+    }
+    
+    void handleConsumerEvent(Consumer* consumer, uint32_t ready) {
+        if (consumer->connecting && (ready & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(consumer->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                consumerFailed(consumer);
+                return;
+            }
+            consumer->connecting = false;
+        }
+        if (ready & EPOLLOUT) {
+            writeConsumer(consumer);
+            if (consumer->fd < 0) {
+                return;
+            }
+        }
+        if (ready & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            readConsumer(consumer);
+        }
+    }
+    
+    // Answers parked pulls that have matching messages and starts push
+    // deliveries. Pull subscriptions that are not waiting cost nothing here;
+    // they read the log when they pull.
+    void dispatchEvents() {
+        uint64_t end = events->end();
+        if (end == dispatched_end) {
+            return;
+        }
+        dispatched_end = end;
+        
+        for (auto& entry : consumers) {
+            startDelivery(entry.second.get());
+        }
+        
+        std::vector<uint32_t> waiting(parked.begin(), parked.end());
+        for (uint32_t id : waiting) {
+            auto it = subscriptions.find(id);
+            if (it != subscriptions.end() && it->second->waiter && hasMessages(it->second.get())) {
+                completePull(it->second.get());
+            }
+        }
+    }
+    
+    void onTimer(TimerNode* node) {
+        if (node->kind == TIMER_PULL_TIMEOUT) {
+            Connection* conn = static_cast<Connection*>(node->owner);
+            auto it = subscriptions.find(conn->parked_subscription);
+            if (it != subscriptions.end()) {
+                completePull(it->second.get());
+            }
+        } else if (node->kind == TIMER_SUBSCRIPTION_EXPIRY) {
+            removeSubscription(static_cast<Subscription*>(node->owner));
+        } else if (node->kind == TIMER_CONSUMER_RETRY) {
+            startDelivery(static_cast<Consumer*>(node->owner));
+        } else if (node->kind == TIMER_CONSUMER_TIMEOUT) {
+            consumerFailed(static_cast<Consumer*>(node->owner));
+        } else if (node->kind == TIMER_CLOCK) {
+            timers.arm(&clock_timer, steadyMs(), clock.update());
+        } else if (node->kind >= TIMER_HEADER) {
+            Connection* conn = static_cast<Connection*>(node->owner);
+            timed_out_connections++;
+            if (verbose) {
+                static const char* const states[] = {"headers", "body", "next request", "client to read"};
+                std::cout << "Connection " << conn->fd << " timed out waiting for "
+                          << states[node->kind - TIMER_HEADER] << std::endl;
+            }
+            if (node->kind == TIMER_WRITE) {
+                // Reset instead of leaving the unsent response to an
+                // orphaned socket that the client still is not reading
+                struct linger abort = {1, 0};
+                setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+            }
+            closeConnection(conn);
+        } else if (node->kind == TIMER_DRAIN) {
+            std::cout << "Drain deadline reached, closing " << connections.size() << " connections" << std::endl;
+            running = false;
+        }
+    }
+    
+    static bool isStale(const MediaConfig& config, const CachedResponse& entry) {
+        for (int i = 0; i < DEPENDENCY_COUNT; i++) {
+            if ((entry.depends & (1u << i)) && config.changed[i] > entry.version) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Cached response for `key`, rendered again only when a change to one
+    // of the `depends` parts of the configuration happened after it was
+    // last rendered
+    template <typename... Parts>
+    ArenaString cacheKey(const Parts&... parts) {
+        ArenaString key(&request_arena);
+        (key.append(parts), ...);
+        return key;
+    }
+    
+    template <typename Render>
+    const std::string& cachedResponse(const MediaConfig& config, const ArenaString& key, unsigned depends, Render render) {
+        auto it = response_cache.find(key);
+        if (it != response_cache.end() && !isStale(config, it->second)) {
+            answered_entry = &it->second;
+            return it->second.response;
+        }
+        if (it == response_cache.end()) {
+            // Keys of deleted profiles are never looked up again
+            if (response_cache.size() >= MAX_CACHED_RESPONSES) {
+                response_cache.clear();
+            }
+            it = response_cache.emplace(key, CachedResponse()).first;
+        }
+        it->second = CachedResponse{render(), depends, config.version, {}};
+        answered_entry = &it->second;
+        return it->second.response;
+    }
+    
+    static constexpr std::string_view SUBSCRIPTION_PREFIX = "/onvif/events/subscription_";
+    
+    // Operations answered from response_cache. Returns nullptr for any
+    // other operation; a fault for invalid arguments is left in
+    // rendered_response.
+    const std::string* cachedOperation(Connection* conn, const MediaConfig& config, std::string_view path,
+                                       const SoapMessage& request) {
+        std::string_view operation = request.operation;
+        if (path == "/onvif/media2_service") {
+            return cachedMedia2Operation(conn, config, request);
+        }
+        if (path.compare(0, SUBSCRIPTION_PREFIX.size(), SUBSCRIPTION_PREFIX) == 0) {
+            return nullptr;
+        }
+        
+        if (operation == "GetDeviceInformation") {
+            return &cachedResponse(config, cacheKey("GetDeviceInformation"), 0, [&] { return handleGetDeviceInformation(); });
+        }
+        if (operation == "GetCapabilities") {
+            const LocalAddress& local = localAddress(conn);
+            return &cachedResponse(config, cacheKey("GetCapabilities/", local.base), 0, [&] { return handleGetCapabilities(local); });
+        }
+        if (operation == "GetServices") {
+            const LocalAddress& local = localAddress(conn);
+            return &cachedResponse(config, cacheKey("GetServices/", local.base), 0, [&] { return handleGetServices(local); });
+        }
+        if (operation == "GetProfiles") {
+            return &cachedResponse(config, cacheKey("GetProfiles"), DEPENDS_PROFILES | DEPENDS_ENCODERS, [&] {
+                return handleGetProfiles(config);
+            });
+        }
+        if (operation == "GetStreamUri") {
+            // Without a ProfileToken, the first profile's stream as before
+            std::string_view token = request.field("ProfileToken");
+            const MediaProfile* profile = token.empty() && !config.profiles.empty() ? &config.profiles.front()
+                                                                                     : config.findProfile(token);
+            StreamTransport transport;
+            if (!profile || !parseStreamSetup(request.field("Stream"), request.field("Protocol"), transport)) {
+                rendered_response = generateFault("Sender", profile ? "Invalid stream setup" : "No such profile");
+                return &rendered_response;
+            }
+            char transport_digit[] = {char('0' + transport), '/', '\0'};
+            const LocalAddress& local = localAddress(conn);
+            return &cachedResponse(config, cacheKey("GetStreamUri/", local.host, "/", transport_digit, profile->token),
+                                   DEPENDS_PROFILES, [&] { return handleGetStreamUri(config, local, *profile, transport); });
+        }
+        if (operation == "GetVideoEncoderConfigurations") {
+            return &cachedResponse(config, cacheKey("GetVideoEncoderConfigurations"), DEPENDS_PROFILES | DEPENDS_ENCODERS, [&] {
+                return handleGetVideoEncoderConfigurations(config);
+            });
+        }
+        if (operation == "GetVideoEncoderConfiguration") {
+            std::string_view token = request.field("ConfigurationToken");
+            const VideoEncoderConfig* encoder = config.findEncoder(token);
+            if (!encoder || encoder->encoding == "H265") {
+                rendered_response = generateFault("Sender", "No such configuration");
+                return &rendered_response;
+            }
+            return &cachedResponse(config, cacheKey("GetVideoEncoderConfiguration/", token), DEPENDS_PROFILES | DEPENDS_ENCODERS, [&] {
+                return handleGetVideoEncoderConfiguration(config, *encoder);
+            });
+        }
+        if (operation == "GetConfigurations") {
+            return &cachedResponse(config, cacheKey("GetConfigurations"), 0, [&] { return handlePTZGetConfigurations(); });
+        }
+        return nullptr;
+    }
+    
+    // Returns the SOAP response, or an empty view when the connection was
+    // parked and will be answered later. The view is valid until the next
+    // request is processed.
+    std::string_view processRequest(Connection* conn, std::string_view path, std::string_view request) {
+        // processInput has found the end of the headers
+        std::string_view body = request.substr(request.find("\r\n\r\n") + 4);
+        answered_entry = nullptr;
+        SoapMessage soap;
+        if (!soap.parse(body)) {
+            rendered_response = generateFault("Sender", "Malformed SOAP request");
+            return rendered_response;
+        }
+        
+        // One configuration version for the whole request
+        std::shared_ptr<const MediaConfig> config = mediaConfig();
+        if (const std::string* cached = cachedOperation(conn, *config, path, soap)) {
+            return *cached;
+        }
+        rendered_response = renderResponse(conn, *config, path, soap.operation, body);
+        return rendered_response;
+    }
+    
+    std::string renderResponse(Connection* conn, const MediaConfig& config, std::string_view path,
+                               std::string_view operation, std::string_view request) {
+        std::string response;
+        
+        if (path.compare(0, SUBSCRIPTION_PREFIX.size(), SUBSCRIPTION_PREFIX) == 0) {
+            uint32_t id = std::strtoul(path.data() + SUBSCRIPTION_PREFIX.size(), nullptr, 10);
+            auto it = subscriptions.find(id);
+            if (it == subscriptions.end()) {
+                return generateFault("Sender", "Unknown subscription");
+            }
+            Subscription* sub = it->second.get();
+            
+            if (operation == "PullMessages") {
+                response = handlePullMessages(conn, sub, request);
+            }
+            else if (operation == "Renew") {
+                response = handleRenew(sub, request);
+            }
+            else if (operation == "Unsubscribe") {
+                removeSubscription(sub);
+                response = generateSoapEnvelope("<wsnt:UnsubscribeResponse/>");
+            }
+            else if (operation == "SetSynchronizationPoint") {
+                response = generateSoapEnvelope("<tev:SetSynchronizationPointResponse/>");
+            }
+            else {
+                response = generateFault("Receiver", "Method not implemented");
+            }
+            return response;
+        }
+        
+        if (path == "/onvif/media2_service") {
+            return processMedia2Request(config, operation, request);
+        }
+        
+        if (operation == "GetSnapshotUri") {
+            response = handleGetSnapshotUri(config, localAddress(conn), request);
+        }
+        else if (operation == "SetVideoEncoderConfiguration") {
+            response = handleSetVideoEncoderConfiguration(config, request, false);
+        }
+        else if (operation == "CreateProfile") {
+            std::string fault;
+            std::string name = getElementText(request, "Name");
+            std::string token = createProfile(config, name, getElementText(request, "Token"), "", fault);
+            response = token.empty() ? fault : renderSoapEnvelope([&](auto& out) {
+                out << "<trt:CreateProfileResponse>\n"
+                       "<trt:Profile token=\"" << token << "\" fixed=\"false\">\n"
+                       "<trt:Name>" << name << "</trt:Name>\n"
+                       "</trt:Profile>\n"
+                       "</trt:CreateProfileResponse>";
+            });
+        }
+        else if (operation == "DeleteProfile") {
+            response = deleteProfile(config, getElementText(request, "ProfileToken"));
+            if (response.empty()) {
+                response = generateSoapEnvelope("<trt:DeleteProfileResponse/>");
+            }
+        }
+        else if (operation == "AddVideoEncoderConfiguration") {
+            response = setProfileEncoder(config, getElementText(request, "ProfileToken"),
+                                         getElementText(request, "ConfigurationToken"));
+            if (response.empty()) {
+                response = generateSoapEnvelope("<trt:AddVideoEncoderConfigurationResponse/>");
+            }
+        }
+        else if (operation == "RemoveVideoEncoderConfiguration") {
+            response = setProfileEncoder(config, getElementText(request, "ProfileToken"), "");
+            if (response.empty()) {
+                response = generateSoapEnvelope("<trt:RemoveVideoEncoderConfigurationResponse/>");
+            }
+        }
+        else if (operation == "GetSystemDateAndTime") {
+            response = handleGetSystemDateAndTime();
+        }
+        else if (operation == "SetSystemDateAndTime") {
+            response = handleSetSystemDateAndTime(request);
+        }
+        else if (operation == "ContinuousMove") {
+            response = handleContinuousMove(request);
+        }
+        else if (operation == "AbsoluteMove") {
+            response = handleAbsoluteMove(request, false);
+        }
+        else if (operation == "RelativeMove") {
+            response = handleAbsoluteMove(request, true);
+        }
+        else if (operation == "Stop") {
+            response = handleStop(request);
+        }
+        else if (operation == "GetStatus") {
+            response = handleGetStatus(request);
+        }
+        else if (operation == "SetPreset") {
+            response = handleSetPreset(request);
+        }
+        else if (operation == "GetPresets") {
+            response = handleGetPresets(request);
+        }
+        else if (operation == "GotoPreset") {
+            response = handleGotoPreset(request);
+        }
+        else if (operation == "RemovePreset") {
+            response = handleRemovePreset(request);
+        }
+        else if (operation == "CreatePresetTour") {
+            response = handleCreatePresetTour(request);
+        }
+        else if (operation == "ModifyPresetTour") {
+            response = handleModifyPresetTour(request);
+        }
+        else if (operation == "GetPresetTours") {
+            response = handleGetPresetTours(request);
+        }
+        else if (operation == "GetPresetTour") {
+            response = handleGetPresetTour(request);
+        }
+        else if (operation == "OperatePresetTour") {
+            response = handleOperatePresetTour(request);
+        }
+        else if (operation == "RemovePresetTour") {
+            response = handleRemovePresetTour(request);
+        }
+        else if (operation == "CreatePullPointSubscription") {
+            response = handleCreatePullPointSubscription(localAddress(conn), request);
+        }
+        else if (operation == "Subscribe") {
+            response = handleSubscribe(localAddress(conn), request);
+        }
+        else if (operation == "GetEventProperties") {
+            response = handleGetEventProperties();
+        }
+        else {
+            // Default error response
+            response = generateFault("Receiver", "Method not implemented");
+        }
+        
+        return response;
+    }
+    
+    // Event loop
+    
+    void wake() {
+        if (wake_fd >= 0) {
+            uint64_t one = 1;
+            ssize_t ignored = write(wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+    
+    static uint64_t ringData(Connection* conn, RingOperation operation) {
+        return reinterpret_cast<uint64_t>(conn) | operation;
+    }
+    
+    // Queues a ring operation on the connection's socket
+    struct io_uring_sqe* prepareRing(Connection* conn, uint8_t opcode, RingOperation operation) {
+        conn->ring_operations++;
+        return ring.prepare(opcode, conn->fd, ringData(conn, operation));
+    }
+    
+    bool ringOwns(const Connection* conn) const {
+        return ring.isOpen() && !conn->ssl;
+    }
+    
+    void watchWrite(Connection* conn, bool enable) {
+        if (conn->writing == enable) {
+            return;
+        }
+        if (ringOwns(conn)) {
+            // One-shot; the completion clears `writing` and resumes flush()
+            prepareRing(conn, IORING_OP_POLL_ADD, RING_WRITABLE)->poll32_events = POLLOUT;
+            conn->writing = true;
+            return;
+        }
+        loop_syscalls++;
+        struct epoll_event ev = {};
+        ev.events = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        ev.data.fd = conn->fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->writing = enable;
+    }
+    
+    void closeConnection(Connection* conn) {
+        if (conn->parked_subscription) {
+            auto it = subscriptions.find(conn->parked_subscription);
+            if (it != subscriptions.end()) {
+                it->second->waiter = nullptr;
+            }
+            parked.erase(conn->parked_subscription);
+        }
+        timers.cancel(&conn->timer);
+        if (conn->ssl) {
+            // close_notify if the socket takes it right away
+            if (!conn->handshaking) {
+                SSL_shutdown(conn->ssl);
+            }
+            SSL_free(conn->ssl);
+            conn->ssl = nullptr;
+            ERR_clear_error();
+        } else if (ring.isOpen()) {
+            // Shutting the socket down ends its multishot receive. Linked
+            // behind a final send, this only runs once the send is done.
+            ring.reserve(2);
+            prepareRing(conn, IORING_OP_SHUTDOWN, RING_SHUTDOWN)->flags = IOSQE_IO_LINK;
+            prepareRing(conn, IORING_OP_CLOSE, RING_CLOSE);
+            conn->retired = true;
+            auto it = connections.find(conn->fd);
+            retired.push_back(std::move(it->second));
+            connections.erase(it);
+            return;
+        }
+        loop_syscalls += 2;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+        close(conn->fd);
+        connections.erase(conn->fd);
+    }
+    
+    // Compressed form of a SOAP response in the preferred coding the client
+    // accepts. A cached response is compressed once per rendering; others
+    // go through the reusable compressor. Resets `encoding` to identity
+    // when the body is sent as it is.
+    std::string_view encodeResponse(std::string_view body, ContentEncoding& encoding) {
+        if (encoding == ENCODING_IDENTITY || body.size() < MIN_COMPRESSED_SIZE) {
+            encoding = ENCODING_IDENTITY;
+            return body;
+        }
+        if (answered_entry && body.data() == answered_entry->response.data()) {
+            std::string& variant = answered_entry->encoded[encoding];
+            if (variant.empty()) {
+                if (!cache_compressor.compress(body, encoding, variant)) {
+                    variant.clear();
+                    encoding = ENCODING_IDENTITY;
+                    return body;
+                }
+                cache_compressions++;
+            }
+            return variant;
+        }
+        if (!response_compressor.compress(body, encoding, compressed_response)) {
+            encoding = ENCODING_IDENTITY;
+            return body;
+        }
+        response_compressions++;
+        return compressed_response;
+    }
+    
+    // Built in place so the output buffer keeps its capacity from one
+    // response to the next
+    void queueResponse(Connection* conn, const char* status, const char* content_type, std::string_view body,
+                       ContentEncoding encoding = ENCODING_IDENTITY) {
+        char length[24];
+        conn->out.assign("HTTP/1.1 ").append(status).append("\r\nContent-Type: ").append(content_type);
+        if (encoding != ENCODING_IDENTITY) {
+            conn->out.append("\r\nContent-Encoding: ").append(ResponseCompressor::name(encoding))
+                     .append("\r\nVary: Accept-Encoding");
+        }
+        conn->out.append("\r\nContent-Length: ")
+                 .append(length, std::to_chars(length, length + sizeof(length), body.size()).ptr - length)
+                 .append(conn->keep_alive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n")
+                 .append(body);
+        conn->out_offset = 0;
+        if (verbose) {
+            std::cout << "Sent response:\n" << conn->out << "\n\n";
+        }
+    }
+    
+    void queueSnapshot(Connection* conn, std::string_view request, const std::string& token) {
+        std::shared_ptr<const SnapshotImage> image;
+        {
+            std::lock_guard<std::mutex> lock(server_mutex);
+            auto it = snapshots.find(token);
+            if (it != snapshots.end()) {
+                image = it->second;
+            }
+        }
+        
+        if (!image) {
+            queueResponse(conn, "404 Not Found", "text/plain", "");
+            return;
+        }
+        
+        const char* connection_header = conn->keep_alive ? "\r\n" : "Connection: close\r\n\r\n";
+        conn->out_offset = 0;
+        if (getHeader(request, "If-None-Match") == image->etag) {
+            conn->out.assign(image->not_modified).append(connection_header);
+            return;
+        }
+        conn->out.assign(image->ok_header).append(connection_header);
+        if (image->fd >= 0) {
+            conn->file = image;
+            conn->file_offset = 0;
+        } else {
+            conn->out += image->jpeg;
+        }
+    }
+    
+    // Hands the rest of `out` to the ring. A response that ends the
+    // connection is linked to its shutdown and close, which are queued
+    // right behind it.
+    bool sendThroughRing(Connection* conn) {
+        bool last = !conn->keep_alive && !conn->file;
+        ring.reserve(last ? 3 : 1);
+        struct io_uring_sqe* sqe = prepareRing(conn, IORING_OP_SEND, RING_SEND);
+        sqe->addr = reinterpret_cast<uint64_t>(conn->out.data() + conn->out_offset);
+        sqe->len = static_cast<uint32_t>(conn->out.size() - conn->out_offset);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (conn->file ? MSG_MORE : 0);
+        conn->writing = true;
+        armDeadline(conn, TIMER_WRITE);
+        if (last) {
+            sqe->flags = IOSQE_IO_LINK;
+            closeConnection(conn);
+            return false;
+        }
+        return true;
+    }
+    
+    // Header and body deadlines keep running while the client trickles
+    // bytes in; the idle and write deadlines restart each time.
+    void armDeadline(Connection* conn, TimerKind kind) {
+        if ((kind == TIMER_HEADER || kind == TIMER_BODY) && conn->timer.armed() && conn->timer.kind == kind) {
+            return;
+        }
+        uint64_t delay = kind == TIMER_HEADER ? header_timeout_ms :
+                         kind == TIMER_BODY ? body_timeout_ms :
+                         kind == TIMER_IDLE ? idle_timeout_ms : WRITE_TIMEOUT_MS;
+        conn->timer.kind = kind;
+        conn->timer.owner = conn;
+        timers.arm(&conn->timer, steadyMs(), delay);
+    }
+    
+    // Writes as much of the pending response as the socket takes. Returns
+    // false if the connection was closed. With io_uring the headers and
+    // SOAP body go out as a ring send and flush() is called again when it
+    // completes; snapshot files are still sent with sendfile().
+    bool flush(Connection* conn) {
+        if (conn->ssl) {
+            return flushTls(conn);
+        }
+        if (conn->out.empty() && !conn->file) {
+            return true;
+        }
+        if (ring.isOpen() && conn->writing) {
+            return true;
+        }
+        while (conn->out_offset < conn->out.size()) {
+            if (ring.isOpen()) {
+                return sendThroughRing(conn);
+            }
+            loop_syscalls++;
+            ssize_t sent = send(conn->fd, conn->out.data() + conn->out_offset, conn->out.size() - conn->out_offset,
+                                MSG_NOSIGNAL | (conn->file ? MSG_MORE : 0));
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    watchWrite(conn, true);
+                    armDeadline(conn, TIMER_WRITE);
+                    return true;
+                }
+                closeConnection(conn);
+                return false;
+            }
+            conn->out_offset += sent;
+        }
+        
+        if (conn->file) {
+            off_t size = static_cast<off_t>(conn->file->jpeg.size());
+            while (conn->file_offset < size) {
+                loop_syscalls++;
+                ssize_t sent = sendfile(conn->fd, conn->file->fd, &conn->file_offset, size - conn->file_offset);
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    watchWrite(conn, true);
+                    armDeadline(conn, TIMER_WRITE);
+                    return true;
+                }
+                if (sent <= 0) {
+                    closeConnection(conn);
+                    return false;
+                }
+            }
+            conn->file.reset();
+        }
+        return responseSent(conn);
+    }
+    
+    bool responseSent(Connection* conn) {
+        conn->out.clear();
+        conn->out_offset = 0;
+        watchWrite(conn, false);
+        // A keep-alive response that was already under way when draining
+        // started ends the connection unless another request is buffered
+        if (!conn->keep_alive || (drain_started && conn->in.empty())) {
+            closeConnection(conn);
+            return false;
+        }
+        return true;
+    }
+    
+    // Outcome of an OpenSSL call that returned `result` <= 0: waits for the
+    // socket when OpenSSL asks for it, otherwise closes the connection.
+    // Returns false if the connection was closed.
+    bool waitTls(Connection* conn, int result) {
+        int error = SSL_get_error(conn->ssl, result);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            watchWrite(conn, error == SSL_ERROR_WANT_WRITE);
+            if (error == SSL_ERROR_WANT_WRITE && !conn->handshaking) {
+                armDeadline(conn, TIMER_WRITE);
+            }
+            return true;
+        }
+        closeConnection(conn);
+        return false;
+    }
+    
+    // Advances the handshake; the header deadline armed at accept bounds
+    // how long it may take. Returns false if the connection was closed.
+    bool handshake(Connection* conn) {
+        loop_syscalls++;
+        int result = SSL_do_handshake(conn->ssl);
+        if (result != 1) {
+            return waitTls(conn, result);
+        }
+        conn->handshaking = false;
+        tls_handshakes++;
+        tls_resumptions += SSL_session_reused(conn->ssl);
+        ktls_connections += TlsContext::kernelSend(conn->ssl);
+        watchWrite(conn, false);
+        return true;
+    }
+    
+    // flush() for HTTPS. With kernel TLS, snapshot files still go out
+    // with sendfile(); otherwise they are written from memory.
+    bool flushTls(Connection* conn) {
+        if (conn->handshaking) {
+            return handshake(conn);
+        }
+        if (conn->out.empty() && !conn->file) {
+            return true;
+        }
+        while (conn->out_offset < conn->out.size()) {
+            loop_syscalls++;
+            int sent = SSL_write(conn->ssl, conn->out.data() + conn->out_offset,
+                                 static_cast<int>(std::min<size_t>(conn->out.size() - conn->out_offset, INT_MAX)));
+            if (sent <= 0) {
+                return waitTls(conn, sent);
+            }
+            conn->out_offset += sent;
+        }
+        
+        if (conn->file) {
+            off_t size = static_cast<off_t>(conn->file->jpeg.size());
+            bool kernel = TlsContext::kernelSend(conn->ssl);
+            while (conn->file_offset < size) {
+                loop_syscalls++;
+                ossl_ssize_t sent = kernel ?
+                    SSL_sendfile(conn->ssl, conn->file->fd, conn->file_offset, size - conn->file_offset, 0) :
+                    SSL_write(conn->ssl, conn->file->jpeg.data() + conn->file_offset,
+                              static_cast<int>(std::min<off_t>(size - conn->file_offset, 1 << 20)));
+                if (sent <= 0) {
+                    return waitTls(conn, static_cast<int>(sent));
+                }
+                conn->file_offset += sent;
+            }
+            conn->file.reset();
+        }
+        return responseSent(conn);
+    }
+    
+    // Reads and decrypts what arrived. Returns false if the connection
+    // was closed or is still in its handshake.
+    bool readTls(Connection* conn) {
+        if (conn->handshaking) {
+            if (!handshake(conn) || conn->handshaking) {
+                return false;
+            }
+        }
+        char buffer[16384];
+        while (true) {
+            loop_syscalls++;
+            int bytes_read = SSL_read(conn->ssl, buffer, sizeof(buffer));
+            if (bytes_read <= 0) {
+                int error = SSL_get_error(conn->ssl, bytes_read);
+                return error == SSL_ERROR_WANT_READ || waitTls(conn, bytes_read);
+            }
+            conn->in.append(buffer, bytes_read);
+            if (conn->in.size() > MAX_REQUEST_SIZE) {
+                closeConnection(conn);
+                return false;
+            }
+        }
+    }
+    
+    bool responsePending(const Connection* conn) const {
+        return !conn->out.empty() || conn->file || conn->parked_subscription;
+    }
+    
+    // Parses and answers buffered requests one at a time; pipelined requests
+    // wait while a response is still being written or the connection is parked
+    void processInput(Connection* conn) {
+        while (!responsePending(conn)) {
+            size_t header_end = conn->in.find("\r\n\r\n");
+            if (header_end == std::string::npos) {
+                // A new connection has the header deadline from accept on
+                armDeadline(conn, conn->in.empty() && conn->served ? TIMER_IDLE : TIMER_HEADER);
+                return;
+            }
+            
+            std::string_view in = conn->in;
+            size_t content_length = parseSize(getHeader(in.substr(0, header_end + 4), "Content-Length"));
+            size_t total = header_end + 4 + content_length;
+            if (total > MAX_REQUEST_SIZE) {
+                closeConnection(conn);
+                return;
+            }
+            if (conn->in.size() < total) {
+                armDeadline(conn, TIMER_BODY);
+                return;
+            }
+            timers.cancel(&conn->timer);
+            
+            // The request is parsed in place and dropped from the input
+            // buffer once it has been answered
+            std::string_view request = in.substr(0, total);
+            if (verbose) {
+                std::cout << "Received request:\n" << request << "\n\n";
+            }
+            
+            // Request line: METHOD SP PATH SP VERSION
+            size_t method_end = request.find(' ');
+            size_t path_end = request.find(' ', method_end + 1);
+            size_t line_end = request.find("\r\n");
+            if (method_end == std::string::npos || path_end == std::string::npos || path_end > line_end) {
+                closeConnection(conn);
+                return;
+            }
+            std::string_view method = request.substr(0, method_end);
+            std::string_view path = request.substr(method_end + 1, path_end - method_end - 1);
+            std::string_view version = request.substr(path_end + 1, line_end - path_end - 1);
+            std::string_view connection = getHeader(request, "Connection");
+            conn->keep_alive = version == "HTTP/1.1" ? !equalsIgnoreCase(connection, "close")
+                                                     : equalsIgnoreCase(connection, "keep-alive");
+            // While draining, every answer tells the client to reconnect
+            // elsewhere
+            conn->keep_alive = conn->keep_alive && !drain_started;
+            conn->served = true;
+            requests_served++;
+            
+            static constexpr std::string_view snapshot_prefix = "/snapshot/";
+            bool parked = false;
+            if (!rate_limiter.admit(conn->client, steadyMs())) {
+                rate_limited_requests++;
+                conn->out.assign(conn->keep_alive ? BUSY_RESPONSE : BUSY_CLOSE_RESPONSE);
+                conn->out_offset = 0;
+            } else if (method == "GET" && path.compare(0, snapshot_prefix.size(), snapshot_prefix) == 0) {
+                std::string token(path.substr(snapshot_prefix.size(), path.find('?') - snapshot_prefix.size()));
+                queueSnapshot(conn, request, token);
+            } else if (method == "GET" && path == "/metrics") {
+                rendered_response = renderMetrics();
+                queueResponse(conn, "200 OK", "text/plain; version=0.0.4", rendered_response);
+            } else {
+                std::string_view soap_response = processRequest(conn, path, request);
+                parked = soap_response.empty();
+                if (!parked) {
+                    ContentEncoding encoding = acceptedEncoding(getHeader(request, "Accept-Encoding"));
+                    soap_response = encodeResponse(soap_response, encoding);
+                    queueResponse(conn, "200 OK", "application/soap+xml; charset=utf-8", soap_response, encoding);
+                }
+            }
+            conn->in.erase(0, total);
+            request_arena.reset();
+            
+            if (parked || !flush(conn)) {
+                return;
+            }
+        }
+    }
+    
+    // Prometheus text exposition of the event loop's state
+    std::string renderMetrics() const {
+        std::ostringstream out;
+        out << "# TYPE onvif_connections gauge\n"
+               "onvif_connections " << connections.size() << "\n"
+               "# TYPE onvif_subscriptions gauge\n"
+               "onvif_subscriptions " << subscriptions.size() << "\n"
+               "# TYPE onvif_requests_total counter\n"
+               "onvif_requests_total " << requests_served << "\n"
+               "# HELP onvif_rejected_connections_total Connections answered with 503 over the connection limit\n"
+               "# TYPE onvif_rejected_connections_total counter\n"
+               "onvif_rejected_connections_total " << rejected_connections << "\n"
+               "# HELP onvif_rate_limited_requests_total Requests answered with 503 over their client's rate\n"
+               "# TYPE onvif_rate_limited_requests_total counter\n"
+               "onvif_rate_limited_requests_total " << rate_limited_requests << "\n"
+               "# HELP onvif_timed_out_connections_total Connections closed by a header, body, idle or write deadline\n"
+               "# TYPE onvif_timed_out_connections_total counter\n"
+               "onvif_timed_out_connections_total " << timed_out_connections << "\n"
+               "# TYPE onvif_tls_handshakes_total counter\n"
+               "onvif_tls_handshakes_total " << tls_handshakes << "\n"
+               "# HELP onvif_tls_resumptions_total Handshakes that resumed a session from a ticket\n"
+               "# TYPE onvif_tls_resumptions_total counter\n"
+               "onvif_tls_resumptions_total " << tls_resumptions << "\n"
+               "# HELP onvif_ktls_connections_total Connections whose sends the kernel encrypts\n"
+               "# TYPE onvif_ktls_connections_total counter\n"
+               "onvif_ktls_connections_total " << ktls_connections << "\n"
+               "# HELP onvif_compressions_total SOAP responses compressed, once per rendering for cached ones\n"
+               "# TYPE onvif_compressions_total counter\n"
+               "onvif_compressions_total{source=\"cache\"} " << cache_compressions << "\n"
+               "onvif_compressions_total{source=\"response\"} " << response_compressions << "\n"
+               "# TYPE onvif_loop_syscalls_total counter\n"
+               "onvif_loop_syscalls_total " << loop_syscalls + ring.enterCalls() << "\n"
+               "# TYPE onvif_io_uring gauge\n"
+               "onvif_io_uring " << ring.isOpen() << "\n"
+               "# HELP onvif_draining 1 once stop() was called; no new connections are accepted\n"
+               "# TYPE onvif_draining gauge\n"
+               "onvif_draining " << drain_started << "\n";
+        return out.str();
+    }
+    
+    // Sends a queued response and carries on with any pipelined requests
+    void respond(Connection* conn) {
+        if (flush(conn) && !responsePending(conn)) {
+            processInput(conn);
+        }
+    }
+    
+    void handleReadable(Connection* conn) {
+        if (conn->ssl) {
+            if (readTls(conn)) {
+                processInput(conn);
+            }
+            return;
+        }
+        char buffer[16384];
+        while (true) {
+            loop_syscalls++;
+            ssize_t bytes_read = read(conn->fd, buffer, sizeof(buffer));
+            if (bytes_read > 0) {
+                conn->in.append(buffer, bytes_read);
+                if (conn->in.size() > MAX_REQUEST_SIZE) {
+                    closeConnection(conn);
+                    return;
+                }
+                continue;
+            }
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            closeConnection(conn);
+            return;
+        }
+        processInput(conn);
+    }
+    
+    // From the HTTP listener, or from the HTTPS one, whose clients are
+    // over the connection limit are closed without an answer
+    void acceptConnections(int listener) {
+        while (true) {
+            struct sockaddr_storage address;
+            socklen_t length = sizeof(address);
+            loop_syscalls++;
+            int client_socket = accept4(listener, reinterpret_cast<struct sockaddr*>(&address), &length,
+                                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                return;
+            }
+            bool secure = listener == tls_socket;
+            if (connections.size() >= max_connections && secure) {
+                rejected_connections++;
+                close(client_socket);
+                continue;
+            }
+            if (connections.size() >= max_connections) {
+                rejectConnection(client_socket);
+                continue;
+            }
+            
+            std::unique_ptr<Connection> conn(new Connection());
+            conn->fd = client_socket;
+            conn->client = RateLimiter::clientKey(address);
+            if (secure) {
+                conn->ssl = tls.accept(client_socket);
+                conn->handshaking = true;
+                if (!conn->ssl) {
+                    close(client_socket);
+                    continue;
+                }
+            }
+            loop_syscalls++;
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = client_socket;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+                SSL_free(conn->ssl);
+                close(client_socket);
+                continue;
+            }
+            armDeadline(conn.get(), TIMER_HEADER);
+            connections[client_socket] = std::move(conn);
+        }
+    }
+    
+    // Best effort: the 503 normally fits the socket buffer of a fresh
+    // connection, and the request the client may have sent is never read.
+    // With io_uring the send is linked to the close.
+    void rejectConnection(int fd) {
+        rejected_connections++;
+        if (ring.isOpen()) {
+            ring.reserve(2);
+            struct io_uring_sqe* sqe = ring.prepare(IORING_OP_SEND, fd, RING_REJECT);
+            sqe->addr = reinterpret_cast<uint64_t>(BUSY_CLOSE_RESPONSE.data());
+            sqe->len = BUSY_CLOSE_RESPONSE.size();
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+            sqe->flags = IOSQE_IO_LINK;
+            ring.prepare(IORING_OP_CLOSE, fd, RING_REJECT);
+            return;
+        }
+        loop_syscalls += 2;
+        ssize_t ignored = send(fd, BUSY_CLOSE_RESPONSE.data(), BUSY_CLOSE_RESPONSE.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        (void)ignored;
+        close(fd);
+    }
+    
+    void handleWake() {
+        uint64_t counter;
+        ssize_t ignored = read(wake_fd, &counter, sizeof(counter));
+        (void)ignored;
+        dispatchEvents();
+    }
+    
+    // Dispatches what epoll_wait reported: the listening sockets, the wake
+    // eventfd, notification consumers and, on the epoll backend, clients
+    void handleEpollEvents(const struct epoll_event* events, int count) {
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == server_socket || fd == tls_socket) {
+                acceptConnections(fd);
+                continue;
+            }
+            if (fd == wake_fd) {
+                handleWake();
+                continue;
+            }
+            
+            auto it = connections.find(fd);
+            if (it == connections.end()) {
+                auto consumer = consumer_fds.find(fd);
+                if (consumer != consumer_fds.end()) {
+                    handleConsumerEvent(consumer->second, events[i].events);
+                }
+                continue;
+            }
+            Connection* conn = it->second.get();
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                closeConnection(conn);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                respond(conn);
+                if (connections.find(fd) == connections.end()) {
+                    continue;
+                }
+            }
+            if (events[i].events & EPOLLIN) {
+                handleReadable(conn);
+            }
+        }
+    }
+    
+    // Multishot operations keep producing completions until one comes
+    // without IORING_CQE_F_MORE; then they are armed again
+    void armAccept() {
+        struct io_uring_sqe* sqe = ring.prepare(IORING_OP_ACCEPT, server_socket, RING_ACCEPT);
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    
+    void armEpoll() {
+        struct io_uring_sqe* sqe = ring.prepare(IORING_OP_POLL_ADD, epoll_fd, RING_EPOLL);
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+    }
+    
+    void armReceive(Connection* conn) {
+        struct io_uring_sqe* sqe = prepareRing(conn, IORING_OP_RECV, RING_RECV);
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = IoRing::BUFFER_GROUP;
+    }
+    
+    void handleCompletion(const struct io_uring_cqe& cqe, std::vector<struct epoll_event>& events) {
+        RingOperation operation = static_cast<RingOperation>(cqe.user_data & RING_OPERATION_MASK);
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (operation == RING_ACCEPT) {
+            if (cqe.res >= 0 && connections.size() >= max_connections) {
+                rejectConnection(cqe.res);
+            } else if (cqe.res >= 0) {
+                std::unique_ptr<Connection> conn(new Connection());
+                conn->fd = cqe.res;
+                if (rate_limiter.enabled()) {
+                    struct sockaddr_storage address;
+                    socklen_t length = sizeof(address);
+                    loop_syscalls++;
+                    if (getpeername(cqe.res, reinterpret_cast<struct sockaddr*>(&address), &length) == 0) {
+                        conn->client = RateLimiter::clientKey(address);
+                    }
+                }
+                armReceive(conn.get());
+                armDeadline(conn.get(), TIMER_HEADER);
+                connections[cqe.res] = std::move(conn);
+            }
+            if (!more && server_socket >= 0) {
+                armAccept();
+            }
+            return;
+        }
+        if (operation == RING_REJECT) {
+            return;
+        }
+        if (operation == RING_EPOLL) {
+            loop_syscalls++;
+            int count = epoll_wait(epoll_fd, events.data(), events.size(), 0);
+            handleEpollEvents(events.data(), count);
+            if (!more && running) {
+                armEpoll();
+            }
+            return;
+        }
+        
+        Connection* conn = reinterpret_cast<Connection*>(cqe.user_data & ~uint64_t(RING_OPERATION_MASK));
+        if (operation != RING_RECV || !more) {
+            conn->ring_operations--;
+        }
+        switch (operation) {
+        case RING_RECV:
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                unsigned id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (!conn->retired && cqe.res > 0) {
+                    conn->in.append(ring.buffer(id), cqe.res);
+                }
+                ring.recycleBuffer(id);
+            }
+            if (conn->retired) {
+                break;
+            }
+            if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS) || conn->in.size() > MAX_REQUEST_SIZE) {
+                closeConnection(conn);
+                break;
+            }
+            if (!more) {
+                // Out of provided buffers for a moment, or the kernel ended
+                // the multishot receive
+                armReceive(conn);
+            }
+            processInput(conn);
+            break;
+        case RING_SEND:
+        case RING_WRITABLE:
+            conn->writing = false;
+            if (conn->retired) {
+                break;
+            }
+            if (cqe.res < 0) {
+                closeConnection(conn);
+                break;
+            }
+            if (operation == RING_SEND) {
+                conn->out_offset += cqe.res;
+            }
+            respond(conn);
+            break;
+        case RING_CLOSE:
+            if (cqe.res == -ECANCELED) {
+                // The send this close was linked to failed
+                loop_syscalls += 2;
+                shutdown(conn->fd, SHUT_RDWR);
+                close(conn->fd);
+            }
+            break;
+        default:
+            break;
+        }
     }
     
-    ~OnvifServer() {
-        stop();
+    // Frees closed connections the kernel no longer refers to
+    void releaseRetired() {
+        retired.erase(std::remove_if(retired.begin(), retired.end(), [](const std::unique_ptr<Connection>& conn) {
+            return conn->ring_operations == 0;
+        }), retired.end());
     }
     
-private:
-    void initializeMediaProfiles() {
-        MediaProfile profile1;
-        profile1.token = "Profile_1";
-        profile1.name = "MainStream";
-        profile1.video_encoder_token = "VideoEncoder_1";
-        profile1.audio_encoder_token = "AudioEncoder_1";
-        profile1.width = 1920;
-        profile1.height = 1080;
-        profile1.framerate = 30;
-        profile1.bitrate = 4000000;
-        
-        MediaProfile profile2;
-        profile2.token = "Profile_2";
-        profile2.name = "SubStream";
-        profile2.video_encoder_token = "VideoEncoder_2";
-        profile2.audio_encoder_token = "AudioEncoder_2";
-        profile2.width = 640;
-        profile2.height = 480;
-        profile2.framerate = 15;
-        profile2.bitrate = 1000000;
-        
-        media_profiles.push_back(profile1);
-        media_profiles.push_back(profile2);
-    }
-    
-    std::string getCurrentTime() {
-        auto now = std::chrono::system_clock::now();
-        auto time_t = std::chrono::system_clock::to_time_t(now);
-        std::stringstream ss;
-        ss << std::put_time(std::gmtime(&time_t), "%Y-%m-%dT%H:%M:%SZ");
-        return ss.str();
+    // Answers connections whose parked request was completed meanwhile
+    void resumeConnections() {
+        while (!resumed.empty()) {
+            std::vector<int> fds;
+            fds.swap(resumed);
+            for (int fd : fds) {
+                auto it = connections.find(fd);
+                if (it != connections.end() && !responsePending(it->second.get())) {
+                    processInput(it->second.get());
+                }
+            }
+        }
     }
     
-    std::string generateSoapEnvelope(const std::string& body) {
-        return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-               "<SOAP-ENV:Envelope xmlns:SOAP-ENV=\"http://www.w3.org/2003/05/soap-envelope\" "
-               "xmlns:tds=\"http://www.onvif.org/ver10/device/wsdl\" "
-               "xmlns:trt=\"http://www.onvif.org/ver10/media/wsdl\" "
-               "xmlns:tptz=\"http://www.onvif.org/ver20/ptz/wsdl\">\n"
-               "<SOAP-ENV:Body>\n" + body + "</SOAP-ENV:Body>\n"
-               "</SOAP-ENV:Envelope>";
+    // First loop pass after stop(): stops accepting, answers parked pulls
+    // with what is queued and closes keep-alive connections that sit idle.
+    // Requests already being received or answered are finished with
+    // "Connection: close".
+    void beginDrain() {
+        drain_started = true;
+        if (!ring.isOpen()) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_socket, nullptr);
+        }
+        // Also ends a multishot accept still queued in the ring
+        shutdown(server_socket, SHUT_RDWR);
+        close(server_socket);
+        server_socket = -1;
+        if (tls_socket >= 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, tls_socket, nullptr);
+            close(tls_socket);
+            tls_socket = -1;
+        }
+        
+        std::vector<uint32_t> waiting(parked.begin(), parked.end());
+        for (uint32_t id : waiting) {
+            auto it = subscriptions.find(id);
+            if (it != subscriptions.end() && it->second->waiter) {
+                it->second->waiter->keep_alive = false;
+                completePull(it->second.get());
+            }
+        }
+        std::vector<Connection*> idle;
+        for (const auto& entry : connections) {
+            if (entry.second->in.empty() && !responsePending(entry.second.get())) {
+                idle.push_back(entry.second.get());
+            }
+        }
+        for (Connection* conn : idle) {
+            closeConnection(conn);
+        }
+        if (!connections.empty()) {
+            std::cout << "Draining " << connections.size() << " connections" << std::endl;
+        }
+        drain_timer.kind = TIMER_DRAIN;
+        timers.arm(&drain_timer, steadyMs(), drain_timeout_ms);
     }
     
-    std::string handleGetDeviceInformation() {
-        std::string body = "<tds:GetDeviceInformationResponse>\n"
-                          "<tds:Manufacturer>" + manufacturer + "</tds:Manufacturer>\n"
-                          "<tds:Model>" + model + "</tds:Model>\n"
-                          "<tds:FirmwareVersion>" + firmware_version + "</tds:FirmwareVersion>\n"
-                          "<tds:SerialNumber>" + serial_number + "</tds:SerialNumber>\n"
-                          "<tds:HardwareId>" + device_uuid + "</tds:HardwareId>\n"
-                          "</tds:GetDeviceInformationResponse>";
-        return generateSoapEnvelope(body);
-    }
-    
-    std::string handleGetCapabilities() {
-        std::string body = "<tds:GetCapabilitiesResponse>\n"
-                          "<tds:Capabilities>\n"
-                          "<tds:Device>\n"
-                          "<tds:XAddr>http://localhost:" + std::to_string(port) + "/onvif/device_service</tds:XAddr>\n"
-                          "<tds:Network>\n"
-                          "<tds:IPFilter>false</tds:IPFilter>\n"
-                          "<tds:ZeroConfiguration>false</tds:ZeroConfiguration>\n"
-                          "<tds:IPVersion6>false</tds:IPVersion6>\n"
-                          "<tds:DynDNS>false</tds:DynDNS>\n"
-                          "</tds:Network>\n"
-                          "<tds:System>\n"
-                          "<tds:DiscoveryResolve>false</tds:DiscoveryResolve>\n"
-                          "<tds:DiscoveryBye>false</tds:DiscoveryBye>\n"
-                          "<tds:RemoteDiscovery>false</tds:RemoteDiscovery>\n"
-                          "<tds:SystemBackup>false</tds:SystemBackup>\n"
-                          "<tds:SystemLogging>false</tds:SystemLogging>\n"
-                          "<tds:FirmwareUpgrade>false</tds:FirmwareUpgrade>\n"
-                          "</tds:System>\n"
-                          "<tds:IO>\n"
-                          "<tds:InputConnectors>0</tds:InputConnectors>\n"
-                          "<tds:RelayOutputs>0</tds:RelayOutputs>\n"
-                          "</tds:IO>\n"
-                          "<tds:Security>\n"
-                          "<tds:TLS1.1>false</tds:TLS1.1>\n"
-                          "<tds:TLS1.2>true</tds:TLS1.2>\n"
-                          "<tds:OnboardKeyGeneration>false</tds:OnboardKeyGeneration>\n"
-                          "<tds:AccessPolicyConfig>false</tds:AccessPolicyConfig>\n"
-                          "<tds:X.509Token>false</tds:X.509Token>\n"
-                          "<tds:SAMLToken>false</tds:SAMLToken>\n"
-                          "<tds:KerberosToken>false</tds:KerberosToken>\n"
-                          "<tds:RELToken>false</tds:RELToken>\n"
-                          "</tds:Security>\n"
-                          "</tds:Device>\n"
-                          "<tds:Media>\n"
-                          "<tds:XAddr>http://localhost:" + std::to_string(port) + "/onvif/media_service</tds:XAddr>\n"
-                          "<tds:StreamingCapabilities>\n"
-                          "<tds:RTPMulticast>false</tds:RTPMulticast>\n"
-                          "<tds:RTP_TCP>true</tds:RTP_TCP>\n"
-                          "<tds:RTP_RTSP_TCP>true</tds:RTP_RTSP_TCP>\n"
-                          "</tds:StreamingCapabilities>\n"
-                          "</tds:Media>\n"
-                          "<tds:PTZ>\n"
-                          "<tds:XAddr>http://localhost:" + std::to_string(port) + "/onvif/ptz_service</tds:XAddr>\n"
-                          "</tds:PTZ>\n"
-                          "</tds:Capabilities>\n"
-                          "</tds:GetCapabilitiesResponse>";
-        return generateSoapEnvelope(body);
-    }
-    
-    std::string handleGetProfiles() {
-        std::string profiles_xml;
-        for (const auto& profile : media_profiles) {
-            profiles_xml += "<trt:Profiles token=\"" + profile.token + "\" fixed=\"true\">\n"
-                           "<trt:Name>" + profile.name + "</trt:Name>\n"
-                           "<trt:VideoSourceConfiguration token=\"VideoSource_1\" fixed=\"true\">\n"
-                           "<trt:Name>VideoSourceConfig</trt:Name>\n"
-                           "<trt:UseCount>2</trt:UseCount>\n"
-                           "<trt:SourceToken>VideoSource_1</trt:SourceToken>\n"
-                           "<trt:Bounds x=\"0\" y=\"0\" width=\"" + std::to_string(profile.width) + "\" height=\"" + std::to_string(profile.height) + "\"/>\n"
-                           "</trt:VideoSourceConfiguration>\n"
-                           "<trt:VideoEncoderConfiguration token=\"" + profile.video_encoder_token + "\" fixed=\"true\">\n"
-                           "<trt:Name>VideoEncoderConfig</trt:Name>\n"
-                           "<trt:UseCount>1</trt:UseCount>\n"
-                           "<trt:Encoding>H264</trt:Encoding>\n"
-                           "<trt:Resolution>\n"
-                           "<trt:Width>" + std::to_string(profile.width) + "</trt:Width>\n"
-                           "<trt:Height>" + std::to_string(profile.height) + "</trt:Height>\n"
-                           "</trt:Resolution>\n"
-                           "<trt:Quality>1</trt:Quality>\n"
-                           "<trt:RateControl>\n"
-                           "<trt:FrameRateLimit>" + std::to_string(profile.framerate) + "</trt:FrameRateLimit>\n"
-                           "<trt:EncodingInterval>1</trt:EncodingInterval>\n"
-                           "<trt:BitrateLimit>" + std::to_string(profile.bitrate) + "</trt:BitrateLimit>\n"
-                           "</trt:RateControl>\n"
-                           "<trt:H264>\n"
-                           "<trt:GovLength>30</trt:GovLength>\n"
-                           "<trt:H264Profile>Baseline</trt:H264Profile>\n"
-                           "</trt:H264>\n"
-                           "</trt:VideoEncoderConfiguration>\n"
-                           "</trt:Profiles>\n";
-        }
-        
-        std::string body = "<trt:GetProfilesResponse>\n" + profiles_xml + "</trt:GetProfilesResponse>";
-        return generateSoapEnvelope(body);
-    }
-    
-    std::string handleGetStreamUri() {
-        std::string body = "<trt:GetStreamUriResponse>\n"
-                          "<trt:MediaUri>\n"
-                          "<trt:Uri>rtsp://localhost:" + std::to_string(port + 1) + "/stream1</trt:Uri>\n"
-                          "<trt:InvalidAfterConnect>false</trt:InvalidAfterConnect>\n"
-                          "<trt:InvalidAfterReboot>false</trt:InvalidAfterReboot>\n"
-                          "<trt:Timeout>PT60S</trt:Timeout>\n"
-                          "</trt:MediaUri>\n"
-                          "</trt:GetStreamUriResponse>";
-        return generateSoapEnvelope(body);
+    // Called after every loop pass
+    void checkDrain() {
+        if (draining && !drain_started) {
+            beginDrain();
+        }
+        if (drain_started && connections.empty()) {
+            running = false;
+        }
     }
     
-    std::string handleGetSystemDateAndTime() {
-        std::string current_time = getCurrentTime();
-        std::string body = "<tds:GetSystemDateAndTimeResponse>\n"
-                          "<tds:SystemDateAndTime>\n"
-                          "<tds:DateTimeType>Manual</tds:DateTimeType>\n"
-                          "<tds:DaylightSavings>false</tds:DaylightSavings>\n"
-                          "<tds:TimeZone>\n"
-                          "<tds:TZ>UTC</tds:TZ>\n"
-                          "</tds:TimeZone>\n"
-                          "<tds:UTCDateTime>\n"
-                          "<tds:Time>\n"
-                          "<tds:Hour>12</tds:Hour>\n"
-                          "<tds:Minute>0</tds:Minute>\n"
-                          "<tds:Second>0</tds:Second>\n"
-                          "</tds:Time>\n"
-                          "<tds:Date>\n"
-                          "<tds:Year>2024</tds:Year>\n"
-                          "<tds:Month>1</tds:Month>\n"
-                          "<tds:Day>1</tds:Day>\n"
-                          "</tds:Date>\n"
-                          "</tds:UTCDateTime>\n"
-                          "</tds:SystemDateAndTime>\n"
-                          "</tds:GetSystemDateAndTimeResponse>";
-        return generateSoapEnvelope(body);
+    void epollPass(std::vector<struct epoll_event>& events, int timeout_ms) {
+        loop_syscalls++;
+        int count = epoll_wait(epoll_fd, events.data(), events.size(), timeout_ms);
+        handleEpollEvents(events.data(), count);
+        timers.advance(steadyMs(), [this](TimerNode* node) { onTimer(node); });
+        resumeConnections();
+        checkDrain();
     }
     
-    std::string handlePTZGetConfigurations() {
-        std::string body = "<tptz:GetConfigurationsResponse>\n"
-                          "<tptz:PTZConfiguration token=\"PTZConfig_1\">\n"
-                          "<tptz:Name>PTZ Configuration</tptz:Name>\n"
-                          "<tptz:UseCount>1</tptz:UseCount>\n"
-                          "<tptz:NodeToken>PTZNode_1</tptz:NodeToken>\n"
-                          "<tptz:DefaultAbsolutePantTiltPositionSpace>http://www.onvif.org/ver10/tptz/PanTiltSpaces/PositionGenericSpace</tptz:DefaultAbsolutePantTiltPositionSpace>\n"
-                          "<tptz:DefaultAbsoluteZoomPositionSpace>http://www.onvif.org/ver10/tptz/ZoomSpaces/PositionGenericSpace</tptz:DefaultAbsoluteZoomPositionSpace>\n"
-                          "<tptz:DefaultRelativePanTiltTranslationSpace>http://www.onvif.org/ver10/tptz/PanTiltSpaces/TranslationGenericSpace</tptz:DefaultRelativePanTiltTranslationSpace>\n"
-                          "<tptz:DefaultRelativeZoomTranslationSpace>http://www.onvif.org/ver10/tptz/ZoomSpaces/TranslationGenericSpace</tptz:DefaultRelativeZoomTranslationSpace>\n"
-                          "<tptz:DefaultContinuousPanTiltVelocitySpace>http://www.onvif.org/ver10/tptz/PanTiltSpaces/VelocityGenericSpace</tptz:DefaultContinuousPanTiltVelocitySpace>\n"
-                          "<tptz:DefaultContinuousZoomVelocitySpace>http://www.onvif.org/ver10/tptz/ZoomSpaces/VelocityGenericSpace</tptz:DefaultContinuousZoomVelocitySpace>\n"
-                          "<tptz:DefaultPTZSpeed>\n"
-                          "<tptz:PanTilt x=\"1.0\" y=\"1.0\" space=\"http://www.onvif.org/ver10/tptz/PanTiltSpaces/GenericSpeedSpace\"/>\n"
-                          "<tptz:Zoom x=\"1.0\" space=\"http://www.onvif.org/ver10/tptz/ZoomSpaces/ZoomGenericSpeedSpace\"/>\n"
-                          "</tptz:DefaultPTZSpeed>\n"
-                          "<tptz:DefaultPTZTimeout>PT5S</tptz:DefaultPTZTimeout>\n"
-                          "<tptz:PanTiltLimits>\n"
-                          "<tptz:Range>\n"
-                          "<tptz:URI>http://www.onvif.org/ver10/tptz/PanTiltSpaces/PositionGenericSpace</tptz:URI>\n"
-                          "<tptz:XRange>\n"
-                          "<tptz:Min>-1.0</tptz:Min>\n"
-                          "<tptz:Max>1.0</tptz:Max>\n"
-                          "</tptz:XRange>\n"
-                          "<tptz:YRange>\n"
-                          "<tptz:Min>-1.0</tptz:Min>\n"
-                          "<tptz:Max>1.0</tptz:Max>\n"
-                          "</tptz:YRange>\n"
-                          "</tptz:Range>\n"
-                          "</tptz:PanTiltLimits>\n"
-                          "<tptz:ZoomLimits>\n"
-                          "<tptz:Range>\n"
-                          "<tptz:URI>http://www.onvif.org/ver10/tptz/ZoomSpaces/PositionGenericSpace</tptz:URI>\n"
-                          "<tptz:XRange>\n"
-                          "<tptz:Min>0.0</tptz:Min>\n"
-                          "<tptz:Max>1.0</tptz:Max>\n"
-                          "</tptz:XRange>\n"
-                          "</tptz:Range>\n"
-                          "</tptz:ZoomLimits>\n"
-                          "</tptz:PTZConfiguration>\n"
-                          "</tptz:GetConfigurationsResponse>";
-        return generateSoapEnvelope(body);
-    }
-    
-    std::string processRequest(const std::string& request) {
-        std::string response;
+    void runEpoll() {
+        std::vector<struct epoll_event> events(256);
+        while (running) {
+            epollPass(events, timers.timeoutMs(steadyMs()));
+        }
+    }
+    
+    // Sends queued by one pass over the completions are submitted together
+    // with the next wait, so a busy loop makes about one system call per
+    // batch of requests instead of several per request
+    void runRing() {
+        std::vector<struct epoll_event> events(256);
+        armAccept();
+        armEpoll();
+        while (running) {
+            ring.submitAndWait(timers.timeoutMs(steadyMs()));
+            ring.forEachCompletion([&](const struct io_uring_cqe& cqe) { handleCompletion(cqe, events); });
+            releaseRetired();
+            timers.advance(steadyMs(), [this](TimerNode* node) { onTimer(node); });
+            resumeConnections();
+            checkDrain();
+        }
+    }
+    
+    // Dual-stack: one IPv6 socket that also takes IPv4 clients as mapped
+    // addresses. Kernels without IPv6 get a plain IPv4 socket.
+    int openListener(int listen_port) {
+        int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        dual_stack = fd >= 0;
+        if (fd < 0) {
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        }
+        if (fd < 0) {
+            std::cerr << "Error creating socket" << std::endl;
+            return -1;
+        }
+        
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
         
-        if (request.find("GetDeviceInformation") != std::string::npos) {
-            response = handleGetDeviceInformation();
+        struct sockaddr_storage address = {};
+        socklen_t length;
+        if (dual_stack) {
+            int v6only = 0;
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+            auto& address6 = reinterpret_cast<struct sockaddr_in6&>(address);
+            address6.sin6_family = AF_INET6;
+            address6.sin6_addr = in6addr_any;
+            address6.sin6_port = htons(listen_port);
+            length = sizeof(address6);
+        } else {
+            auto& address4 = reinterpret_cast<struct sockaddr_in&>(address);
+            address4.sin_family = AF_INET;
+            address4.sin_addr.s_addr = INADDR_ANY;
+            address4.sin_port = htons(listen_port);
+            length = sizeof(address4);
         }
-        else if (request.find("GetCapabilities") != std::string::npos) {
-            response = handleGetCapabilities();
+        
+        if (bind(fd, reinterpret_cast<struct sockaddr*>(&address), length) < 0) {
+            std::cerr << "Bind failed" << std::endl;
+            close(fd);
+            return -1;
         }
-        else if (request.find("GetProfiles") != std::string::npos) {
-            response = handleGetProfiles();
+        
+        if (listen(fd, listen_backlog) < 0) {
+            std::cerr << "Listen failed" << std::endl;
+            close(fd);
+            return -1;
         }
-        else if (request.find("GetStreamUri") != std::string::npos) {
-            response = handleGetStreamUri();
+        return fd;
+    }
+    
+    static int localPort(int fd) {
+        struct sockaddr_storage address = {};
+        socklen_t length = sizeof(address);
+        if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&address), &length) < 0) {
+            return -1;
         }
-        else if (request.find("GetSystemDateAndTime") != std::string::npos) {
-            response = handleGetSystemDateAndTime();
+        return ntohs(socketPort(address));
+    }
+    
+    // Port in network order; sockaddr_in and sockaddr_in6 keep it in the same place
+    static in_port_t socketPort(const struct sockaddr_storage& address) {
+        return reinterpret_cast<const struct sockaddr_in&>(address).sin_port;
+    }
+    
+    static bool sameAddress(const struct sockaddr_storage& a, const struct sockaddr_storage& b) {
+        if (a.ss_family != b.ss_family || socketPort(a) != socketPort(b)) {
+            return false;
         }
-        else if (request.find("GetConfigurations") != std::string::npos) {
-            response = handlePTZGetConfigurations();
+        if (a.ss_family == AF_INET) {
+            return reinterpret_cast<const struct sockaddr_in&>(a).sin_addr.s_addr ==
+                   reinterpret_cast<const struct sockaddr_in&>(b).sin_addr.s_addr;
         }
-        else {
-            // Default error response
-            std::string body = "<SOAP-ENV:Fault>\n"
-                              "<SOAP-ENV:Code>\n"
-                              "<SOAP-ENV:Value>SOAP-ENV:Receiver</SOAP-ENV:Value>\n"
-                              "</SOAP-ENV:Code>\n"
-                              "<SOAP-ENV:Reason>\n"
-                              "<SOAP-ENV:Text>Method not implemented</SOAP-ENV:Text>\n"
-                              "</SOAP-ENV:Reason>\n"
-                              "</SOAP-ENV:Fault>";
-            response = generateSoapEnvelope(body);
+        const auto& a6 = reinterpret_cast<const struct sockaddr_in6&>(a);
+        const auto& b6 = reinterpret_cast<const struct sockaddr_in6&>(b);
+        return memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(a6.sin6_addr)) == 0 && a6.sin6_scope_id == b6.sin6_scope_id;
+    }
+    
+    // Address `conn` was accepted on, looked up once per connection
+    const LocalAddress& localAddress(Connection* conn) {
+        if (conn && conn->local_address < 0) {
+            struct sockaddr_storage address = {};
+            socklen_t length = sizeof(address);
+            conn->local_address = 0;
+            if (getsockname(conn->fd, reinterpret_cast<struct sockaddr*>(&address), &length) == 0) {
+                conn->local_address = internLocalAddress(address, conn->ssl != nullptr);
+            }
         }
-        
-        return response;
+        return local_addresses[conn ? conn->local_address : 0];
     }
     
-    void handleClient(int client_socket) {
-        char buffer[4096] = {0};
-        int bytes_read = read(client_socket, buffer, sizeof(buffer) - 1);
-        
-        if (bytes_read > 0) {
-            std::string request(buffer);
-            std::cout << "Received request:\n" << request << "\n\n";
-            
-            std::string soap_response = processRequest(request);
-            
-            std::string http_response = 
-                "HTTP/1.1 200 OK\r\n"
-                "Content-Type: application/soap+xml; charset=utf-8\r\n"
-                "Content-Length: " + std::to_string(soap_response.length()) + "\r\n"
-                "Connection: close\r\n"
-                "\r\n" + soap_response;
-            
-            send(client_socket, http_response.c_str(), http_response.length(), 0);
-            std::cout << "Sent response:\n" << http_response << "\n\n";
+    int internLocalAddress(const struct sockaddr_storage& address, bool tls) {
+        if (address.ss_family != AF_INET && address.ss_family != AF_INET6) {
+            return 0;
         }
-        
-        close(client_socket);
+        for (size_t i = 1; i < local_addresses.size(); i++) {
+            if (sameAddress(local_addresses[i].address, address)) {
+                return int(i);
+            }
+        }
+        char text[INET6_ADDRSTRLEN];
+        std::string host;
+        if (address.ss_family == AF_INET) {
+            inet_ntop(AF_INET, &reinterpret_cast<const struct sockaddr_in&>(address).sin_addr, text, sizeof(text));
+            host = text;
+        } else {
+            const auto& address6 = reinterpret_cast<const struct sockaddr_in6&>(address);
+            if (IN6_IS_ADDR_V4MAPPED(&address6.sin6_addr)) {
+                // An IPv4 client of the dual-stack listener
+                inet_ntop(AF_INET, address6.sin6_addr.s6_addr + 12, text, sizeof(text));
+                host = text;
+            } else {
+                inet_ntop(AF_INET6, &address6.sin6_addr, text, sizeof(text));
+                host = std::string("[") + text;
+                if (address6.sin6_scope_id != 0) {
+                    // Link-local: the zone goes into the URI as in RFC 6874
+                    char name[IF_NAMESIZE];
+                    host += "%25";
+                    host += if_indextoname(address6.sin6_scope_id, name) ? name : std::to_string(address6.sin6_scope_id);
+                }
+                host += "]";
+            }
+        }
+        std::string base = std::string(tls ? "https://" : "http://") + host + ":" + std::to_string(ntohs(socketPort(address)));
+        local_addresses.push_back({address, std::move(host), std::move(base)});
+        return int(local_addresses.size() - 1);
     }
-
+    
 public:
     bool start() {
-        server_socket = socket(AF_INET, SOCK_STREAM, 0);
+        server_socket = openListener(port);
         if (server_socket < 0) {
-            std::cerr << "Error creating socket" << std::endl;
             return false;
         }
+        if (tls_port >= 0) {
+            if (!tls.open(tls_certificate, tls_key)) {
+                std::cerr << "Error setting up TLS" << std::endl;
+                return false;
+            }
+            tls_socket = openListener(tls_port);
+            if (tls_socket < 0) {
+                return false;
+            }
+        }
+        local_addresses.clear();
+        local_addresses.push_back({{}, "localhost", "http://localhost:" + std::to_string(listeningPort())});
         
-        int opt = 1;
-        setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        
-        struct sockaddr_in address;
-        address.sin_family = AF_INET;
-        address.sin_addr.s_addr = INADDR_ANY;
-        address.sin_port = htons(port);
+        events.reset(new EventLog(event_backlog));
+        dispatched_end = events->end();
         
-        if (bind(server_socket, (struct sockaddr*)&address, sizeof(address)) < 0) {
-            std::cerr << "Bind failed" << std::endl;
-            close(server_socket);
+        if (!presets && !openPresetStore("")) {
+            std::cerr << "Error creating preset store" << std::endl;
             return false;
         }
         
-        if (listen(server_socket, 5) < 0) {
-            std::cerr << "Listen failed" << std::endl;
-            close(server_socket);
+        clock_timer.kind = TIMER_CLOCK;
+        timers.arm(&clock_timer, steadyMs(), clock.update());
+        
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd < 0 || wake_fd < 0) {
+            std::cerr << "Error creating event loop: " << strerror(errno) << std::endl;
             return false;
         }
         
+        if (io_backend == IO_URING && !ring.open(RING_ENTRIES, RING_BUFFERS, RING_BUFFER_SIZE)) {
+            std::cerr << "io_uring is not available, using epoll" << std::endl;
+        }
+        
+        for (int fd : {server_socket, tls_socket, wake_fd}) {
+            if ((fd == server_socket && ring.isOpen()) || fd < 0) {
+                continue;
+            }
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        }
+        
+        // Peers closing mid-response must not kill the process
+        signal(SIGPIPE, SIG_IGN);
+        
         running = true;
-        std::cout << "ONVIF Server started on port " << port << std::endl;
+        return true;
+    }
+    
+    // Port the server listens on, which start() picked when it was given 0
+    int listeningPort() const {
+        int bound = localPort(server_socket);
+        return bound < 0 ? port : bound;
+    }
+    
+    // HTTPS port, or -1 without TLS
+    int tlsListeningPort() const {
+        return tls_socket < 0 ? -1 : localPort(tls_socket);
+    }
+    
+    void printEndpoints() const {
+        std::cout << "ONVIF Server started on port " << port << (ring.isOpen() ? " (io_uring)" : "") << std::endl;
         std::cout << "Device Service: http://localhost:" << port << "/onvif/device_service" << std::endl;
         std::cout << "Media Service: http://localhost:" << port << "/onvif/media_service" << std::endl;
+        std::cout << "Media2 Service: http://localhost:" << port << "/onvif/media2_service" << std::endl;
         std::cout << "PTZ Service: http://localhost:" << port << "/onvif/ptz_service" << std::endl;
-        
-        return true;
+        std::cout << "Event Service: http://localhost:" << port << "/onvif/event_service" << std::endl;
+        std::cout << "Snapshots: http://localhost:" << port << "/snapshot/<profile token>" << std::endl;
+        if (tls_socket >= 0) {
+            std::cout << "HTTPS on port " << tlsListeningPort()
+                      << (tls_certificate.empty() ? " (self-signed certificate)" : "") << std::endl;
+        }
     }
     
+    // Single-threaded event loop: accepts, reads, answers and fires timers
+    // until stop() is called and the connections have drained
     void run() {
-        while (running) {
-            struct sockaddr_in client_address;
-            socklen_t client_len = sizeof(client_address);
+        if (ring.isOpen()) {
+            runRing();
+        } else {
+            runEpoll();
+        }
+        finish();
+    }
+    
+    // The epoll loop in steps, for driving several servers from one thread
+    // (see FleetRunner): once eventFd() is readable or timeoutMs() has
+    // passed, poll() handles what is due without blocking. It returns
+    // false once the server has stopped, after which finish() closes what
+    // is left.
+    int eventFd() const {
+        return epoll_fd;
+    }
+    
+    int timeoutMs() const {
+        return timers.timeoutMs(steadyMs());
+    }
+    
+    bool poll() {
+        if (running) {
+            if (poll_events.empty()) {
+                poll_events.resize(64);
+            }
+            epollPass(poll_events, 0);
+        }
+        return running;
+    }
+    
+    void finish() {
+        while (!connections.empty()) {
+            closeConnection(connections.begin()->second.get());
+        }
+        for (auto& entry : consumers) {
+            closeConsumer(entry.second.get());
+        }
+        // Let the ring finish closing sockets before the connections go
+        std::vector<struct epoll_event> no_events;
+        for (int wait = 0; !retired.empty() && wait < 100; wait++) {
+            ring.submitAndWait(10);
+            ring.forEachCompletion([&](const struct io_uring_cqe& cqe) {
+                if ((cqe.user_data & RING_OPERATION_MASK) > RING_EPOLL) {
+                    handleCompletion(cqe, no_events);
+                }
+            });
+            releaseRetired();
+        }
+    }
+    
+    // Starts a graceful shutdown; run() returns once in-flight requests
+    // were answered or the drain timeout passed. Safe from any thread.
+    void stop() {
+        draining = true;
+        wake();
+    }
+};
+
+// Synthetic event source for load-testing event consumers. One thread
+// schedules events for any number of servers (virtual devices) from
+// Poisson, bursty or replayed-trace arrival processes. Each source renders
+// its NotificationMessage once per state; publishing copies the template
+// into the event log and patches only the fixed-width UtcTime field.
+class EventGenerator {
+public:
+    enum Kind { MOTION, TAMPER, DIGITAL_INPUT };
+    enum Distribution { POISSON, BURSTY, TRACE };
+    
+    struct TraceEntry {
+        double offset;      // seconds from the start of the trace
+        Kind kind;
+        bool state;
+    };
+    
+private:
+    struct Template {
+        std::string topic;
+        std::string xml;
+        size_t time_offset;
+    };
+    
+    struct Source {
+        OnvifServer* server;
+        Distribution distribution;
+        double rate;            // mean events per second
+        int burst;              // events per burst
+        int burst_left = 0;
+        bool state = false;
+        Template templates[3][2];   // [kind][state]
+        Kind kind;
+        std::vector<TraceEntry> trace;
+        size_t trace_index = 0;
+        double trace_start = 0;
+    };
+    
+    struct Due {
+        double at;      // steady clock, microseconds
+        size_t source;
+        bool operator>(const Due& other) const {
+            return at > other.at;
+        }
+    };
+    
+    // Placeholder with the width of the rendered time
+    static constexpr const char* TIME_PLACEHOLDER = "0000-00-00T00:00:00.000Z";
+    static const size_t TIME_LENGTH = 24;
+    
+    std::vector<Source> sources;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> schedule;
+    std::mt19937_64 rng;
+    std::thread worker;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> published;
+    
+    // Wall clock rendering, re-formatted only when the second changes
+    int64_t wall_offset_us;
+    int64_t cached_second;
+    char cached_time[TIME_LENGTH + 1];
+    
+    static double nowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    static Template buildTemplate(Kind kind, bool state) {
+        static const char* topics[] = {
+            "tns1:VideoSource/MotionAlarm",
+            "tns1:VideoSource/GlobalSceneChange/ImagingService",
+            "tns1:Device/Trigger/DigitalInput"
+        };
+        static const char* sources[] = {
+            "<tt:SimpleItem Name=\"Source\" Value=\"VideoSource_1\"/>",
+            "<tt:SimpleItem Name=\"Source\" Value=\"VideoSource_1\"/>",
+            "<tt:SimpleItem Name=\"InputToken\" Value=\"DigitalInput_1\"/>"
+        };
+        static const char* items[] = {"State", "State", "LogicalState"};
+        
+        Template t;
+        t.topic = topics[kind];
+        std::string message = std::string("<tt:Message UtcTime=\"") + TIME_PLACEHOLDER + "\" PropertyOperation=\"Changed\">"
+                              "<tt:Source>" + sources[kind] + "</tt:Source>"
+                              "<tt:Data><tt:SimpleItem Name=\"" + items[kind] + "\" Value=\"" + (state ? "true" : "false") + "\"/></tt:Data>"
+                              "</tt:Message>";
+        t.xml = OnvifServer::renderNotification(t.topic, message);
+        t.time_offset = t.xml.find(TIME_PLACEHOLDER);
+        return t;
+    }
+    
+    const char* formatTime(double steady_us) {
+        int64_t wall_us = static_cast<int64_t>(steady_us) + wall_offset_us;
+        int64_t second = wall_us / 1000000;
+        if (second != cached_second) {
+            // CoarseClock's text with milliseconds spliced in before the Z
+            CoarseClock::format(second, cached_time);
+            memcpy(cached_time + CoarseClock::TEXT_LENGTH - 1, ".000Z", 5);
+            cached_second = second;
+        }
+        int millis = static_cast<int>((wall_us / 1000) % 1000);
+        cached_time[20] = '0' + millis / 100;
+        cached_time[21] = '0' + (millis / 10) % 10;
+        cached_time[22] = '0' + millis % 10;
+        return cached_time;
+    }
+    
+    double exponential(double rate) {
+        std::exponential_distribution<double> dist(rate);
+        return dist(rng) * 1e6;
+    }
+    
+    // Publishes the source's next event and returns when the one after is due
+    double fire(Source& source, double at) {
+        Kind kind = source.kind;
+        bool state;
+        if (source.distribution == TRACE) {
+            const TraceEntry& entry = source.trace[source.trace_index];
+            kind = entry.kind;
+            state = entry.state;
+        } else {
+            // Alternate so consumers see matching raise/clear pairs
+            source.state = !source.state;
+            state = source.state;
+        }
+        
+        const Template& t = source.templates[kind][state];
+        const char* time = formatTime(at);
+        EventLog* log = source.server->eventLog();
+        if (log && log->publish(t.topic.data(), t.topic.size(), t.xml.size(), [&](char* out) {
+                memcpy(out, t.xml.data(), t.xml.size());
+                memcpy(out + t.time_offset, time, TIME_LENGTH);
+            })) {
+            published.fetch_add(1, std::memory_order_relaxed);
+        }
+        
+        switch (source.distribution) {
+            case POISSON:
+                return at + exponential(source.rate);
+            case BURSTY:
+                // Bursts of `burst` events 1 ms apart, separated by idle gaps
+                // sized so the long-run mean stays at `rate`
+                if (--source.burst_left > 0) {
+                    return at + 1000;
+                }
+                source.burst_left = source.burst;
+                return at + exponential(source.rate / source.burst);
+            case TRACE: {
+                source.trace_index++;
+                if (source.trace_index == source.trace.size()) {
+                    // Loop the trace, keeping one second between repetitions
+                    source.trace_index = 0;
+                    source.trace_start += (source.trace.back().offset + 1.0) * 1e6;
+                }
+                return source.trace_start + source.trace[source.trace_index].offset * 1e6;
+            }
+        }
+        return at;
+    }
+    
+    void loop() {
+        std::vector<OnvifServer*> touched;
+        
+        while (running.load(std::memory_order_relaxed)) {
+            double now = nowUs();
+            touched.clear();
+            
+            while (!schedule.empty() && schedule.top().at <= now) {
+                Due due = schedule.top();
+                schedule.pop();
+                Source& source = sources[due.source];
+                due.at = fire(source, due.at);
+                schedule.push(due);
+                if (std::find(touched.begin(), touched.end(), source.server) == touched.end()) {
+                    touched.push_back(source.server);
+                }
+            }
+            
+            // One wakeup per server per batch instead of one per event
+            for (OnvifServer* server : touched) {
+                server->notifyEvents();
+            }
             
-            int client_socket = accept(server_socket, (struct sockaddr*)&client_address, &client_len);
-            if (client_socket >= 0) {
-                std::thread client_thread(&OnvifServer::handleClient, this, client_socket);
-                client_thread.detach();
+            // Batches are at least 1 ms apart so high rates coalesce
+            double next = schedule.empty() ? now + 100000 : std::max(schedule.top().at, now + 1000);
+            std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>(std::min(next - now, 100000.0))));
+        }
+    }
+    
+    Source makeSource(OnvifServer* server, Distribution distribution) {
+        Source source;
+        source.server = server;
+        source.distribution = distribution;
+        source.rate = 1;
+        source.burst = 1;
+        source.kind = MOTION;
+        for (int kind = 0; kind < 3; kind++) {
+            for (int state = 0; state < 2; state++) {
+                source.templates[kind][state] = buildTemplate(static_cast<Kind>(kind), state != 0);
+            }
+        }
+        return source;
+    }
+    
+public:
+    EventGenerator() : rng(std::random_device()()), running(false), published(0), cached_second(-1) {
+        auto wall = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        wall_offset_us = wall - static_cast<int64_t>(nowUs());
+        memset(cached_time, 0, sizeof(cached_time));
+    }
+    
+    ~EventGenerator() {
+        stop();
+    }
+    
+    // Random arrivals at `rate` events per second; with `burst` > 1 the
+    // events come in bursts of that size
+    void addSource(OnvifServer* server, Kind kind, Distribution distribution, double rate, int burst = 1) {
+        Source source = makeSource(server, distribution);
+        source.kind = kind;
+        source.rate = std::max(rate, 0.001);
+        source.burst = std::max(burst, 1);
+        source.burst_left = source.burst;
+        sources.push_back(source);
+    }
+    
+    void addTrace(OnvifServer* server, const std::vector<TraceEntry>& trace) {
+        if (trace.empty()) {
+            return;
+        }
+        Source source = makeSource(server, TRACE);
+        source.trace = trace;
+        sources.push_back(source);
+    }
+    
+    // Trace file lines: <seconds from start> <motion|tamper|io> <true|false>
+    static bool loadTrace(const std::string& path, std::vector<TraceEntry>& trace) {
+        std::ifstream file(path);
+        if (!file) {
+            return false;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            TraceEntry entry;
+            std::string kind, state;
+            if (line.empty() || line[0] == '#' || !(fields >> entry.offset >> kind >> state)) {
+                continue;
+            }
+            if (!parseKind(kind, entry.kind)) {
+                return false;
             }
+            entry.state = state == "true" || state == "1";
+            trace.push_back(entry);
         }
+        std::stable_sort(trace.begin(), trace.end(), [](const TraceEntry& a, const TraceEntry& b) {
+            return a.offset < b.offset;
+        });
+        return true;
+    }
+    
+    static bool parseKind(const std::string& name, Kind& kind) {
+        if (name == "motion") {
+            kind = MOTION;
+        } else if (name == "tamper") {
+            kind = TAMPER;
+        } else if (name == "io") {
+            kind = DIGITAL_INPUT;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    
+    void start() {
+        if (sources.empty() || running) {
+            return;
+        }
+        double now = nowUs();
+        for (size_t i = 0; i < sources.size(); i++) {
+            Source& source = sources[i];
+            double first = now;
+            if (source.distribution == TRACE) {
+                source.trace_start = now;
+                first = now + source.trace[0].offset * 1e6;
+            } else {
+                // Random phase so many devices do not fire in lockstep
+                first = now + exponential(source.rate);
+            }
+            schedule.push(Due{first, i});
+        }
+        running = true;
+        worker = std::thread(&EventGenerator::loop, this);
     }
     
     void stop() {
         running = false;
-        if (server_socket >= 0) {
-            close(server_socket);
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    
+    uint64_t publishedCount() const {
+        return published.load(std::memory_order_relaxed);
+    }
+};
+
+// Runs the servers of a simulated fleet on a few threads instead of one
+// each. A thread waits on the epoll descriptors of its servers and on the
+// earliest of their timer deadlines, then lets each server that is due
+// take a non-blocking pass.
+class FleetRunner {
+public:
+    void start(const std::vector<OnvifServer*>& servers, unsigned thread_count) {
+        thread_count = std::max(1u, std::min<unsigned>(thread_count, servers.size()));
+        std::vector<std::vector<OnvifServer*>> groups(thread_count);
+        for (size_t i = 0; i < servers.size(); i++) {
+            groups[i % thread_count].push_back(servers[i]);
+        }
+        for (auto& group : groups) {
+            threads.emplace_back(&FleetRunner::runGroup, std::move(group));
+        }
+    }
+    
+    void join() {
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+    
+private:
+    static void runGroup(std::vector<OnvifServer*> servers) {
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        for (uint32_t i = 0; i < servers.size(); i++) {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.u32 = i;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, servers[i]->eventFd(), &ev);
+        }
+        
+        // Deadlines by server. A server's entry is only replaced by an
+        // earlier one; a server that woke early takes a pass that does
+        // nothing and is scheduled again.
+        using Deadline = std::pair<uint64_t, uint32_t>;
+        std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> deadlines;
+        std::vector<uint64_t> scheduled(servers.size(), UINT64_MAX);
+        std::vector<bool> stopped(servers.size(), false);
+        size_t running = servers.size();
+        auto schedule = [&](uint32_t i) {
+            int timeout = servers[i]->timeoutMs();
+            uint64_t at = steadyMs() + timeout;
+            if (timeout >= 0 && at < scheduled[i]) {
+                scheduled[i] = at;
+                deadlines.push({at, i});
+            }
+        };
+        auto pass = [&](uint32_t i) {
+            if (stopped[i]) {
+                return;
+            }
+            if (!servers[i]->poll()) {
+                stopped[i] = true;
+                running--;
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, servers[i]->eventFd(), nullptr);
+                return;
+            }
+            schedule(i);
+        };
+        for (uint32_t i = 0; i < servers.size(); i++) {
+            schedule(i);
+        }
+        
+        std::vector<struct epoll_event> events(256);
+        while (running > 0) {
+            uint64_t now = steadyMs();
+            int wait = deadlines.empty() ? -1 : deadlines.top().first <= now ? 0 : int(deadlines.top().first - now);
+            int count = epoll_wait(epoll_fd, events.data(), events.size(), wait);
+            for (int k = 0; k < count; k++) {
+                pass(events[k].data.u32);
+            }
+            now = steadyMs();
+            while (!deadlines.empty() && deadlines.top().first <= now) {
+                Deadline due = deadlines.top();
+                deadlines.pop();
+                if (due.first == scheduled[due.second]) {
+                    scheduled[due.second] = UINT64_MAX;
+                    pass(due.second);
+                }
+            }
+        }
+        close(epoll_fd);
+        for (OnvifServer* server : servers) {
+            server->finish();
         }
     }
+    
+    std::vector<std::thread> threads;
 };
 
-int main() {
-    OnvifServer server(8080);
+// onvif_bench.cpp includes this file for its internals and brings its own main
+#ifndef ONVIF_SERVER_NO_MAIN
+int main(int argc, char* argv[]) {
+    int port = 8080;
+    bool verbose = false;
+    std::vector<std::string> snapshot_args;
+    std::vector<std::string> event_args;
+    std::vector<std::string> trace_args;
+    size_t event_backlog = 1024;
+    std::string preset_store;
+    OnvifServer::IoBackend io_backend = OnvifServer::IO_EPOLL;
+    double drain_timeout = 10;
+    size_t max_connections = 4096;
+    int listen_backlog = SOMAXCONN;
+    uint64_t rate_limit = 0;
+    uint64_t rate_burst = 0;
+    double header_timeout = 10;
+    double body_timeout = 30;
+    double idle_timeout = 60;
+    int https_port = -1;
+    std::string tls_certificate;
+    std::string tls_key;
+    int devices = 1;
+    int rtsp_port = -1;
+    
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            port = std::atoi(argv[++i]);
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            snapshot_args.push_back(argv[++i]);
+        } else if (arg == "--events" && i + 1 < argc) {
+            event_args.push_back(argv[++i]);
+        } else if (arg == "--event-trace" && i + 1 < argc) {
+            trace_args.push_back(argv[++i]);
+        } else if (arg == "--event-backlog" && i + 1 < argc) {
+            event_backlog = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--preset-store" && i + 1 < argc) {
+            preset_store = argv[++i];
+        } else if (arg == "--io-backend" && i + 1 < argc &&
+                   (std::strcmp(argv[i + 1], "epoll") == 0 || std::strcmp(argv[i + 1], "io_uring") == 0)) {
+            io_backend = std::strcmp(argv[++i], "io_uring") == 0 ? OnvifServer::IO_URING : OnvifServer::IO_EPOLL;
+        } else if (arg == "--drain-timeout" && i + 1 < argc) {
+            drain_timeout = std::atof(argv[++i]);
+        } else if (arg == "--max-connections" && i + 1 < argc) {
+            max_connections = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--listen-backlog" && i + 1 < argc) {
+            listen_backlog = std::atoi(argv[++i]);
+        } else if (arg == "--rate-limit" && i + 1 < argc) {
+            // <requests/s>[:<burst>]
+            char* end;
+            rate_limit = std::strtoul(argv[++i], &end, 10);
+            rate_burst = *end == ':' ? std::strtoul(end + 1, nullptr, 10) : rate_limit;
+        } else if (arg == "--header-timeout" && i + 1 < argc) {
+            header_timeout = std::atof(argv[++i]);
+        } else if (arg == "--body-timeout" && i + 1 < argc) {
+            body_timeout = std::atof(argv[++i]);
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            idle_timeout = std::atof(argv[++i]);
+        } else if (arg == "--https-port" && i + 1 < argc) {
+            https_port = std::atoi(argv[++i]);
+        } else if (arg == "--tls-cert" && i + 1 < argc) {
+            tls_certificate = argv[++i];
+        } else if (arg == "--tls-key" && i + 1 < argc) {
+            tls_key = argv[++i];
+        } else if (arg == "--devices" && i + 1 < argc) {
+            devices = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--rtsp-port" && i + 1 < argc) {
+            rtsp_port = std::atoi(argv[++i]);
+        } else if (arg == "--verbose") {
+            verbose = true;
+        } else {
+            std::cout << "Usage: " << argv[0] << " [options]" << std::endl;
+            std::cout << "Options:" << std::endl;
+            std::cout << "  --port <port>                 HTTP port (default: 8080)" << std::endl;
+            std::cout << "  --snapshot [<token>=]<file>   JPEG served as snapshot for one or all profiles" << std::endl;
+            std::cout << "  --events <kind>:<dist>:<rate>[:<burst>]" << std::endl;
+            std::cout << "                                Generate events; kind motion|tamper|io," << std::endl;
+            std::cout << "                                dist poisson|bursty, rate in events/s" << std::endl;
+            std::cout << "  --event-trace <file>          Replay events from a trace file" << std::endl;
+            std::cout << "  --event-backlog <n>           Events kept for subscribers (default: 1024)" << std::endl;
+            std::cout << "  --preset-store <file>         Keep PTZ presets and tours in a file" << std::endl;
+            std::cout << "  --io-backend epoll|io_uring   Socket I/O backend (default: epoll)" << std::endl;
+            std::cout << "  --drain-timeout <seconds>     Time given to in-flight requests on shutdown (default: 10)" << std::endl;
+            std::cout << "  --max-connections <n>         Concurrent clients before new ones get 503 (default: 4096)" << std::endl;
+            std::cout << "  --listen-backlog <n>          Pending connections queued by the kernel (default: SOMAXCONN)" << std::endl;
+            std::cout << "  --rate-limit <rate>[:<burst>] Requests/s allowed per client address (default: unlimited)" << std::endl;
+            std::cout << "  --header-timeout <seconds>    Time to send a request's headers (default: 10)" << std::endl;
+            std::cout << "  --body-timeout <seconds>      Time to send a request's body (default: 30)" << std::endl;
+            std::cout << "  --idle-timeout <seconds>      Keep-alive time between requests (default: 60)" << std::endl;
+            std::cout << "  --https-port <port>           Also serve HTTPS on this port" << std::endl;
+            std::cout << "  --tls-cert <file>             PEM certificate chain (default: self-signed)" << std::endl;
+            std::cout << "  --tls-key <file>              PEM private key (default: in the certificate file)" << std::endl;
+            std::cout << "  --devices <n>                 Simulate n devices on consecutive ports (default: 1)" << std::endl;
+            std::cout << "  --rtsp-port <port>            Port in stream URIs, per device (default: after the HTTP ports)" << std::endl;
+            std::cout << "  --verbose                     Log requests and responses" << std::endl;
+            return -1;
+        }
+    }
+    
+    OnvifServer server(port);
     
-    if (!server.start()) {
-        std::cerr << "Failed to start server" << std::endl;
+    // Device i takes port i of each range: HTTP, RTSP and HTTPS (unless
+    // the HTTPS port is picked by the kernel)
+    if (rtsp_port < 0) {
+        rtsp_port = port + devices;
+    }
+    std::vector<std::pair<const char*, int>> port_ranges = {{"--port", port}, {"--rtsp-port", rtsp_port}};
+    if (https_port > 0) {
+        port_ranges.emplace_back("--https-port", https_port);
+    }
+    if (devices > 1 && port == 0) {
+        std::cerr << "--devices needs a fixed --port" << std::endl;
+        return -1;
+    }
+    for (size_t a = 0; a < port_ranges.size(); a++) {
+        if (port_ranges[a].second < 0 || port_ranges[a].second + devices - 1 > 65535) {
+            std::cerr << port_ranges[a].first << " range " << port_ranges[a].second << "-"
+                      << port_ranges[a].second + devices - 1 << " is not a valid port range" << std::endl;
+            return -1;
+        }
+        for (size_t b = 0; b < a; b++) {
+            if (port_ranges[a].second < port_ranges[b].second + devices &&
+                port_ranges[b].second < port_ranges[a].second + devices) {
+                std::cerr << port_ranges[b].first << " and " << port_ranges[a].first << " ranges overlap for "
+                          << devices << " device" << (devices > 1 ? "s" : "") << std::endl;
+                return -1;
+            }
+        }
+    }
+    if (devices > 1 && io_backend == OnvifServer::IO_URING) {
+        std::cerr << "io_uring serves a single device; the devices share threads through epoll" << std::endl;
+        io_backend = OnvifServer::IO_EPOLL;
+    }
+    // A listener, an epoll and an eventfd per device, plus the clients
+    struct rlimit files;
+    if (devices > 1 && getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    // One table for the presets of every device, each under its index
+    auto presets = std::make_shared<PresetStore>();
+    if (!presets->open(preset_store)) {
+        std::cerr << "Could not open preset store " << preset_store << std::endl;
         return -1;
     }
+    // Settings shared by every simulated device; device `index` listens on
+    // port + index, rtsp_port + index and https_port + index
+    auto configure = [&](OnvifServer& device, int index) {
+        device.setVerbose(verbose);
+        // Events are only generated for the first device; the log of the
+        // others stays empty, so keep it small
+        device.setEventBacklog(index == 0 ? event_backlog : 16);
+        device.setIoBackend(io_backend);
+        auto ms = [](double seconds) { return static_cast<uint64_t>(std::max(0.0, seconds) * 1000); };
+        device.setDrainTimeout(ms(drain_timeout));
+        device.setMaxConnections(max_connections);
+        device.setListenBacklog(listen_backlog);
+        device.setRateLimit(rate_limit, rate_burst);
+        device.setConnectionTimeouts(ms(header_timeout), ms(body_timeout), ms(idle_timeout));
+        device.setRtspPort(rtsp_port + index);
+        if (https_port >= 0) {
+            device.setTls(https_port == 0 ? 0 : https_port + index, tls_certificate, tls_key);
+        }
+        if (index > 0) {
+            char uuid[64];
+            snprintf(uuid, sizeof(uuid), "urn:uuid:12345678-1234-1234-1234-%012d", index);
+            device.setIdentity("123456789-" + std::to_string(index), uuid);
+        }
+        device.setPresetStore(presets, index);
+    };
+    configure(server, 0);
+    
+    EventGenerator generator;
+    for (const auto& spec : event_args) {
+        // <kind>:<distribution>:<rate>[:<burst>]
+        std::vector<std::string> fields;
+        std::istringstream parts(spec);
+        std::string field;
+        while (std::getline(parts, field, ':')) {
+            fields.push_back(field);
+        }
+        EventGenerator::Kind kind;
+        if (fields.size() < 3 || !EventGenerator::parseKind(fields[0], kind) ||
+            (fields[1] != "poisson" && fields[1] != "bursty")) {
+            std::cerr << "Invalid event source " << spec << std::endl;
+            return -1;
+        }
+        int burst = fields.size() > 3 ? std::atoi(fields[3].c_str()) : (fields[1] == "bursty" ? 10 : 1);
+        generator.addSource(&server, kind, fields[1] == "bursty" ? EventGenerator::BURSTY : EventGenerator::POISSON,
+                            std::atof(fields[2].c_str()), burst);
+    }
+    for (const auto& path : trace_args) {
+        std::vector<EventGenerator::TraceEntry> trace;
+        if (!EventGenerator::loadTrace(path, trace)) {
+            std::cerr << "Could not read event trace " << path << std::endl;
+            return -1;
+        }
+        generator.addTrace(&server, trace);
+    }
+    
+    // The first device is `server`; the others answer requests and keep
+    // presets but have no event sources
+    std::vector<std::unique_ptr<OnvifServer>> fleet;
+    for (int i = 1; i < devices; i++) {
+        fleet.emplace_back(new OnvifServer(port + i));
+        configure(*fleet.back(), i);
+    }
+    std::vector<OnvifServer*> all_devices = {&server};
+    for (const auto& device : fleet) {
+        all_devices.push_back(device.get());
+    }
     
-    std::cout << "Press Enter to stop the server..." << std::endl;
+    for (const auto& snapshot : snapshot_args) {
+        size_t eq = snapshot.find('=');
+        std::vector<std::string> tokens = server.profileTokens();
+        std::string path = snapshot;
+        if (eq != std::string::npos) {
+            tokens.assign(1, snapshot.substr(0, eq));
+            path = snapshot.substr(eq + 1);
+        }
+        for (OnvifServer* device : all_devices) {
+            for (const auto& token : tokens) {
+                if (!device->loadSnapshotFile(token, path)) {
+                    std::cerr << "Could not read snapshot " << path << std::endl;
+                    return -1;
+                }
+            }
+        }
+    }
+    
+    for (OnvifServer* device : all_devices) {
+        if (!device->start()) {
+            std::cerr << "Failed to start server" << std::endl;
+            return -1;
+        }
+    }
+    server.printEndpoints();
+    if (devices > 1) {
+        std::cout << devices << " devices on ports " << port << "-" << port + devices - 1 << ", RTSP URIs on "
+                  << rtsp_port << "-" << rtsp_port + devices - 1;
+        if (https_port > 0) {
+            std::cout << ", HTTPS on " << https_port << "-" << https_port + devices - 1;
+        }
+        std::cout << std::endl;
+    }
+    
+    std::cout << "Press Enter or send SIGTERM to stop the server..." << std::endl;
     
-    // Start server in a separate thread
-    std::thread server_thread(&OnvifServer::run, &server);
+    // SIGTERM and SIGINT are taken from a signalfd; blocked before any
+    // thread starts so that every thread inherits the mask
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+    int signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+    
+    // A single device runs its own loop; a fleet shares one thread per core
+    std::thread server_thread;
+    FleetRunner fleet_runner;
+    if (devices == 1) {
+        server_thread = std::thread(&OnvifServer::run, &server);
+    } else {
+        fleet_runner.start(all_devices, std::thread::hardware_concurrency());
+    }
+    generator.start();
     
-    // Wait for user input to stop
-    std::cin.get();
+    // Wait for Enter (or end of input) or a stop signal
+    struct pollfd waits[2] = {{STDIN_FILENO, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+    while (poll(waits, signal_fd >= 0 ? 2 : 1, -1) < 0 && errno == EINTR) {
+    }
+    std::cout << "Stopping" << std::endl;
     
-    server.stop();
-    server_thread.join();
+    // Events stop first so nothing is published into a draining server;
+    // run() returns once the connections have drained
+    generator.stop();
+    for (OnvifServer* device : all_devices) {
+        device->stop();
+    }
+    if (server_thread.joinable()) {
+        server_thread.join();
+    }
+    fleet_runner.join();
     
+    if (signal_fd >= 0) {
+        close(signal_fd);
+    }
     std::cout << "Server stopped" << std::endl;
     return 0;
-}
\ No newline at end of file
+}
+#endif
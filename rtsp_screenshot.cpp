@@ -3,6 +3,364 @@
 #include <string>
 #include <chrono>
 #include <thread>
+#include <vector>
+#include <algorithm>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <functional>
+#include <memory>
+#include <unistd.h>
+
+// Timestamp used for screenshot filenames, e.g. 20250718_082128
+static std::string makeTimestamp() {
+    auto now = std::chrono::system_clock::now();
+    auto time_t = std::chrono::system_clock::to_time_t(now);
+    auto tm = *std::localtime(&time_t);
+    
+    char timestamp[100];
+    std::strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", &tm);
+    return std::string(timestamp);
+}
+
+// Filename without its extension. Dots in directory names and a leading
+// dot of the file name do not start an extension.
+static std::string stripExtension(const std::string& filename) {
+    size_t slash = filename.find_last_of('/');
+    size_t nameStart = slash == std::string::npos ? 0 : slash + 1;
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos || dot <= nameStart) {
+        return filename;
+    }
+    return filename.substr(0, dot);
+}
+
+// Motion detection settings. ROIs are normalized (0..1) rectangles relative to
+// the frame; an empty list means the whole frame is analyzed.
+struct MotionConfig {
+    int analysisWidth = 160;       // width of the downscaled analysis frame
+    double analysisFps = 5.0;      // frames analyzed per second
+    int pixelThreshold = 25;       // per-pixel difference to count as changed (0-255)
+    double minAreaRatio = 0.01;    // fraction of ROI pixels that must change
+    double learningRate = 0.05;    // background adaptation speed
+    int holdFrames = 5;            // quiet analysis frames before motion ends
+    std::vector<cv::Rect2f> rois;
+};
+
+// Frame differencing against a running-average background on a small
+// grayscale frame. All per-pixel work goes through OpenCV primitives
+// (resize, cvtColor, absdiff, threshold, countNonZero), which are vectorized,
+// and every buffer is reused between frames so steady state does not allocate.
+class MotionDetector {
+private:
+    MotionConfig config;
+    cv::Mat small;
+    cv::Mat gray;
+    cv::Mat background;     // CV_32F running average
+    cv::Mat background8u;
+    cv::Mat diff;
+    cv::Mat mask;           // 255 inside ROIs, 0 elsewhere
+    int maskArea = 0;
+    bool initialized = false;
+    
+    void buildMask(const cv::Size& size) {
+        if (config.rois.empty()) {
+            mask = cv::Mat(size, CV_8UC1, cv::Scalar(255));
+        } else {
+            mask = cv::Mat::zeros(size, CV_8UC1);
+            cv::Rect bounds(0, 0, size.width, size.height);
+            for (const auto& roi : config.rois) {
+                cv::Rect r(cvRound(roi.x * size.width), cvRound(roi.y * size.height),
+                           cvRound(roi.width * size.width), cvRound(roi.height * size.height));
+                r &= bounds;
+                if (r.area() > 0) {
+                    mask(r).setTo(cv::Scalar(255));
+                }
+            }
+        }
+        maskArea = cv::countNonZero(mask);
+    }
+    
+public:
+    MotionDetector(const MotionConfig& cfg) : config(cfg) {}
+    
+    // Returns the fraction of changed pixels inside the ROI mask
+    double process(const cv::Mat& frame) {
+        int width = std::min(config.analysisWidth, frame.cols);
+        int height = std::max(1, frame.rows * width / frame.cols);
+        
+        // Downscale first so color conversion touches as few pixels as possible
+        cv::resize(frame, small, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+        if (small.channels() == 3) {
+            cv::cvtColor(small, gray, cv::COLOR_BGR2GRAY);
+        } else {
+            small.copyTo(gray);
+        }
+        
+        if (!initialized || gray.size() != background.size()) {
+            gray.convertTo(background, CV_32F);
+            buildMask(gray.size());
+            initialized = true;
+            return 0.0;
+        }
+        
+        background.convertTo(background8u, CV_8U);
+        cv::absdiff(gray, background8u, diff);
+        cv::threshold(diff, diff, config.pixelThreshold, 255, cv::THRESH_BINARY);
+        cv::bitwise_and(diff, mask, diff);
+        
+        cv::accumulateWeighted(gray, background, config.learningRate);
+        
+        if (maskArea == 0) {
+            return 0.0;
+        }
+        return static_cast<double>(cv::countNonZero(diff)) / maskArea;
+    }
+    
+    bool isMotion(double ratio) const {
+        return ratio >= config.minAreaRatio;
+    }
+};
+
+// 64-bit difference hash (dHash): the frame is reduced to a 9x8 grayscale
+// thumbnail and each bit records whether a pixel is brighter than its right
+// neighbour. Near-identical frames differ in only a few bits, so the Hamming
+// distance between hashes measures how much the scene changed.
+class FrameHasher {
+private:
+    cv::Mat small;
+    cv::Mat gray;
+    
+public:
+    uint64_t dHash(const cv::Mat& frame) {
+        cv::resize(frame, small, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+        if (small.channels() == 3) {
+            cv::cvtColor(small, gray, cv::COLOR_BGR2GRAY);
+        } else {
+            small.copyTo(gray);
+        }
+        
+        uint64_t hash = 0;
+        for (int y = 0; y < 8; y++) {
+            const uint8_t* row = gray.ptr<uint8_t>(y);
+            for (int x = 0; x < 8; x++) {
+                hash = (hash << 1) | (row[x] > row[x + 1] ? 1 : 0);
+            }
+        }
+        return hash;
+    }
+    
+    static int distance(uint64_t a, uint64_t b) {
+        return __builtin_popcountll(a ^ b);
+    }
+};
+
+// Remembers the last stored snapshot hash per camera across runs so periodic
+// sweeps can skip (or hard link) frames of a static scene instead of writing
+// another JPEG. The database is a small text file with one tab-separated
+// <camera> <hash> <file> line per camera, so file names may hold spaces.
+class SnapshotDeduplicator {
+public:
+    enum Mode { SKIP, LINK };
+    
+private:
+    struct Entry {
+        uint64_t hash;
+        std::string filename;
+    };
+    
+    std::string dbPath;
+    Mode mode;
+    int threshold;
+    std::map<std::string, Entry> entries;
+    FrameHasher hasher;
+    bool duplicate = false;
+    std::string duplicateOf;
+    
+    void load() {
+        std::ifstream in(dbPath);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::string camera, hex, file;
+            size_t first = line.find('\t');
+            size_t second = first == std::string::npos ? std::string::npos : line.find('\t', first + 1);
+            if (second != std::string::npos) {
+                camera = line.substr(0, first);
+                hex = line.substr(first + 1, second - first - 1);
+                file = line.substr(second + 1);
+            } else {
+                // Space-separated line of an older database
+                std::istringstream fields(line);
+                if (!(fields >> camera >> hex >> file)) {
+                    continue;
+                }
+            }
+            if (camera.empty() || file.empty()) {
+                continue;
+            }
+            Entry entry;
+            entry.hash = std::strtoull(hex.c_str(), nullptr, 16);
+            entry.filename = file;
+            entries[camera] = entry;
+        }
+    }
+    
+    void save() {
+        std::string tmpPath = dbPath + ".tmp";
+        std::ofstream out(tmpPath, std::ios::trunc);
+        for (const auto& kv : entries) {
+            char hex[17];
+            std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(kv.second.hash));
+            out << kv.first << '\t' << hex << '\t' << kv.second.filename << "\n";
+        }
+        out.close();
+        std::rename(tmpPath.c_str(), dbPath.c_str());
+    }
+    
+public:
+    SnapshotDeduplicator(const std::string& path, Mode m, int maxDistance)
+        : dbPath(path), mode(m), threshold(maxDistance) {
+        load();
+    }
+    
+    // Writes the frame unless it duplicates the camera's previous snapshot.
+    // Returns false only if a file should have been written and was not.
+    bool store(const std::string& camera, const std::string& filename, const cv::Mat& frame) {
+        uint64_t hash = hasher.dHash(frame);
+        duplicate = false;
+        duplicateOf.clear();
+        
+        auto it = entries.find(camera);
+        if (it != entries.end()) {
+            int dist = FrameHasher::distance(hash, it->second.hash);
+            if (dist <= threshold) {
+                duplicate = true;
+                duplicateOf = it->second.filename;
+                if (mode == SKIP) {
+                    return true;
+                }
+                if (filename == it->second.filename) {
+                    return true;
+                }
+                unlink(filename.c_str());
+                if (link(it->second.filename.c_str(), filename.c_str()) == 0) {
+                    std::cout << "Duplicate of " << it->second.filename << " (distance " << dist << "), linked " << filename << std::endl;
+                    return true;
+                }
+                // Previous file is gone or on another filesystem, store a fresh copy
+                duplicate = false;
+            }
+        }
+        
+        if (!cv::imwrite(filename, frame)) {
+            return false;
+        }
+        Entry entry;
+        entry.hash = hash;
+        entry.filename = filename;
+        entries[camera] = entry;
+        save();
+        return true;
+    }
+    
+    bool wasDuplicate() const {
+        return duplicate;
+    }
+    
+    // The last frame duplicated an earlier snapshot and no file was written
+    bool wasSkipped() const {
+        return duplicate && mode == SKIP;
+    }
+    
+    // Snapshot the last frame duplicated
+    const std::string& previousFile() const {
+        return duplicateOf;
+    }
+};
+
+// Resized copies of a snapshot at several widths, built from the in-memory
+// frame instead of decoding the stored JPEG again. Levels are produced
+// largest first and each one is area-filtered from the previous level, so
+// the source frame is read once and later passes work on data that is
+// already small. The JPEG encodes are independent and run in parallel.
+// Frames are never scaled up: a level at least as wide as the frame holds
+// the frame at its own size, so every <prefix>_<width>.jpg exists.
+class ThumbnailPyramid {
+private:
+    std::vector<int> widths;    // descending
+    std::vector<cv::Mat> levels;
+    std::vector<std::vector<uchar>> encoded;
+    std::vector<int> encodeParams;
+    
+public:
+    ThumbnailPyramid(std::vector<int> levelWidths, int quality = 90) : widths(levelWidths) {
+        std::sort(widths.begin(), widths.end(), std::greater<int>());
+        widths.erase(std::unique(widths.begin(), widths.end()), widths.end());
+        levels.resize(widths.size());
+        encoded.resize(widths.size());
+        encodeParams.push_back(cv::IMWRITE_JPEG_QUALITY);
+        encodeParams.push_back(quality);
+    }
+    
+    bool empty() const {
+        return widths.empty();
+    }
+    
+    // Writes <prefix>_<width>.jpg for every level
+    bool write(const cv::Mat& frame, const std::string& prefix) {
+        const cv::Mat* source = &frame;
+        for (size_t i = 0; i < widths.size(); i++) {
+            int width = widths[i];
+            if (width >= source->cols) {
+                levels[i] = *source;
+            } else {
+                int height = std::max(1, (frame.rows * width + frame.cols / 2) / frame.cols);
+                cv::resize(*source, levels[i], cv::Size(width, height), 0, 0, cv::INTER_AREA);
+            }
+            source = &levels[i];
+        }
+        
+        std::vector<uchar> ok(widths.size(), 0);
+        cv::parallel_for_(cv::Range(0, static_cast<int>(widths.size())), [&](const cv::Range& range) {
+            for (int i = range.start; i < range.end; i++) {
+                ok[i] = cv::imencode(".jpg", levels[i], encoded[i], encodeParams) ? 1 : 0;
+            }
+        });
+        
+        bool success = true;
+        for (size_t i = 0; i < widths.size(); i++) {
+            std::string filename = prefix + "_" + std::to_string(widths[i]) + ".jpg";
+            // May be a hard link to an older snapshot's thumbnail
+            unlink(filename.c_str());
+            std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+            if (!ok[i] || !out.write(reinterpret_cast<const char*>(encoded[i].data()), encoded[i].size())) {
+                std::cerr << "Error: Could not save thumbnail " << filename << std::endl;
+                success = false;
+            }
+        }
+        return success;
+    }
+    
+    // Hard links the thumbnails of the snapshot at `from` to `prefix`, for a
+    // snapshot that is itself a link. Fails if any of them is missing.
+    bool link(const std::string& from, const std::string& prefix) const {
+        if (from == prefix) {
+            return true;
+        }
+        for (int width : widths) {
+            std::string suffix = "_" + std::to_string(width) + ".jpg";
+            unlink((prefix + suffix).c_str());
+            if (::link((from + suffix).c_str(), (prefix + suffix).c_str()) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
 
 class RTSPScreenshot {
 private:
@@ -10,6 +368,43 @@ private:
     std::string rtspUrl;
     std::string username;
     std::string password;
+    SnapshotDeduplicator* dedup = nullptr;
+    ThumbnailPyramid* pyramid = nullptr;
+    
+    // Camera identity for deduplication, with any inline credentials removed
+    std::string cameraKey() const {
+        std::string key = rtspUrl;
+        size_t protocolEnd = key.find("://");
+        size_t at = key.find('@');
+        if (protocolEnd != std::string::npos && at != std::string::npos && at > protocolEnd) {
+            key.erase(protocolEnd + 3, at - protocolEnd - 2);
+        }
+        return key;
+    }
+    
+    // Stores the frame and its thumbnails. A skipped duplicate writes
+    // neither; a linked one links the previous snapshot's thumbnails,
+    // falling back to writing them if they are gone.
+    bool saveFrame(const std::string& filename, const cv::Mat& frame) {
+        bool saved;
+        if (dedup) {
+            saved = dedup->store(cameraKey(), filename, frame);
+            if (!saved || dedup->wasSkipped()) {
+                return saved;
+            }
+            if (dedup->wasDuplicate() && pyramid &&
+                pyramid->link(stripExtension(dedup->previousFile()), stripExtension(filename))) {
+                return true;
+            }
+        } else {
+            saved = cv::imwrite(filename, frame);
+        }
+        
+        if (saved && pyramid) {
+            saved = pyramid->write(frame, stripExtension(filename));
+        }
+        return saved;
+    }
     
 public:
     RTSPScreenshot(const std::string& url) : rtspUrl(url) {}
@@ -17,6 +412,14 @@ public:
     RTSPScreenshot(const std::string& url, const std::string& user, const std::string& pass) 
         : rtspUrl(url), username(user), password(pass) {}
     
+    void setDeduplicator(SnapshotDeduplicator* d) {
+        dedup = d;
+    }
+    
+    void setPyramid(ThumbnailPyramid* p) {
+        pyramid = p;
+    }
+    
     bool connect() {
         std::string finalUrl = rtspUrl;
         
@@ -75,7 +478,11 @@ public:
         }
         
         // Save the screenshot
-        if (cv::imwrite(filename, frame)) {
+        if (saveFrame(filename, frame)) {
+            if (dedup && dedup->wasSkipped()) {
+                std::cout << "Screenshot not saved, duplicate of " << dedup->previousFile() << std::endl;
+                return true;
+            }
             std::cout << "Screenshot saved successfully: " << filename << std::endl;
             std::cout << "Image size: " << frame.cols << "x" << frame.rows << std::endl;
             return true;
@@ -108,14 +515,7 @@ public:
                 break;
             } else if (key == 's' || key == 'S') {
                 // Generate timestamp-based filename
-                auto now = std::chrono::system_clock::now();
-                auto time_t = std::chrono::system_clock::to_time_t(now);
-                auto tm = *std::localtime(&time_t);
-                
-                char timestamp[100];
-                std::strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", &tm);
-                
-                std::string filename = "screenshot_" + std::string(timestamp) + ".jpg";
+                std::string filename = "screenshot_" + makeTimestamp() + ".jpg";
                 cv::imwrite(filename, frame);
                 std::cout << "Screenshot saved: " << filename << std::endl;
             }
@@ -124,6 +524,67 @@ public:
         cv::destroyAllWindows();
     }
     
+    // Analyze the stream at a reduced rate and only save snapshots when motion
+    // is detected. Frames between analysis points are grabbed but not decoded
+    // into BGR, which keeps the per-stream cost low.
+    void watchMotion(const MotionConfig& config, const std::string& prefix) {
+        if (!cap.isOpened()) {
+            std::cerr << "Error: RTSP stream is not open!" << std::endl;
+            return;
+        }
+        
+        MotionDetector detector(config);
+        cv::Mat frame;
+        auto interval = std::chrono::microseconds(static_cast<long long>(1000000.0 / config.analysisFps));
+        auto nextAnalysis = std::chrono::steady_clock::now();
+        bool inMotion = false;
+        int quietFrames = 0;
+        
+        std::cout << "Watching for motion at " << config.analysisFps << " fps. Press Ctrl+C to stop." << std::endl;
+        
+        while (true) {
+            if (!cap.grab()) {
+                std::cerr << "Error: Could not grab frame from stream!" << std::endl;
+                break;
+            }
+            
+            auto now = std::chrono::steady_clock::now();
+            if (now < nextAnalysis) {
+                continue;
+            }
+            nextAnalysis += interval;
+            if (nextAnalysis < now) {
+                nextAnalysis = now + interval;
+            }
+            
+            if (!cap.retrieve(frame) || frame.empty()) {
+                continue;
+            }
+            
+            double ratio = detector.process(frame);
+            if (detector.isMotion(ratio)) {
+                quietFrames = 0;
+                if (!inMotion) {
+                    inMotion = true;
+                    std::string timestamp = makeTimestamp();
+                    std::string filename = prefix + "_" + timestamp + ".jpg";
+                    bool saved = saveFrame(filename, frame);
+                    std::cout << "MOTION_START " << timestamp << " ratio=" << ratio;
+                    if (!saved) {
+                        std::cout << " snapshot_failed=" << filename << std::endl;
+                    } else if (dedup && dedup->wasSkipped()) {
+                        std::cout << " duplicate=" << dedup->previousFile() << std::endl;
+                    } else {
+                        std::cout << " snapshot=" << filename << std::endl;
+                    }
+                }
+            } else if (inMotion && ++quietFrames >= config.holdFrames) {
+                inMotion = false;
+                std::cout << "MOTION_END " << makeTimestamp() << std::endl;
+            }
+        }
+    }
+    
     void disconnect() {
         if (cap.isOpened()) {
             cap.release();
@@ -142,6 +603,12 @@ int main(int argc, char* argv[]) {
     std::string username;
     std::string password;
     bool displayMode = false;
+    bool motionMode = false;
+    MotionConfig motionConfig;
+    std::string dedupMode;
+    std::string dedupDb = ".rtsp_screenshot_hashes";
+    int dedupThreshold = 5;
+    std::vector<int> pyramidWidths;
     
     // Parse command line arguments
     if (argc < 2) {
@@ -151,12 +618,23 @@ int main(int argc, char* argv[]) {
         std::cout << "  --pass <password>     RTSP password" << std::endl;
         std::cout << "  --output <filename>   Output filename (default: screenshot.jpg)" << std::endl;
         std::cout << "  --display            Interactive display mode" << std::endl;
+        std::cout << "  --motion             Save snapshots only when motion is detected" << std::endl;
+        std::cout << "  --motion-fps <n>      Analysis frame rate (default: 5)" << std::endl;
+        std::cout << "  --motion-width <n>    Analysis frame width (default: 160)" << std::endl;
+        std::cout << "  --motion-threshold <n> Per-pixel difference threshold 0-255 (default: 25)" << std::endl;
+        std::cout << "  --motion-area <f>     Changed fraction of ROI to trigger, (0, 1] (default: 0.01)" << std::endl;
+        std::cout << "  --roi <x,y,w,h>       Normalized region of interest, repeatable" << std::endl;
+        std::cout << "  --dedup <skip|link>   Skip or hard link snapshots matching the previous one" << std::endl;
+        std::cout << "  --dedup-threshold <n> Max hash distance 0-64 for a duplicate (default: 5)" << std::endl;
+        std::cout << "  --dedup-db <file>     Hash database (default: .rtsp_screenshot_hashes)" << std::endl;
+        std::cout << "  --pyramid <w1,w2,..>  Also write resized copies at these widths" << std::endl;
         std::cout << std::endl;
         std::cout << "Examples:" << std::endl;
         std::cout << "  " << argv[0] << " rtsp://192.168.1.100:554/stream" << std::endl;
         std::cout << "  " << argv[0] << " rtsp://192.168.1.100:554/stream --user admin --pass 123456" << std::endl;
         std::cout << "  " << argv[0] << " rtsp://192.168.1.100:554/stream --user admin --pass 123456 --output camera1.png" << std::endl;
         std::cout << "  " << argv[0] << " rtsp://192.168.1.100:554/stream --user admin --pass 123456 --display" << std::endl;
+        std::cout << "  " << argv[0] << " rtsp://192.168.1.100:554/stream --motion --roi 0.5,0,0.5,1" << std::endl;
         return -1;
     }
     
@@ -173,12 +651,72 @@ int main(int argc, char* argv[]) {
             outputFile = argv[++i];
         } else if (arg == "--display") {
             displayMode = true;
+        } else if (arg == "--motion") {
+            motionMode = true;
+        } else if (arg == "--motion-fps" && i + 1 < argc) {
+            motionConfig.analysisFps = std::max(0.1, std::atof(argv[++i]));
+        } else if (arg == "--motion-width" && i + 1 < argc) {
+            motionConfig.analysisWidth = std::max(16, std::atoi(argv[++i]));
+        } else if (arg == "--motion-threshold" && i + 1 < argc) {
+            motionConfig.pixelThreshold = std::min(255, std::max(0, std::atoi(argv[++i])));
+        } else if (arg == "--motion-area" && i + 1 < argc) {
+            motionConfig.minAreaRatio = std::atof(argv[++i]);
+            if (!(motionConfig.minAreaRatio > 0 && motionConfig.minAreaRatio <= 1)) {
+                std::cerr << "Error: --motion-area expects a fraction in (0, 1]" << std::endl;
+                return -1;
+            }
+        } else if (arg == "--roi" && i + 1 < argc) {
+            float x, y, w, h;
+            if (std::sscanf(argv[++i], "%f,%f,%f,%f", &x, &y, &w, &h) == 4) {
+                motionConfig.rois.push_back(cv::Rect2f(x, y, w, h));
+            } else {
+                std::cerr << "Error: Invalid ROI, expected x,y,w,h" << std::endl;
+                return -1;
+            }
+        } else if (arg == "--dedup" && i + 1 < argc) {
+            dedupMode = argv[++i];
+            if (dedupMode != "skip" && dedupMode != "link") {
+                std::cerr << "Error: --dedup expects skip or link" << std::endl;
+                return -1;
+            }
+        } else if (arg == "--dedup-threshold" && i + 1 < argc) {
+            dedupThreshold = std::atoi(argv[++i]);
+        } else if (arg == "--dedup-db" && i + 1 < argc) {
+            dedupDb = argv[++i];
+        } else if (arg == "--pyramid" && i + 1 < argc) {
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start < list.size()) {
+                size_t end = list.find(',', start);
+                if (end == std::string::npos) {
+                    end = list.size();
+                }
+                int width = std::atoi(list.substr(start, end - start).c_str());
+                if (width > 0) {
+                    pyramidWidths.push_back(width);
+                }
+                start = end + 1;
+            }
         }
     }
     
     // Create RTSP screenshot object
     RTSPScreenshot rtspCapture(rtspUrl, username, password);
     
+    std::unique_ptr<SnapshotDeduplicator> dedup;
+    if (!dedupMode.empty()) {
+        dedup.reset(new SnapshotDeduplicator(dedupDb,
+            dedupMode == "link" ? SnapshotDeduplicator::LINK : SnapshotDeduplicator::SKIP,
+            dedupThreshold));
+        rtspCapture.setDeduplicator(dedup.get());
+    }
+    
+    std::unique_ptr<ThumbnailPyramid> pyramid;
+    if (!pyramidWidths.empty()) {
+        pyramid.reset(new ThumbnailPyramid(pyramidWidths));
+        rtspCapture.setPyramid(pyramid.get());
+    }
+    
     // Connect to the stream
     if (!rtspCapture.connect()) {
         return -1;
@@ -187,6 +725,10 @@ int main(int argc, char* argv[]) {
     if (displayMode) {
         // Display stream with interactive screenshot capability
         rtspCapture.displayStream();
+    } else if (motionMode) {
+        // Snapshots are named <output without extension>_<timestamp>.jpg
+        std::string prefix = stripExtension(outputFile);
+        rtspCapture.watchMotion(motionConfig, prefix);
     } else {
         // Capture a single screenshot
         if (!rtspCapture.captureScreenshot(outputFile)) {